@@ -0,0 +1,73 @@
+#!/usr/bin/env python3
+"""Compares two earthquake_bench result files and flags regressions.
+
+    earthquake_bench --benchmark_repetitions=5 --benchmark_out=baseline.json
+    ... change and rebuild ...
+    earthquake_bench --benchmark_repetitions=5 --benchmark_out=candidate.json
+    bench/compare.py baseline.json candidate.json
+
+Benchmarks are compared by their median when repetitions were run and by
+their single result otherwise. The exit status is 1 if any benchmark present
+in both files got slower by more than --threshold percent.
+"""
+
+import argparse
+import json
+import sys
+
+
+def load(path):
+    with open(path) as f:
+        benchmarks = json.load(f)["benchmarks"]
+    results = {}
+    medians = {}
+    for run in benchmarks:
+        name = run.get("run_name", run["name"])
+        if run.get("run_type") == "aggregate":
+            if run.get("aggregate_name") == "median":
+                medians[name] = run
+        elif name not in results:
+            results[name] = run
+    results.update(medians)
+    return results
+
+
+def seconds(run):
+    scale = {"ns": 1e-9, "us": 1e-6, "ms": 1e-3, "s": 1.0}[run.get("time_unit", "ns")]
+    return run["real_time"] * scale
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("baseline")
+    parser.add_argument("candidate")
+    parser.add_argument("--threshold", type=float, default=10.0,
+                        help="slowdown in percent that counts as a regression (default 10)")
+    args = parser.parse_args()
+
+    baseline = load(args.baseline)
+    candidate = load(args.candidate)
+    regressions = 0
+    width = max((len(name) for name in baseline if name in candidate), default=9)
+    print(f"{'benchmark':<{width}}  {'baseline':>12}  {'candidate':>12}  {'change':>8}")
+    for name, before in baseline.items():
+        after = candidate.get(name)
+        if after is None:
+            continue
+        old, new = seconds(before), seconds(after)
+        change = (new - old) / old * 100.0 if old > 0 else 0.0
+        flag = ""
+        if change > args.threshold:
+            flag = "  REGRESSION"
+            regressions += 1
+        print(f"{name:<{width}}  {old * 1e3:>10.3f}ms  {new * 1e3:>10.3f}ms  {change:>+7.1f}%{flag}")
+    for name in sorted(set(baseline) ^ set(candidate)):
+        print(f"{name}: only in {'baseline' if name in baseline else 'candidate'}")
+    if regressions:
+        print(f"{regressions} benchmark(s) slower by more than {args.threshold:g}%")
+        return 1
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,379 @@
+// Micro and macro benchmarks of the pipeline stages over fixed corpora.
+//
+// Corpora: all_hour and escapes are checked in under bench/corpus; all_day,
+// all_month and large are generated at startup by a seeded generator that
+// does not depend on the standard library's distributions, so every
+// machine benchmarks the same bytes. large has EARTHQUAKE_BENCH_LARGE_FEATURES
+// features (1,000,000 by default) and is only built when a benchmark that
+// uses it is selected.
+//
+// Throughput is reported as bytes_per_second (MB/s of input) and
+// records_per_second. bench/compare.py compares two --benchmark_out files.
+
+#include "aggregate_state.hpp"
+#include "csv_writer.hpp"
+#include "feed_records.hpp"
+#include "iso8601.hpp"
+#include "json.hpp"
+#include "record_batch.hpp"
+#include "reports.hpp"
+#include "thread_pool.hpp"
+
+#include <benchmark/benchmark.h>
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#ifndef EARTHQUAKE_BENCH_CORPUS_DIR
+#define EARTHQUAKE_BENCH_CORPUS_DIR "bench/corpus"
+#endif
+
+namespace {
+
+using columnar::RecordBatch;
+
+// splitmix64: a fixed sequence on every platform.
+class Random {
+public:
+    explicit Random(uint64_t seed) : state_(seed) {}
+
+    uint64_t next() {
+        uint64_t z = (state_ += 0x9E3779B97F4A7C15ull);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+        return z ^ (z >> 31);
+    }
+
+    // Uniform in [low, high).
+    double uniform(double low, double high) {
+        return low + (high - low) * static_cast<double>(next() >> 11) * (1.0 / 9007199254740992.0);
+    }
+
+    size_t below(size_t bound) { return static_cast<size_t>(next() % bound); }
+
+private:
+    uint64_t state_;
+};
+
+void append_fixed(std::string &out, double value, int decimals) {
+    char buffer[64];
+    int length = std::snprintf(buffer, sizeof(buffer), "%.*f", decimals, value);
+    out.append(buffer, static_cast<size_t>(length));
+}
+
+// A FeatureCollection in the shape of the USGS summary feeds, with every
+// property the real feeds carry, so that skipping unused members costs
+// what it does in production.
+std::string generate_feed(size_t features, uint64_t seed) {
+    static const char *const kPlaces[] = {
+        "10 km NE of Ridgecrest, CA",  "3 km WSW of Cobb, CA",      "Southern Alaska",
+        "12 km SSE of Volcano, Hawaii", "Puerto Rico region",       "22 km W of Tonopah, Nevada",
+        "Mid-Atlantic Ridge",           "Kepulauan Talaud, Indonesia", "8 km N of Anza, CA",
+        "south of the Fiji Islands",
+    };
+    static const char *const kNets[] = {"ci", "nc", "ak", "hv", "us", "nn", "pr", "uw"};
+    Random random(seed);
+    const int64_t start_ms = 1791950400000;
+    std::string out = "{\"type\":\"FeatureCollection\",\"metadata\":{\"generated\":1791954000000,"
+                      "\"url\":\"https://earthquake.usgs.gov/earthquakes/feed/v1.0/summary/all_day.geojson\","
+                      "\"title\":\"USGS All Earthquakes\",\"status\":200,\"api\":\"1.14.1\",\"count\":";
+    out += std::to_string(features);
+    out += "},\"features\":[";
+    out.reserve(features * 1100);
+    for (size_t i = 0; i < features; ++i) {
+        const char *net = kNets[random.below(std::size(kNets))];
+        const char *place = kPlaces[random.below(std::size(kPlaces))];
+        std::string id = std::string(net) + std::to_string(70000000 + i);
+        int64_t time_ms = start_ms - static_cast<int64_t>(random.below(30ull * 24 * 3600 * 1000));
+        double magnitude = random.uniform(-0.5, 7.5);
+        if (i != 0) {
+            out += ',';
+        }
+        out += "{\"type\":\"Feature\",\"properties\":{\"mag\":";
+        append_fixed(out, magnitude, 2);
+        out += ",\"place\":\"";
+        out += place;
+        out += "\",\"time\":" + std::to_string(time_ms);
+        out += ",\"updated\":" + std::to_string(time_ms + static_cast<int64_t>(random.below(3600000)));
+        out += ",\"tz\":null,\"url\":\"https://earthquake.usgs.gov/earthquakes/eventpage/" + id;
+        out += "\",\"detail\":\"https://earthquake.usgs.gov/earthquakes/feed/v1.0/detail/" + id;
+        out += ".geojson\",\"felt\":null,\"cdi\":null,\"mmi\":null,\"alert\":null,\"status\":\"automatic\","
+               "\"tsunami\":0,\"sig\":" + std::to_string(random.below(900));
+        out += ",\"net\":\"";
+        out += net;
+        out += "\",\"code\":\"" + std::to_string(70000000 + i);
+        out += "\",\"ids\":\"," + id + ",\",\"sources\":\",";
+        out += net;
+        out += ",\",\"types\":\",nearby-cities,origin,phase-data,\",\"nst\":" + std::to_string(random.below(80));
+        out += ",\"dmin\":";
+        append_fixed(out, random.uniform(0.0, 2.0), 4);
+        out += ",\"rms\":";
+        append_fixed(out, random.uniform(0.0, 1.0), 3);
+        out += ",\"gap\":" + std::to_string(random.below(300));
+        out += ",\"magType\":\"ml\",\"type\":\"earthquake\",\"title\":\"M ";
+        append_fixed(out, magnitude, 1);
+        out += " - ";
+        out += place;
+        out += "\"},\"geometry\":{\"type\":\"Point\",\"coordinates\":[";
+        append_fixed(out, random.uniform(-180.0, 180.0), 4);
+        out += ',';
+        append_fixed(out, random.uniform(-85.0, 85.0), 4);
+        out += ',';
+        append_fixed(out, random.uniform(0.0, 650.0), 2);
+        out += "]},\"id\":\"" + id + "\"}";
+    }
+    out += "],\"bbox\":[-180,-85,0,180,85,650]}";
+    return out;
+}
+
+std::string read_corpus_file(const std::string &name) {
+    std::filesystem::path path = std::filesystem::path(EARTHQUAKE_BENCH_CORPUS_DIR) / name;
+    std::ifstream in(path, std::ios::binary);
+    if (!in) {
+        throw std::runtime_error("Missing benchmark corpus " + path.string());
+    }
+    return std::string((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+}
+
+size_t large_features() {
+    const char *configured = std::getenv("EARTHQUAKE_BENCH_LARGE_FEATURES");
+    return configured ? static_cast<size_t>(std::strtoull(configured, nullptr, 10)) : 1000000;
+}
+
+// A corpus document and its parsed records, built on first use.
+struct Corpus {
+    std::string document;
+    RecordBatch records;
+};
+
+const Corpus &corpus(const std::string &name) {
+    static std::map<std::string, Corpus> corpora;
+    auto it = corpora.find(name);
+    if (it != corpora.end()) {
+        return it->second;
+    }
+    Corpus loaded;
+    if (name == "all_hour" || name == "escapes") {
+        loaded.document = read_corpus_file(name + ".geojson");
+    } else if (name == "all_day") {
+        loaded.document = generate_feed(300, 1);
+    } else if (name == "all_month") {
+        loaded.document = generate_feed(10000, 2);
+    } else if (name == "large") {
+        loaded.document = generate_feed(large_features(), 3);
+    } else {
+        throw std::invalid_argument("Unknown corpus " + name);
+    }
+    loaded.records = records::parse_records(loaded.document);
+    return corpora.emplace(name, std::move(loaded)).first->second;
+}
+
+void set_throughput(benchmark::State &state, size_t bytes, size_t records) {
+    if (bytes > 0) {
+        state.SetBytesProcessed(static_cast<int64_t>(state.iterations() * bytes));
+    }
+    state.counters["records_per_second"] =
+        benchmark::Counter(static_cast<double>(records), benchmark::Counter::kIsIterationInvariantRate);
+}
+
+concurrency::ThreadPool &pool() {
+    static concurrency::ThreadPool workers;
+    return workers;
+}
+
+std::filesystem::path scratch_path(const char *name) {
+    return std::filesystem::temp_directory_path() / (std::string("earthquake_bench_") + name);
+}
+
+// simplejson::parse builds the whole DOM.
+void BM_DomParse(benchmark::State &state, const std::string &name) {
+    const Corpus &input = corpus(name);
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(simplejson::parse(input.document));
+    }
+    set_throughput(state, input.document.size(), input.records.size());
+}
+
+// simplejson::TapeDocument only records where the tokens are.
+void BM_TapeParse(benchmark::State &state, const std::string &name) {
+    const Corpus &input = corpus(name);
+    for (auto _ : state) {
+        simplejson::TapeDocument document(input.document);
+        benchmark::DoNotOptimize(document.size());
+    }
+    set_throughput(state, input.document.size(), input.records.size());
+}
+
+// A tape built and read through the accessors for the fields a record
+// needs, which is where its values get decoded.
+void BM_TapeRecords(benchmark::State &state, const std::string &name) {
+    const Corpus &input = corpus(name);
+    for (auto _ : state) {
+        simplejson::TapeDocument document(input.document);
+        double sum = 0.0;
+        const simplejson::TapeValue *features = simplejson::get(document.root().as_object(), "features");
+        for (const simplejson::TapeValue &feature : features->as_array()) {
+            simplejson::TapeObject object = feature.as_object();
+            simplejson::TapeObject properties = simplejson::get(object, "properties")->as_object();
+            const simplejson::TapeValue *mag = simplejson::get(properties, "mag");
+            sum += simplejson::get(properties, "time")->as_number();
+            sum += mag && mag->is_number() ? mag->as_number() : 0.0;
+            benchmark::DoNotOptimize(simplejson::get(properties, "place")->as_string().data());
+            for (const simplejson::TapeValue &coordinate :
+                 simplejson::get(simplejson::get(object, "geometry")->as_object(), "coordinates")->as_array()) {
+                sum += coordinate.as_number();
+            }
+        }
+        benchmark::DoNotOptimize(sum);
+    }
+    set_throughput(state, input.document.size(), input.records.size());
+}
+
+// The SAX walk that extracts records from a whole document.
+void BM_ParseRecords(benchmark::State &state, const std::string &name) {
+    const Corpus &input = corpus(name);
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(records::parse_records(input.document));
+    }
+    set_throughput(state, input.document.size(), input.records.size());
+}
+
+// The streaming path: the same walk fed in 16 KiB chunks, as downloads are.
+void BM_PushParseRecords(benchmark::State &state, const std::string &name) {
+    const Corpus &input = corpus(name);
+    constexpr size_t kChunk = 16 * 1024;
+    for (auto _ : state) {
+        RecordBatch records;
+        records::RecordExtractor extractor(records);
+        simplejson::PushParser<records::RecordExtractor> parser(extractor);
+        std::string_view rest = input.document;
+        while (!rest.empty()) {
+            size_t size = std::min(kChunk, rest.size());
+            parser.feed(rest.substr(0, size));
+            rest.remove_prefix(size);
+        }
+        parser.finish();
+        extractor.finish();
+        benchmark::DoNotOptimize(records.size());
+    }
+    set_throughput(state, input.document.size(), input.records.size());
+}
+
+void BM_ParseRecordsParallel(benchmark::State &state, const std::string &name) {
+    const Corpus &input = corpus(name);
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(records::parse_records_parallel(input.document, pool()));
+    }
+    set_throughput(state, input.document.size(), input.records.size());
+}
+
+// ISO 8601 rendering of the event times.
+void BM_Iso8601Format(benchmark::State &state) {
+    const RecordBatch &records = corpus("all_month").records;
+    iso8601::Formatter formatter;
+    iso8601::Buffer buffer;
+    for (auto _ : state) {
+        for (int64_t time_ms : records.time_ms()) {
+            benchmark::DoNotOptimize(formatter.format(time_ms, buffer).data());
+        }
+    }
+    set_throughput(state, 0, records.size());
+}
+
+// CSV quoting and escaping of text fields, into a discarded file. The
+// escapes corpus's places all need quoting; all_month's mostly do not.
+void BM_CsvEscape(benchmark::State &state, const std::string &name) {
+    const RecordBatch &records = corpus(name).records;
+    size_t bytes = records.places().heap_size();
+    csv::Writer out("/dev/null", true);
+    for (auto _ : state) {
+        for (size_t row = 0; row < records.size(); ++row) {
+            out.field(records.places()[row]);
+            out.end_row();
+        }
+    }
+    out.close();
+    set_throughput(state, bytes, records.size());
+}
+
+void BM_AppendRecordsToCsv(benchmark::State &state, const std::string &name) {
+    const RecordBatch &records = corpus(name).records;
+    const std::filesystem::path path = scratch_path("earthquakes.csv");
+    size_t bytes = 0;
+    for (auto _ : state) {
+        state.PauseTiming();
+        std::filesystem::remove(path);
+        state.ResumeTiming();
+        reports::append_records_to_csv(records, path);
+    }
+    bytes = static_cast<size_t>(std::filesystem::file_size(path));
+    std::filesystem::remove(path);
+    set_throughput(state, bytes, records.size());
+}
+
+// report.csv from the fetched records and an aggregate state holding them.
+void BM_WriteReport(benchmark::State &state, const std::string &name) {
+    const RecordBatch &records = corpus(name).records;
+    aggregate::State aggregates(reports::report_bins().edges());
+    for (size_t row = 0; row < records.size(); ++row) {
+        aggregates.add(records.time_ms()[row], records.magnitude()[row], records.depth_km()[row]);
+    }
+    const std::filesystem::path path = scratch_path("report.csv");
+    for (auto _ : state) {
+        reports::write_report(records, aggregates, 1791954000000, path, pool());
+    }
+    std::filesystem::remove(path);
+    set_throughput(state, 0, records.size());
+}
+
+void register_benchmarks() {
+    const std::vector<std::string> feeds = {"all_hour", "all_day", "all_month", "escapes"};
+    for (const std::string &name : feeds) {
+        benchmark::RegisterBenchmark(("BM_DomParse/" + name).c_str(), BM_DomParse, name);
+        benchmark::RegisterBenchmark(("BM_TapeParse/" + name).c_str(), BM_TapeParse, name);
+        benchmark::RegisterBenchmark(("BM_TapeRecords/" + name).c_str(), BM_TapeRecords, name);
+    }
+    std::vector<std::string> with_large = feeds;
+    with_large.push_back("large");
+    for (const std::string &name : with_large) {
+        benchmark::RegisterBenchmark(("BM_ParseRecords/" + name).c_str(), BM_ParseRecords, name);
+        benchmark::RegisterBenchmark(("BM_PushParseRecords/" + name).c_str(), BM_PushParseRecords, name);
+    }
+    for (const char *feed : {"all_month", "large"}) {
+        const std::string name(feed);
+        benchmark::RegisterBenchmark(("BM_ParseRecordsParallel/" + name).c_str(), BM_ParseRecordsParallel, name)
+            ->UseRealTime();
+    }
+    benchmark::RegisterBenchmark("BM_Iso8601Format", BM_Iso8601Format);
+    for (const char *corpus : {"all_month", "escapes"}) {
+        const std::string name(corpus);
+        benchmark::RegisterBenchmark(("BM_CsvEscape/" + name).c_str(), BM_CsvEscape, name);
+    }
+    for (const char *feed : {"all_day", "all_month"}) {
+        const std::string name(feed);
+        benchmark::RegisterBenchmark(("BM_AppendRecordsToCsv/" + name).c_str(), BM_AppendRecordsToCsv, name);
+        benchmark::RegisterBenchmark(("BM_WriteReport/" + name).c_str(), BM_WriteReport, name);
+    }
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+    register_benchmarks();
+    benchmark::Initialize(&argc, argv);
+    if (benchmark::ReportUnrecognizedArguments(argc, argv)) {
+        return 1;
+    }
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+    return 0;
+}
@@ -0,0 +1,290 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <limits>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "binary_io.hpp"
+
+namespace aggregate {
+
+// Count, sum and range of a stream of values. remove() takes a value back
+// out of the count and sum; the range only ever widens.
+struct Stats {
+    uint64_t count = 0;
+    double sum = 0.0;
+    double min = std::numeric_limits<double>::infinity();
+    double max = -std::numeric_limits<double>::infinity();
+
+    void add(double value) {
+        ++count;
+        sum += value;
+        min = std::min(min, value);
+        max = std::max(max, value);
+    }
+
+    void remove(double value) {
+        if (count == 0) {
+            return;
+        }
+        if (--count == 0) {
+            *this = Stats{};
+        } else {
+            sum -= value;
+        }
+    }
+
+    void merge(const Stats &other) {
+        count += other.count;
+        sum += other.sum;
+        min = std::min(min, other.min);
+        max = std::max(max, other.max);
+    }
+
+    std::optional<double> mean() const {
+        if (count == 0) {
+            return std::nullopt;
+        }
+        return sum / static_cast<double>(count);
+    }
+};
+
+// Everything known about the events in some span of time: how many there
+// were, how many fell in each magnitude bucket, and the spread of their
+// magnitudes and depths.
+struct Summary {
+    uint64_t events = 0;
+    std::vector<uint64_t> buckets;
+    Stats magnitude;
+    Stats depth_km;
+
+    explicit Summary(size_t bucket_count = 0) : buckets(bucket_count, 0) {}
+
+    void merge(const Summary &other) {
+        events += other.events;
+        for (size_t i = 0; i < buckets.size(); ++i) {
+            buckets[i] += other.buckets[i];
+        }
+        magnitude.merge(other.magnitude);
+        depth_km.merge(other.depth_km);
+    }
+};
+
+// Running totals of every event counted so far, plus one Summary per hour
+// of event time for the last kRingHours hours, kept in a ring: the slot of
+// hour h is h % kRingHours, and a slot still holding an older hour is
+// cleared when a newer one claims it. A rolling window is the sum of the
+// slots inside it, so old events fall out of the 24 h, 7 d and 30 d
+// figures without anything being rescanned.
+//
+// Magnitudes are bucketed by `edges` (bucket 0 below edges[0], bucket i in
+// [edges[i - 1], edges[i]), the last at or above edges.back()), which are
+// stored with the state; loading with different edges is an error rather
+// than a silent reinterpretation of the counts.
+//
+// On disk: the magic "EQAGG001", the edge count and edges, the totals, the
+// ring size, then every slot as its hour and Summary, all little-endian.
+class State {
+public:
+    static constexpr int64_t kHourMs = 3600 * 1000;
+    static constexpr size_t kRingHours = 30 * 24;
+
+    explicit State(std::vector<double> edges)
+        : edges_(std::move(edges)), totals_(edges_.size() + 1), ring_(kRingHours, Slot{kEmpty, Summary(edges_.size() + 1)}) {}
+
+    // A missing file yields an empty state.
+    static State load(const std::filesystem::path &path, std::vector<double> edges) {
+        State state(std::move(edges));
+        std::optional<std::vector<char>> data = binary::read_file(path);
+        if (!data) {
+            return state;
+        }
+
+        binary::Reader reader(data->data(), data->data() + data->size(), "aggregate state");
+        if (reader.bytes(kMagic.size()) != kMagic) {
+            throw std::runtime_error("Unrecognized aggregate state " + path.string());
+        }
+        uint32_t edge_count = reader.u32();
+        bool same_edges = edge_count == state.edges_.size();
+        for (uint32_t i = 0; i < edge_count; ++i) {
+            double edge = reader.f64();
+            same_edges = same_edges && edge == state.edges_[i];
+        }
+        if (!same_edges) {
+            throw std::runtime_error("Aggregate state " + path.string() +
+                                     " was built with different magnitude buckets; remove it to start over");
+        }
+        state.read_summary(reader, state.totals_);
+        if (reader.u32() != kRingHours) {
+            throw std::runtime_error("Unrecognized aggregate state " + path.string());
+        }
+        for (Slot &slot : state.ring_) {
+            slot.hour = reader.i64();
+            state.read_summary(reader, slot.summary);
+        }
+        return state;
+    }
+
+    void add(int64_t time_ms, std::optional<double> magnitude, std::optional<double> depth_km) {
+        apply(totals_, magnitude, depth_km, true);
+        if (Summary *summary = claim(hour_of(time_ms))) {
+            apply(*summary, magnitude, depth_km, true);
+        }
+    }
+
+    // Takes back an event counted by add() with the same arguments, e.g.
+    // the superseded revision of an event.
+    void remove(int64_t time_ms, std::optional<double> magnitude, std::optional<double> depth_km) {
+        apply(totals_, magnitude, depth_km, false);
+        int64_t hour = hour_of(time_ms);
+        Slot &slot = ring_[slot_of(hour)];
+        if (slot.hour == hour) {
+            apply(slot.summary, magnitude, depth_km, false);
+        }
+    }
+
+    // Events of the `hours` hours of event time up to and including the one
+    // containing `now_ms`, plus any stamped later than that. At most
+    // kRingHours hours back.
+    Summary window(int64_t now_ms, int64_t hours) const {
+        int64_t oldest = hour_of(now_ms) - std::min<int64_t>(hours, kRingHours) + 1;
+        Summary result(edges_.size() + 1);
+        for (const Slot &slot : ring_) {
+            if (slot.hour != kEmpty && slot.hour >= oldest) {
+                result.merge(slot.summary);
+            }
+        }
+        return result;
+    }
+
+    const Summary &totals() const { return totals_; }
+    const std::vector<double> &edges() const { return edges_; }
+
+    void save(const std::filesystem::path &path) const {
+        std::string data(kMagic);
+        binary::put_u32(data, static_cast<uint32_t>(edges_.size()));
+        for (double edge : edges_) {
+            binary::put_f64(data, edge);
+        }
+        write_summary(data, totals_);
+        binary::put_u32(data, static_cast<uint32_t>(kRingHours));
+        for (const Slot &slot : ring_) {
+            binary::put_i64(data, slot.hour);
+            write_summary(data, slot.summary);
+        }
+        binary::write_file_atomically(path, data);
+    }
+
+private:
+    static constexpr std::string_view kMagic = "EQAGG001";
+    static constexpr int64_t kEmpty = std::numeric_limits<int64_t>::min();
+
+    struct Slot {
+        int64_t hour;
+        Summary summary;
+    };
+
+    static int64_t hour_of(int64_t time_ms) {
+        // Floor division, so times before the epoch land in the hour they
+        // belong to.
+        int64_t hour = time_ms / kHourMs;
+        return hour - (time_ms % kHourMs < 0 ? 1 : 0);
+    }
+
+    static size_t slot_of(int64_t hour) {
+        int64_t slot = hour % static_cast<int64_t>(kRingHours);
+        return static_cast<size_t>(slot < 0 ? slot + static_cast<int64_t>(kRingHours) : slot);
+    }
+
+    // The slot summary for `hour`, cleared first if it held an older hour;
+    // null when the slot already holds a newer hour, i.e. the event is more
+    // than kRingHours older than data already seen.
+    Summary *claim(int64_t hour) {
+        Slot &slot = ring_[slot_of(hour)];
+        if (slot.hour != hour) {
+            if (slot.hour != kEmpty && slot.hour > hour) {
+                return nullptr;
+            }
+            slot.hour = hour;
+            slot.summary = Summary(edges_.size() + 1);
+        }
+        return &slot.summary;
+    }
+
+    size_t bucket_of(double magnitude) const {
+        return static_cast<size_t>(std::upper_bound(edges_.begin(), edges_.end(), magnitude) - edges_.begin());
+    }
+
+    void apply(Summary &summary, std::optional<double> magnitude, std::optional<double> depth_km, bool adding) const {
+        if (adding) {
+            ++summary.events;
+            if (magnitude) {
+                ++summary.buckets[bucket_of(*magnitude)];
+                summary.magnitude.add(*magnitude);
+            }
+            if (depth_km) {
+                summary.depth_km.add(*depth_km);
+            }
+            return;
+        }
+        if (summary.events == 0) {
+            return;
+        }
+        --summary.events;
+        if (magnitude) {
+            uint64_t &bucket = summary.buckets[bucket_of(*magnitude)];
+            bucket -= bucket > 0 ? 1 : 0;
+            summary.magnitude.remove(*magnitude);
+        }
+        if (depth_km) {
+            summary.depth_km.remove(*depth_km);
+        }
+    }
+
+    static void write_stats(std::string &out, const Stats &stats) {
+        binary::put_u64(out, stats.count);
+        binary::put_f64(out, stats.sum);
+        binary::put_f64(out, stats.min);
+        binary::put_f64(out, stats.max);
+    }
+
+    static void read_stats(binary::Reader &reader, Stats &stats) {
+        stats.count = reader.u64();
+        stats.sum = reader.f64();
+        stats.min = reader.f64();
+        stats.max = reader.f64();
+    }
+
+    static void write_summary(std::string &out, const Summary &summary) {
+        binary::put_u64(out, summary.events);
+        for (uint64_t count : summary.buckets) {
+            binary::put_u64(out, count);
+        }
+        write_stats(out, summary.magnitude);
+        write_stats(out, summary.depth_km);
+    }
+
+    void read_summary(binary::Reader &reader, Summary &summary) const {
+        summary = Summary(edges_.size() + 1);
+        summary.events = reader.u64();
+        for (uint64_t &count : summary.buckets) {
+            count = reader.u64();
+        }
+        read_stats(reader, summary.magnitude);
+        read_stats(reader, summary.depth_km);
+    }
+
+    std::vector<double> edges_;
+    Summary totals_;
+    std::vector<Slot> ring_;
+};
+
+} // namespace aggregate
@@ -0,0 +1,345 @@
+#pragma once
+
+#include <curl/curl.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "async_writer.hpp"
+#include "event_index.hpp"
+#include "iso8601.hpp"
+#include "json.hpp"
+#include "record_batch.hpp"
+#include "reports.hpp"
+
+namespace alerts {
+
+// Conditions an event must all meet to raise an alert; unset ones always
+// hold.
+struct Rule {
+    std::optional<double> min_magnitude;
+    std::optional<reports::Region> area;
+    bool tsunami = false;
+
+    bool matches(const columnar::Row &row) const {
+        if (min_magnitude && !(row.magnitude && *row.magnitude >= *min_magnitude)) {
+            return false;
+        }
+        if (tsunami && row.tsunami == 0) {
+            return false;
+        }
+        if (!area) {
+            return true;
+        }
+        if (!row.latitude || !row.longitude) {
+            return false;
+        }
+        return reports::contains(*area, *row.latitude, *row.longitude);
+    }
+};
+
+// The event as one line of JSON, ending in a newline.
+inline std::string format_alert(const columnar::Row &row, std::string_view feed) {
+    auto number = [](std::string &out, const char *name, const std::optional<double> &value) {
+        out += ",\"";
+        out += name;
+        out += "\":";
+        if (value) {
+            simplejson::append_number(out, *value);
+        } else {
+            out += "null";
+        }
+    };
+    iso8601::Formatter timestamps;
+    iso8601::Buffer time_iso;
+    std::string out = "{\"id\":";
+    simplejson::append_string(out, row.id);
+    out += ",\"time\":";
+    simplejson::append_string(out, timestamps.format(row.time_ms, time_iso));
+    number(out, "magnitude", row.magnitude);
+    out += ",\"place\":";
+    simplejson::append_string(out, row.place);
+    number(out, "longitude", row.longitude);
+    number(out, "latitude", row.latitude);
+    number(out, "depth_km", row.depth_km);
+    out += row.tsunami != 0 ? ",\"tsunami\":true" : ",\"tsunami\":false";
+    out += ",\"feed\":";
+    simplejson::append_string(out, feed);
+    out += "}\n";
+    return out;
+}
+
+// Where alert lines go: "-" for standard output, udp://<host>:<port> for
+// one datagram per alert, an http:// or https:// URL that each alert is
+// POSTed to, or otherwise the path of a file or named pipe to append to.
+// A path stays open between alerts and is opened again after a failed
+// write, so a pipe's reader may come and go; an alert sent while no reader
+// is attached fails.
+class Sink {
+public:
+    explicit Sink(const std::string &target) : target_(target) {
+        if (target == "-") {
+            kind_ = Kind::Stdout;
+        } else if (target.compare(0, 6, "udp://") == 0) {
+            kind_ = Kind::Udp;
+            open_udp(target.substr(6));
+        } else if (target.compare(0, 7, "http://") == 0 || target.compare(0, 8, "https://") == 0) {
+            kind_ = Kind::Http;
+            open_http();
+        } else {
+            kind_ = Kind::Path;
+            // A pipe whose reader went away raises SIGPIPE instead of
+            // failing the write.
+            std::signal(SIGPIPE, SIG_IGN);
+        }
+    }
+
+    Sink(const Sink &) = delete;
+    Sink &operator=(const Sink &) = delete;
+
+    ~Sink() {
+        if (socket_ >= 0) {
+            ::close(socket_);
+        }
+        if (file_ >= 0) {
+            ::close(file_);
+        }
+        if (curl_) {
+            curl_slist_free_all(headers_);
+            curl_easy_cleanup(curl_);
+        }
+    }
+
+    // Delivers one line; throws if it could not be.
+    void send(const std::string &line) {
+        switch (kind_) {
+            case Kind::Stdout:
+                if (!(std::cout << line << std::flush)) {
+                    throw std::runtime_error("Failed to write alert to standard output");
+                }
+                return;
+            case Kind::Udp:
+                if (::send(socket_, line.data(), line.size(), 0) != static_cast<ssize_t>(line.size())) {
+                    throw std::runtime_error("Failed to send alert to " + target_ + ": " + std::strerror(errno));
+                }
+                return;
+            case Kind::Http:
+                post(line);
+                return;
+            case Kind::Path:
+                append(line);
+                return;
+        }
+    }
+
+private:
+    enum class Kind { Stdout, Udp, Http, Path };
+
+    void open_udp(const std::string &address) {
+        size_t colon = address.rfind(':');
+        if (colon == std::string::npos || colon == 0 || colon + 1 == address.size()) {
+            throw std::invalid_argument("Invalid alert address: " + target_);
+        }
+        std::string host = address.substr(0, colon);
+        if (host.size() > 2 && host.front() == '[' && host.back() == ']') {
+            host = host.substr(1, host.size() - 2);
+        }
+        addrinfo hints{};
+        hints.ai_socktype = SOCK_DGRAM;
+        addrinfo *found = nullptr;
+        int error = ::getaddrinfo(host.c_str(), address.c_str() + colon + 1, &hints, &found);
+        if (error != 0) {
+            throw std::runtime_error("Failed to resolve " + target_ + ": " + ::gai_strerror(error));
+        }
+        for (addrinfo *candidate = found; candidate && socket_ < 0; candidate = candidate->ai_next) {
+            socket_ = ::socket(candidate->ai_family, candidate->ai_socktype | SOCK_CLOEXEC, candidate->ai_protocol);
+            if (socket_ >= 0 && ::connect(socket_, candidate->ai_addr, candidate->ai_addrlen) != 0) {
+                ::close(socket_);
+                socket_ = -1;
+            }
+        }
+        ::freeaddrinfo(found);
+        if (socket_ < 0) {
+            throw std::runtime_error("Failed to open a socket for " + target_);
+        }
+    }
+
+    void open_http() {
+        curl_ = curl_easy_init();
+        if (!curl_) {
+            throw std::runtime_error("Failed to initialize CURL");
+        }
+        headers_ = curl_slist_append(headers_, "Content-Type: application/json");
+        curl_easy_setopt(curl_, CURLOPT_URL, target_.c_str());
+        curl_easy_setopt(curl_, CURLOPT_HTTPHEADER, headers_);
+        curl_easy_setopt(curl_, CURLOPT_USERAGENT, "earthquake-data-pipeline/1.0");
+        curl_easy_setopt(curl_, CURLOPT_TIMEOUT_MS, 5000L);
+        curl_easy_setopt(curl_, CURLOPT_NOSIGNAL, 1L);
+        curl_easy_setopt(curl_, CURLOPT_WRITEFUNCTION, discard);
+    }
+
+    void post(const std::string &line) {
+        curl_easy_setopt(curl_, CURLOPT_POSTFIELDS, line.data());
+        curl_easy_setopt(curl_, CURLOPT_POSTFIELDSIZE_LARGE, static_cast<curl_off_t>(line.size()));
+        CURLcode result = curl_easy_perform(curl_);
+        if (result != CURLE_OK) {
+            throw std::runtime_error("Failed to post alert to " + target_ + ": " + curl_easy_strerror(result));
+        }
+        long response_code = 0;
+        curl_easy_getinfo(curl_, CURLINFO_RESPONSE_CODE, &response_code);
+        if (response_code >= 400) {
+            throw std::runtime_error("Failed to post alert to " + target_ + ": HTTP " + std::to_string(response_code));
+        }
+    }
+
+    void append(const std::string &line) {
+        if (file_ < 0) {
+            // Opened non-blocking so that a pipe without a reader fails at
+            // once, then written in blocking mode.
+            file_ = ::open(target_.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_NONBLOCK | O_CLOEXEC, 0644);
+            if (file_ < 0) {
+                throw std::runtime_error("Failed to open " + target_ + ": " + std::strerror(errno));
+            }
+            ::fcntl(file_, F_SETFL, ::fcntl(file_, F_GETFL) & ~O_NONBLOCK);
+        }
+        if (::write(file_, line.data(), line.size()) != static_cast<ssize_t>(line.size())) {
+            const int error = errno;
+            ::close(file_);
+            file_ = -1;
+            throw std::runtime_error("Failed to write alert to " + target_ + ": " + std::strerror(error));
+        }
+    }
+
+    static size_t discard(char *, size_t size, size_t nmemb, void *) { return size * nmemb; }
+
+    std::string target_;
+    Kind kind_ = Kind::Stdout;
+    int socket_ = -1;
+    int file_ = -1;
+    CURL *curl_ = nullptr;
+    curl_slist *headers_ = nullptr;
+};
+
+// Raises alerts from inside the parse: consider() is called for every
+// feature as soon as it is complete, on whichever thread parses it, and
+// hands an event that matches a rule to a sender thread straight away, so
+// the alert goes out while the rest of the feed is still being parsed and
+// long before anything is written to disk.
+//
+// An event alerts once. Events the dedup index already holds at the same
+// or a later revision were dealt with by an earlier cycle (or an earlier
+// run) and are left alone, and the ids alerted since are remembered until
+// prune() forgets them. Events without an id alert every time they match.
+class Alerter {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    // Delivery latencies of the alerts sent since the last take_latency().
+    struct Latency {
+        uint64_t alerts = 0;
+        // From the feature being parsed to the sink accepting the alert.
+        double max_parse_to_alert_seconds = 0.0;
+        // From the start of the fetch that carried it.
+        double max_fetch_to_alert_seconds = 0.0;
+    };
+
+    // `index` is only read during consider(), which must therefore not run
+    // while the index changes.
+    Alerter(std::vector<Rule> rules, const std::string &sink, const dedup::EventIndex &index)
+        : rules_(std::move(rules)), sink_(sink), index_(index) {}
+
+    // Thread-safe.
+    void consider(const columnar::Row &row, std::string_view feed, Clock::time_point fetch_started) {
+        bool matched = false;
+        for (const Rule &rule : rules_) {
+            matched = matched || rule.matches(row);
+        }
+        if (!matched) {
+            return;
+        }
+        if (!row.id.empty()) {
+            const dedup::EventIndex::Entry *known = index_.find(row.id);
+            if (known && known->updated_ms >= row.updated_ms) {
+                return;
+            }
+        }
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!row.id.empty() && !alerted_.emplace(row.id, row.time_ms).second) {
+            return;
+        }
+        // The sender is fed from one thread at a time.
+        sender_.submit(Alert{format_alert(row, feed), Clock::now(), fetch_started});
+    }
+
+    // Forgets the alerted events older than `cutoff_ms`.
+    void prune(int64_t cutoff_ms) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (auto it = alerted_.begin(); it != alerted_.end();) {
+            it = it->second < cutoff_ms ? alerted_.erase(it) : std::next(it);
+        }
+    }
+
+    Latency take_latency() {
+        std::lock_guard<std::mutex> lock(latency_mutex_);
+        return std::exchange(latency_, Latency{});
+    }
+
+private:
+    struct Alert {
+        std::string line;
+        Clock::time_point parsed;
+        Clock::time_point fetch_started;
+    };
+
+    // Runs on the sender thread. A failed alert is reported and dropped;
+    // it is not retried.
+    void send(std::vector<Alert> &alerts) {
+        for (const Alert &alert : alerts) {
+            try {
+                sink_.send(alert.line);
+            } catch (const std::exception &ex) {
+                std::cerr << "Error sending alert: " << ex.what() << std::endl;
+                continue;
+            }
+            const Clock::time_point sent = Clock::now();
+            std::lock_guard<std::mutex> lock(latency_mutex_);
+            ++latency_.alerts;
+            latency_.max_parse_to_alert_seconds = std::max(
+                latency_.max_parse_to_alert_seconds, std::chrono::duration<double>(sent - alert.parsed).count());
+            latency_.max_fetch_to_alert_seconds =
+                std::max(latency_.max_fetch_to_alert_seconds,
+                         std::chrono::duration<double>(sent - alert.fetch_started).count());
+        }
+    }
+
+    static constexpr size_t kQueueCapacity = 64;
+
+    const std::vector<Rule> rules_;
+    Sink sink_;
+    const dedup::EventIndex &index_;
+    std::mutex mutex_;
+    // Event time of each id alerted.
+    std::unordered_map<std::string, int64_t> alerted_;
+    std::mutex latency_mutex_;
+    Latency latency_;
+    // Last, so that it is destroyed first and sends what is still queued.
+    concurrency::AsyncWriter<Alert> sender_{kQueueCapacity, [this](std::vector<Alert> &alerts) { send(alerts); }};
+};
+
+} // namespace alerts
@@ -0,0 +1,70 @@
+#pragma once
+
+// Replaces the global operator new to count allocations for metrics. The
+// replacement must exist once per program, so include this header from
+// exactly one translation unit, and only in builds that define
+// METRICS_COUNT_ALLOCATIONS. The count is a relaxed atomic increment, so
+// the hook is cheap enough to leave on.
+
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+
+#include "metrics.hpp"
+
+#if defined(METRICS_COUNT_ALLOCATIONS)
+
+namespace metrics::detail {
+
+inline void *counted_allocate(std::size_t size) {
+    g_allocations.fetch_add(1, std::memory_order_relaxed);
+    // malloc(0) may return null; operator new must not.
+    if (void *memory = std::malloc(size == 0 ? 1 : size)) {
+        return memory;
+    }
+    throw std::bad_alloc();
+}
+
+} // namespace metrics::detail
+
+void *operator new(std::size_t size) {
+    return metrics::detail::counted_allocate(size);
+}
+
+void *operator new[](std::size_t size) {
+    return metrics::detail::counted_allocate(size);
+}
+
+void *operator new(std::size_t size, const std::nothrow_t &) noexcept {
+    try {
+        return metrics::detail::counted_allocate(size);
+    } catch (...) {
+        return nullptr;
+    }
+}
+
+void *operator new[](std::size_t size, const std::nothrow_t &) noexcept {
+    try {
+        return metrics::detail::counted_allocate(size);
+    } catch (...) {
+        return nullptr;
+    }
+}
+
+void operator delete(void *memory) noexcept {
+    std::free(memory);
+}
+
+void operator delete[](void *memory) noexcept {
+    std::free(memory);
+}
+
+void operator delete(void *memory, std::size_t) noexcept {
+    std::free(memory);
+}
+
+void operator delete[](void *memory, std::size_t) noexcept {
+    std::free(memory);
+}
+
+#endif
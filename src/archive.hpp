@@ -0,0 +1,603 @@
+#pragma once
+
+#include <algorithm>
+#include <charconv>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <limits>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "binary_io.hpp"
+#include "record_batch.hpp"
+
+namespace archive {
+
+// Append-only binary archive of the events written to earthquakes.csv: one
+// immutable segment file per batch, merged as they accumulate (see
+// SegmentWriter), laid out so that a reader can mmap it and use the
+// columns in place.
+//
+// A segment is the magic "EQSEG001", then these sections, each starting on
+// an 8-byte boundary:
+//   time, updated   offsets from the footer's base time, one uint32 or
+//                   uint64 per row (the footer says which)
+//   magnitude, longitude, latitude, depth_km
+//                   float64 per row, NaN when absent
+//   place           uint32 code per row into the place dictionary
+//   id offsets      uint32 per row plus one; row i is [offsets[i], offsets[i + 1])
+//   id bytes
+//   dictionary offsets, dictionary bytes
+//                   the distinct places, laid out like the ids
+// and a fixed-size footer (see Footer) ending in "EQSEGEND". Everything is
+// little-endian.
+namespace detail {
+
+constexpr std::string_view kMagic = "EQSEG001";
+constexpr std::string_view kEndMagic = "EQSEGEND";
+
+enum Section : size_t {
+    kTime,
+    kUpdated,
+    kMagnitude,
+    kLongitude,
+    kLatitude,
+    kDepth,
+    kPlace,
+    kIdOffsets,
+    kIdBytes,
+    kDictionaryOffsets,
+    kDictionaryBytes,
+    kSectionCount,
+};
+
+constexpr size_t kFooterSize = 8 * 4 + 4 * 2 + 8 * 4 + 8 * kSectionCount + kEndMagic.size();
+
+inline bool little_endian_host() {
+    const uint16_t probe = 1;
+    unsigned char first;
+    std::memcpy(&first, &probe, 1);
+    return first == 1;
+}
+
+inline void pad(std::string &out) {
+    out.append((8 - out.size() % 8) % 8, '\0');
+}
+
+inline double or_nan(const std::optional<double> &value) {
+    return value.value_or(std::numeric_limits<double>::quiet_NaN());
+}
+
+} // namespace detail
+
+// Per-segment statistics, read from the footer without touching the
+// columns. Magnitudes are NaN when no row has one.
+struct Footer {
+    uint64_t rows = 0;
+    uint64_t places = 0;
+    int64_t base_ms = 0;
+    uint32_t time_width = 4;
+    int64_t min_time_ms = 0;
+    int64_t max_time_ms = 0;
+    double min_magnitude = std::numeric_limits<double>::quiet_NaN();
+    double max_magnitude = std::numeric_limits<double>::quiet_NaN();
+    uint64_t offsets[detail::kSectionCount] = {};
+};
+
+// Rows wanted by a scan: event time in [from_ms, to_ms] and, when set,
+// magnitude at or above min_magnitude.
+struct Query {
+    int64_t from_ms = std::numeric_limits<int64_t>::min();
+    int64_t to_ms = std::numeric_limits<int64_t>::max();
+    std::optional<double> min_magnitude;
+};
+
+// Encodes `records` as one segment.
+inline std::string encode_segment(const columnar::RecordBatch &records) {
+    const size_t rows = records.size();
+    Footer footer;
+    footer.rows = rows;
+
+    if (rows > 0) {
+        const std::vector<int64_t> &times = records.time_ms();
+        const std::vector<int64_t> &updates = records.updated_ms();
+        auto [min_time, max_time] = std::minmax_element(times.begin(), times.end());
+        auto [min_update, max_update] = std::minmax_element(updates.begin(), updates.end());
+        footer.min_time_ms = *min_time;
+        footer.max_time_ms = *max_time;
+        footer.base_ms = std::min(*min_time, *min_update);
+        int64_t top = std::max(*max_time, *max_update);
+        // Compare as unsigned: the span of arbitrary int64 times can
+        // overflow a signed difference.
+        uint64_t span = static_cast<uint64_t>(top) - static_cast<uint64_t>(footer.base_ms);
+        footer.time_width = span <= UINT32_MAX ? 4 : 8;
+    }
+    for (size_t row = 0; row < rows; ++row) {
+        if (std::optional<double> magnitude = records.magnitude()[row]) {
+            bool first = std::isnan(footer.min_magnitude);
+            footer.min_magnitude = first ? *magnitude : std::min(footer.min_magnitude, *magnitude);
+            footer.max_magnitude = first ? *magnitude : std::max(footer.max_magnitude, *magnitude);
+        }
+    }
+
+    std::string out(detail::kMagic);
+    auto begin_section = [&](detail::Section section) {
+        detail::pad(out);
+        footer.offsets[section] = out.size();
+    };
+    auto put_times = [&](detail::Section section, const std::vector<int64_t> &values) {
+        begin_section(section);
+        for (int64_t value : values) {
+            uint64_t offset = static_cast<uint64_t>(value) - static_cast<uint64_t>(footer.base_ms);
+            if (footer.time_width == 4) {
+                binary::put_u32(out, static_cast<uint32_t>(offset));
+            } else {
+                binary::put_u64(out, offset);
+            }
+        }
+    };
+    auto put_doubles = [&](detail::Section section, const columnar::NullableColumn<double> &column) {
+        begin_section(section);
+        for (size_t row = 0; row < rows; ++row) {
+            binary::put_f64(out, detail::or_nan(column[row]));
+        }
+    };
+    auto put_strings = [&](detail::Section offsets, detail::Section bytes, size_t count, const auto &at) {
+        begin_section(offsets);
+        uint64_t end = 0;
+        binary::put_u32(out, 0);
+        for (size_t i = 0; i < count; ++i) {
+            end += at(i).size();
+            if (end > UINT32_MAX) {
+                throw std::length_error("Archive segment strings exceed 4 GiB");
+            }
+            binary::put_u32(out, static_cast<uint32_t>(end));
+        }
+        begin_section(bytes);
+        for (size_t i = 0; i < count; ++i) {
+            out += at(i);
+        }
+    };
+
+    put_times(detail::kTime, records.time_ms());
+    put_times(detail::kUpdated, records.updated_ms());
+    put_doubles(detail::kMagnitude, records.magnitude());
+    put_doubles(detail::kLongitude, records.longitude());
+    put_doubles(detail::kLatitude, records.latitude());
+    put_doubles(detail::kDepth, records.depth_km());
+
+    // The same places recur across events, so each distinct one is stored
+    // once and rows refer to it by code.
+    std::vector<std::string_view> dictionary;
+    std::unordered_map<std::string_view, uint32_t> codes;
+    begin_section(detail::kPlace);
+    for (size_t row = 0; row < rows; ++row) {
+        std::string_view place = records.places()[row];
+        auto [it, inserted] = codes.emplace(place, static_cast<uint32_t>(dictionary.size()));
+        if (inserted) {
+            dictionary.push_back(place);
+        }
+        binary::put_u32(out, it->second);
+    }
+    footer.places = dictionary.size();
+
+    put_strings(detail::kIdOffsets, detail::kIdBytes, rows, [&](size_t row) { return records.ids()[row]; });
+    put_strings(detail::kDictionaryOffsets, detail::kDictionaryBytes, dictionary.size(),
+                [&](size_t code) { return dictionary[code]; });
+
+    detail::pad(out);
+    binary::put_u64(out, footer.rows);
+    binary::put_u64(out, footer.places);
+    binary::put_i64(out, footer.base_ms);
+    binary::put_i64(out, footer.min_time_ms);
+    binary::put_u32(out, footer.time_width);
+    binary::put_u32(out, 0);
+    binary::put_i64(out, footer.max_time_ms);
+    binary::put_f64(out, footer.min_magnitude);
+    binary::put_f64(out, footer.max_magnitude);
+    binary::put_u64(out, 0);
+    for (uint64_t offset : footer.offsets) {
+        binary::put_u64(out, offset);
+    }
+    out += detail::kEndMagic;
+    return out;
+}
+
+// A segment file as listed from its name: the writes it holds, numbered
+// from 1 in the order they were made (first == last for a single write, a
+// range for segments merged by SegmentWriter), and the range of its event
+// times, so a scan can pass over it without opening it. Names are
+//   segment-<first>_<last>_<min_time_ms>_<max_time_ms>.eqseg
+// with the write numbers zero-padded to at least six digits. Archives from
+// before merging hold segment-<number>.eqseg, which has no times.
+struct SegmentFile {
+    std::filesystem::path path;
+    uint64_t first = 0;
+    uint64_t last = 0;
+    std::optional<std::pair<int64_t, int64_t>> times;
+    uint64_t bytes = 0;
+
+    // False when the name proves no row can match `query`.
+    bool may_match(const Query &query) const {
+        return !times || (times->second >= query.from_ms && times->first <= query.to_ms);
+    }
+};
+
+inline std::string segment_name(uint64_t first, uint64_t last, int64_t min_time_ms, int64_t max_time_ms) {
+    auto padded = [](uint64_t number) {
+        std::string digits = std::to_string(number);
+        digits.insert(0, digits.size() < 6 ? 6 - digits.size() : 0, '0');
+        return digits;
+    };
+    return "segment-" + padded(first) + "_" + padded(last) + "_" + std::to_string(min_time_ms) + "_" +
+           std::to_string(max_time_ms) + ".eqseg";
+}
+
+// The fields of a segment file name; unset if it does not name one.
+inline std::optional<SegmentFile> parse_segment_name(std::string_view name) {
+    constexpr std::string_view kPrefix = "segment-";
+    constexpr std::string_view kSuffix = ".eqseg";
+    if (name.size() <= kPrefix.size() + kSuffix.size() || name.substr(0, kPrefix.size()) != kPrefix ||
+        name.substr(name.size() - kSuffix.size()) != kSuffix) {
+        return std::nullopt;
+    }
+    std::string_view rest = name.substr(kPrefix.size(), name.size() - kPrefix.size() - kSuffix.size());
+    std::vector<std::string_view> fields;
+    while (true) {
+        size_t underscore = rest.find('_');
+        fields.push_back(rest.substr(0, underscore));
+        if (underscore == std::string_view::npos) {
+            break;
+        }
+        rest.remove_prefix(underscore + 1);
+    }
+    auto number = [](std::string_view field, auto &value) {
+        auto [end, ec] = std::from_chars(field.data(), field.data() + field.size(), value);
+        return !field.empty() && ec == std::errc() && end == field.data() + field.size();
+    };
+    SegmentFile file;
+    if (fields.size() == 1 && number(fields[0], file.first)) {
+        file.last = file.first;
+        return file;
+    }
+    int64_t min_time_ms = 0;
+    int64_t max_time_ms = 0;
+    if (fields.size() == 4 && number(fields[0], file.first) && number(fields[1], file.last) &&
+        number(fields[2], min_time_ms) && number(fields[3], max_time_ms) && file.first <= file.last) {
+        file.times.emplace(min_time_ms, max_time_ms);
+        return file;
+    }
+    return std::nullopt;
+}
+
+// The segments of `directory` in write order. A segment whose writes
+// another one also covers is left over from a merge that was interrupted
+// before it removed its inputs; it is skipped, and its path added to
+// `superseded` when given.
+inline std::vector<SegmentFile> list_segments(const std::filesystem::path &directory,
+                                              std::vector<std::filesystem::path> *superseded = nullptr) {
+    std::vector<SegmentFile> found;
+    std::error_code error;
+    for (const auto &entry : std::filesystem::directory_iterator(directory, error)) {
+        if (std::optional<SegmentFile> file = parse_segment_name(entry.path().filename().string())) {
+            file->path = entry.path();
+            std::error_code size_error;
+            file->bytes = entry.file_size(size_error);
+            found.push_back(std::move(*file));
+        }
+    }
+    // By first write, the widest range first, so that what it covers
+    // follows it.
+    std::sort(found.begin(), found.end(), [](const SegmentFile &a, const SegmentFile &b) {
+        return a.first != b.first ? a.first < b.first : a.last > b.last;
+    });
+    std::vector<SegmentFile> segments;
+    for (SegmentFile &file : found) {
+        if (!segments.empty() && file.last <= segments.back().last) {
+            if (superseded) {
+                superseded->push_back(file.path);
+            }
+            continue;
+        }
+        segments.push_back(std::move(file));
+    }
+    return segments;
+}
+
+// A segment mapped read-only. Accessors read the mapped columns directly;
+// only the footer is decoded when the file is opened. Moving a segment
+// keeps the mapping, so the pointers into it stay valid.
+class Segment {
+public:
+    explicit Segment(const std::filesystem::path &path) : path_(path.string()), file_(map_segment(path)) {
+        data_ = file_.view().data();
+        size_ = file_.view().size();
+        read_footer();
+    }
+
+    const Footer &footer() const { return footer_; }
+    size_t size() const { return static_cast<size_t>(footer_.rows); }
+
+    // False when the footer proves no row can match, so the segment can be
+    // skipped without reading its columns.
+    bool may_match(const Query &query) const {
+        if (footer_.rows == 0 || footer_.max_time_ms < query.from_ms || footer_.min_time_ms > query.to_ms) {
+            return false;
+        }
+        return !query.min_magnitude || footer_.max_magnitude >= *query.min_magnitude;
+    }
+
+    bool matches(size_t row, const Query &query) const {
+        int64_t time = time_ms(row);
+        if (time < query.from_ms || time > query.to_ms) {
+            return false;
+        }
+        return !query.min_magnitude || magnitudes()[row] >= *query.min_magnitude;
+    }
+
+    int64_t time_ms(size_t row) const { return decode_time(detail::kTime, row); }
+    int64_t updated_ms(size_t row) const { return decode_time(detail::kUpdated, row); }
+
+    // Whole columns, NaN where absent, for scanning in place.
+    const double *magnitudes() const { return column<double>(detail::kMagnitude); }
+    const double *longitudes() const { return column<double>(detail::kLongitude); }
+    const double *latitudes() const { return column<double>(detail::kLatitude); }
+    const double *depths_km() const { return column<double>(detail::kDepth); }
+
+    std::optional<double> magnitude(size_t row) const { return present(magnitudes()[row]); }
+    std::optional<double> longitude(size_t row) const { return present(longitudes()[row]); }
+    std::optional<double> latitude(size_t row) const { return present(latitudes()[row]); }
+    std::optional<double> depth_km(size_t row) const { return present(depths_km()[row]); }
+
+    std::string_view id(size_t row) const {
+        return string_at(detail::kIdOffsets, detail::kIdBytes, row);
+    }
+
+    std::string_view place(size_t row) const {
+        return string_at(detail::kDictionaryOffsets, detail::kDictionaryBytes, column<uint32_t>(detail::kPlace)[row]);
+    }
+
+    // Copies row `row` into `out`, e.g. to rebuild a RecordBatch.
+    void read(size_t row, columnar::Row &out) const {
+        out.id.assign(id(row));
+        out.time_ms = time_ms(row);
+        out.updated_ms = updated_ms(row);
+        out.magnitude = magnitude(row);
+        out.place.assign(place(row));
+        out.longitude = longitude(row);
+        out.latitude = latitude(row);
+        out.depth_km = depth_km(row);
+    }
+
+private:
+    static std::optional<double> present(double value) {
+        if (std::isnan(value)) {
+            return std::nullopt;
+        }
+        return value;
+    }
+
+    template <typename T>
+    const T *column(detail::Section section) const {
+        return reinterpret_cast<const T *>(data_ + footer_.offsets[section]);
+    }
+
+    int64_t decode_time(detail::Section section, size_t row) const {
+        uint64_t offset = footer_.time_width == 4 ? column<uint32_t>(section)[row] : column<uint64_t>(section)[row];
+        return static_cast<int64_t>(static_cast<uint64_t>(footer_.base_ms) + offset);
+    }
+
+    std::string_view string_at(detail::Section offsets, detail::Section bytes, size_t index) const {
+        const uint32_t *bounds = column<uint32_t>(offsets);
+        uint64_t count = offsets == detail::kIdOffsets ? footer_.rows : footer_.places;
+        if (index >= count || bounds[index] > bounds[index + 1] || bounds[index + 1] > bounds[count]) {
+            throw std::runtime_error("Corrupt archive segment " + path_);
+        }
+        return std::string_view(data_ + footer_.offsets[bytes] + bounds[index], bounds[index + 1] - bounds[index]);
+    }
+
+    void read_footer() {
+        if (size_ < detail::kMagic.size() + detail::kFooterSize ||
+            std::string_view(data_, detail::kMagic.size()) != detail::kMagic) {
+            throw std::runtime_error("Unrecognized archive segment " + path_);
+        }
+        binary::Reader reader(data_ + size_ - detail::kFooterSize, data_ + size_, "archive segment");
+        footer_.rows = reader.u64();
+        footer_.places = reader.u64();
+        footer_.base_ms = reader.i64();
+        footer_.min_time_ms = reader.i64();
+        footer_.time_width = reader.u32();
+        reader.u32();
+        footer_.max_time_ms = reader.i64();
+        footer_.min_magnitude = reader.f64();
+        footer_.max_magnitude = reader.f64();
+        reader.u64();
+        for (uint64_t &offset : footer_.offsets) {
+            offset = reader.u64();
+        }
+        if (reader.bytes(detail::kEndMagic.size()) != detail::kEndMagic ||
+            (footer_.time_width != 4 && footer_.time_width != 8)) {
+            throw std::runtime_error("Unrecognized archive segment " + path_);
+        }
+        validate();
+    }
+
+    // Checks that every section lies inside the file and is aligned for
+    // its element type, so the accessors can index the columns directly.
+    void validate() const {
+        const uint64_t limit = size_ - detail::kFooterSize;
+        const uint64_t rows = footer_.rows;
+        auto check = [&](detail::Section section, uint64_t count, uint64_t width) {
+            uint64_t offset = footer_.offsets[section];
+            if (offset % width != 0 || offset > limit || count > (limit - offset) / width) {
+                throw std::runtime_error("Corrupt archive segment " + path_);
+            }
+        };
+        check(detail::kTime, rows, footer_.time_width);
+        check(detail::kUpdated, rows, footer_.time_width);
+        for (detail::Section section : {detail::kMagnitude, detail::kLongitude, detail::kLatitude, detail::kDepth}) {
+            check(section, rows, 8);
+        }
+        check(detail::kPlace, rows, 4);
+        check(detail::kIdOffsets, rows + 1, 4);
+        check(detail::kDictionaryOffsets, footer_.places + 1, 4);
+        check_heap(detail::kIdOffsets, detail::kIdBytes, rows, limit);
+        check_heap(detail::kDictionaryOffsets, detail::kDictionaryBytes, footer_.places, limit);
+    }
+
+    // The last offset of a string table must stay inside the file; single
+    // strings are checked when read, which keeps opening O(1).
+    void check_heap(detail::Section offsets, detail::Section bytes, uint64_t count, uint64_t limit) const {
+        uint64_t start = footer_.offsets[bytes];
+        if (start > limit || column<uint32_t>(offsets)[count] > limit - start) {
+            throw std::runtime_error("Corrupt archive segment " + path_);
+        }
+    }
+
+    static binary::MappedFile map_segment(const std::filesystem::path &path) {
+        if (!detail::little_endian_host()) {
+            throw std::runtime_error("Archive segments can only be mapped on little-endian hosts");
+        }
+        return binary::MappedFile(path);
+    }
+
+    std::string path_;
+    binary::MappedFile file_;
+    const char *data_ = nullptr;
+    size_t size_ = 0;
+    Footer footer_;
+};
+
+// Calls visit(segment, row) for every archived row matching `query`, in
+// write order, mapping only the segments whose name and footer allow a
+// match. Meant for when no SegmentWriter is merging in the directory, e.g.
+// at startup: a merge removes the files it has merged.
+template <typename Visit>
+void scan(const std::filesystem::path &directory, const Query &query, Visit visit) {
+    for (const SegmentFile &file : list_segments(directory)) {
+        if (!file.may_match(query)) {
+            continue;
+        }
+        Segment segment(file.path);
+        if (!segment.may_match(query)) {
+            continue;
+        }
+        for (size_t row = 0; row < segment.size(); ++row) {
+            if (segment.matches(row, query)) {
+                visit(segment, row);
+            }
+        }
+    }
+}
+
+// Appends segments to a directory, one per non-empty write, and merges them
+// so that the number of files does not grow with the number of writes:
+// whenever the last kMergeFanIn segments each cover as many writes, they
+// are merged into one, which may in turn complete a run at the next size.
+// Every row is therefore rewritten about log16(writes) times. Runs whose
+// files add up to more than kMaxMergeBytes are left as they are; from
+// then on the files grow with the archive's size rather than with its
+// writes. A merge holds its rows and the merged segment in memory, about
+// twice that at most, which the cap keeps small beside --bounded-memory.
+//
+// The segments are listed on the first write and then tracked in memory,
+// so only one writer may use a directory at a time. A merge writes its
+// output before removing its inputs; if it is interrupted in between,
+// list_segments() ignores the inputs, and the next writer removes them.
+class SegmentWriter {
+public:
+    static constexpr size_t kMergeFanIn = 16;
+    static constexpr uint64_t kMaxMergeBytes = uint64_t(16) << 20;
+
+    explicit SegmentWriter(std::filesystem::path directory) : directory_(std::move(directory)) {}
+
+    // Writes `records` as the next segment, creating the directory when
+    // needed, then merges as described above. Nothing is written for an
+    // empty batch. Files appear atomically, so readers never map a partial
+    // segment.
+    void append(const columnar::RecordBatch &records) {
+        if (records.empty()) {
+            return;
+        }
+        std::filesystem::create_directories(directory_);
+        if (!listed_) {
+            std::vector<std::filesystem::path> superseded;
+            segments_ = list_segments(directory_, &superseded);
+            for (const std::filesystem::path &path : superseded) {
+                std::error_code error;
+                std::filesystem::remove(path, error);
+            }
+            listed_ = true;
+        }
+        const uint64_t number = segments_.empty() ? 1 : segments_.back().last + 1;
+        segments_.push_back(write(records, number, number));
+        merge();
+    }
+
+    // The segments as of the last write.
+    const std::vector<SegmentFile> &segments() const { return segments_; }
+
+private:
+    void merge() {
+        while (segments_.size() >= kMergeFanIn) {
+            const auto first = segments_.end() - static_cast<std::ptrdiff_t>(kMergeFanIn);
+            const uint64_t writes = first->last - first->first;
+            uint64_t bytes = 0;
+            for (auto it = first; it != segments_.end(); ++it) {
+                if (it->last - it->first != writes) {
+                    return;
+                }
+                bytes += it->bytes;
+            }
+            if (bytes > kMaxMergeBytes) {
+                return;
+            }
+            columnar::RecordBatch merged;
+            columnar::Row row;
+            for (auto it = first; it != segments_.end(); ++it) {
+                Segment segment(it->path);
+                merged.reserve(merged.size() + segment.size());
+                for (size_t index = 0; index < segment.size(); ++index) {
+                    segment.read(index, row);
+                    merged.append(row);
+                }
+            }
+            SegmentFile output = write(merged, first->first, segments_.back().last);
+            for (auto it = first; it != segments_.end(); ++it) {
+                std::error_code error;
+                std::filesystem::remove(it->path, error);
+            }
+            segments_.erase(first, segments_.end());
+            segments_.push_back(std::move(output));
+        }
+    }
+
+    SegmentFile write(const columnar::RecordBatch &records, uint64_t first, uint64_t last) const {
+        const std::vector<int64_t> &times = records.time_ms();
+        auto [min_time, max_time] = std::minmax_element(times.begin(), times.end());
+        std::string encoded = encode_segment(records);
+        SegmentFile file;
+        file.path = directory_ / segment_name(first, last, *min_time, *max_time);
+        file.first = first;
+        file.last = last;
+        file.times.emplace(*min_time, *max_time);
+        file.bytes = encoded.size();
+        binary::write_file_atomically(file.path, encoded);
+        return file;
+    }
+
+    std::filesystem::path directory_;
+    bool listed_ = false;
+    std::vector<SegmentFile> segments_;
+};
+
+} // namespace archive
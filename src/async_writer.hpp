@@ -0,0 +1,161 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "spsc_queue.hpp"
+
+namespace concurrency {
+
+// Hands jobs from one producer thread to a dedicated writer thread through
+// a bounded SpscQueue. The writer takes every job queued by the time it
+// wakes, up to the queue's capacity, and passes them to `write` together, so
+// jobs that piled up behind a slow disk are written in one go.
+//
+// submit() blocks while the queue is full, which bounds how far the
+// producer can run ahead. When `write` throws, the exception is kept and the
+// jobs behind it are discarded unwritten, since they may depend on the
+// failed one, until the producer collects it with drain(). Destroying the
+// writer writes the jobs still queued, unless a failure is pending, before
+// the thread exits.
+//
+// Neither side takes the mutex while jobs flow: a submit() locks it only
+// to sleep on a full queue or to wake a writer asleep on an empty one, and
+// the writer only to sleep, to wake a blocked submit() or to report that it
+// is idle. Each side sets a flag before it sleeps and checks the queue
+// after a fence, and the other side checks the flag after a fence once it
+// changed the queue, so at least one of them sees the other's change.
+template <typename Job>
+class AsyncWriter {
+public:
+    using Write = std::function<void(std::vector<Job> &)>;
+
+    AsyncWriter(size_t capacity, Write write)
+        : queue_(capacity), write_(std::move(write)), thread_([this] { run(); }) {}
+
+    AsyncWriter(const AsyncWriter &) = delete;
+    AsyncWriter &operator=(const AsyncWriter &) = delete;
+
+    ~AsyncWriter() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        ready_.notify_one();
+        thread_.join();
+    }
+
+    // Queues a job, waiting for room if the queue is full.
+    void submit(Job job) {
+        in_flight_.fetch_add(1, std::memory_order_relaxed);
+        while (!queue_.try_push(job)) {
+            std::unique_lock<std::mutex> lock(mutex_);
+            producer_waiting_.store(true, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            room_.wait(lock, [&] { return !queue_.full(); });
+            producer_waiting_.store(false, std::memory_order_relaxed);
+        }
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (consumer_waiting_.load(std::memory_order_relaxed)) {
+            // The writer holds the lock from setting its flag until it
+            // sleeps, so this cannot notify before it waits.
+            { std::lock_guard<std::mutex> lock(mutex_); }
+            ready_.notify_one();
+        }
+    }
+
+    // True once a write has failed and the failure was not yet drained.
+    bool failed() const { return failed_.load(std::memory_order_acquire); }
+
+    // Waits until every submitted job was written or discarded, then
+    // returns the first failure since the last drain(), if any, and accepts
+    // jobs again.
+    std::exception_ptr drain() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        idle_.wait(lock, [&] { return in_flight_.load(std::memory_order_acquire) == 0; });
+        std::exception_ptr error = std::exchange(error_, nullptr);
+        failed_.store(false, std::memory_order_release);
+        return error;
+    }
+
+    // drain(), rethrowing the failure.
+    void flush() {
+        if (std::exception_ptr error = drain()) {
+            std::rethrow_exception(error);
+        }
+    }
+
+private:
+    void run() {
+        std::vector<Job> batch;
+        batch.reserve(queue_.capacity());
+        for (;;) {
+            if (queue_.empty()) {
+                std::unique_lock<std::mutex> lock(mutex_);
+                consumer_waiting_.store(true, std::memory_order_relaxed);
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                ready_.wait(lock, [&] { return stopping_ || !queue_.empty(); });
+                consumer_waiting_.store(false, std::memory_order_relaxed);
+                if (stopping_ && queue_.empty()) {
+                    return;
+                }
+            }
+            while (batch.size() < queue_.capacity()) {
+                std::optional<Job> job = queue_.try_pop();
+                if (!job) {
+                    break;
+                }
+                batch.push_back(std::move(*job));
+            }
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (producer_waiting_.load(std::memory_order_relaxed)) {
+                { std::lock_guard<std::mutex> lock(mutex_); }
+                room_.notify_one();
+            }
+
+            if (!failed()) {
+                try {
+                    write_(batch);
+                } catch (...) {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    error_ = std::current_exception();
+                    failed_.store(true, std::memory_order_release);
+                }
+            }
+            const size_t done = batch.size();
+            batch.clear();
+            if (in_flight_.fetch_sub(done, std::memory_order_acq_rel) == done) {
+                // drain() checks in_flight_ under the lock.
+                { std::lock_guard<std::mutex> lock(mutex_); }
+                idle_.notify_all();
+            }
+        }
+    }
+
+    SpscQueue<Job> queue_;
+    Write write_;
+    std::mutex mutex_;
+    std::condition_variable ready_;
+    std::condition_variable room_;
+    std::condition_variable idle_;
+    // Submitted jobs not yet written or discarded.
+    std::atomic<size_t> in_flight_{0};
+    // Set while the producer sleeps on room_ and the writer on ready_.
+    std::atomic<bool> producer_waiting_{false};
+    std::atomic<bool> consumer_waiting_{false};
+    bool stopping_ = false;
+    std::exception_ptr error_;
+    std::atomic<bool> failed_{false};
+    // Last, so it starts after everything it uses.
+    std::thread thread_;
+};
+
+} // namespace concurrency
@@ -0,0 +1,220 @@
+#pragma once
+
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace binary {
+
+// Little-endian encoders for the pipeline's state files.
+inline void put_u32(std::string &out, uint32_t value) {
+    for (int i = 0; i < 4; ++i) {
+        out.push_back(static_cast<char>((value >> (8 * i)) & 0xFF));
+    }
+}
+
+inline void put_u64(std::string &out, uint64_t value) {
+    for (int i = 0; i < 8; ++i) {
+        out.push_back(static_cast<char>((value >> (8 * i)) & 0xFF));
+    }
+}
+
+inline void put_i64(std::string &out, int64_t value) {
+    put_u64(out, static_cast<uint64_t>(value));
+}
+
+inline void put_f64(std::string &out, double value) {
+    uint64_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    put_u64(out, bits);
+}
+
+// Bounds-checked decoder over an in-memory file. `what` names the file
+// kind in the error thrown on truncation.
+class Reader {
+public:
+    Reader(const char *first, const char *last, std::string what)
+        : position_(first), end_(last), what_(std::move(what)) {}
+
+    std::string_view bytes(size_t count) {
+        if (static_cast<size_t>(end_ - position_) < count) {
+            throw std::runtime_error("Truncated " + what_);
+        }
+        std::string_view result(position_, count);
+        position_ += count;
+        return result;
+    }
+
+    uint32_t u32() {
+        std::string_view raw = bytes(4);
+        uint32_t value = 0;
+        for (int i = 3; i >= 0; --i) {
+            value = (value << 8) | static_cast<unsigned char>(raw[static_cast<size_t>(i)]);
+        }
+        return value;
+    }
+
+    uint64_t u64() {
+        std::string_view raw = bytes(8);
+        uint64_t value = 0;
+        for (int i = 7; i >= 0; --i) {
+            value = (value << 8) | static_cast<unsigned char>(raw[static_cast<size_t>(i)]);
+        }
+        return value;
+    }
+
+    int64_t i64() {
+        return static_cast<int64_t>(u64());
+    }
+
+    double f64() {
+        uint64_t bits = u64();
+        double value;
+        std::memcpy(&value, &bits, sizeof(value));
+        return value;
+    }
+
+    bool done() const { return position_ == end_; }
+    size_t remaining() const { return static_cast<size_t>(end_ - position_); }
+
+private:
+    const char *position_;
+    const char *end_;
+    std::string what_;
+};
+
+// The whole file, read into a buffer of its size, or nothing if it does
+// not exist. Any other failure throws: a state file that exists but cannot
+// be read must not pass for a missing one.
+inline std::optional<std::vector<char>> read_file(const std::filesystem::path &path) {
+    const std::string name = path.string();
+    int fd = ::open(name.c_str(), O_RDONLY);
+    if (fd < 0) {
+        if (errno == ENOENT) {
+            return std::nullopt;
+        }
+        throw std::runtime_error("Failed to open " + name + ": " + std::strerror(errno));
+    }
+    struct stat info;
+    if (::fstat(fd, &info) != 0) {
+        const int error = errno;
+        ::close(fd);
+        throw std::runtime_error("Failed to stat " + name + ": " + std::strerror(error));
+    }
+    std::vector<char> data(static_cast<size_t>(info.st_size));
+    // One read, unless it is interrupted or the file is larger than a
+    // single read returns.
+    size_t done = 0;
+    while (done < data.size()) {
+        ssize_t count = ::read(fd, data.data() + done, data.size() - done);
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+        if (count <= 0) {
+            const int error = count < 0 ? errno : 0;
+            ::close(fd);
+            throw std::runtime_error("Failed to read " + name + ": " +
+                                     (count < 0 ? std::strerror(error) : "file shrank while read"));
+        }
+        done += static_cast<size_t>(count);
+    }
+    ::close(fd);
+    return data;
+}
+
+// Replaces `path` through a temporary file, so readers never see a
+// partial write.
+inline void write_file_atomically(const std::filesystem::path &path, std::string_view data) {
+    std::filesystem::path temporary = path;
+    temporary += ".tmp";
+    {
+        std::ofstream out(temporary, std::ios::binary | std::ios::trunc);
+        if (!out || !out.write(data.data(), static_cast<std::streamsize>(data.size())) || !out.flush()) {
+            throw std::runtime_error("Failed to write " + temporary.string());
+        }
+    }
+    std::filesystem::rename(temporary, path);
+}
+
+// A whole file mapped read-only. The view stays valid, at the same
+// address, for as long as some MappedFile owns the mapping.
+class MappedFile {
+public:
+    explicit MappedFile(const std::filesystem::path &path) {
+        const std::string name = path.string();
+        int fd = ::open(name.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw std::runtime_error("Failed to open " + name);
+        }
+        struct stat info;
+        if (::fstat(fd, &info) != 0) {
+            ::close(fd);
+            throw std::runtime_error("Failed to stat " + name);
+        }
+        size_ = static_cast<size_t>(info.st_size);
+        // mmap rejects empty ranges; an empty file is an empty view.
+        if (size_ > 0) {
+            void *mapping = ::mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapping == MAP_FAILED) {
+                ::close(fd);
+                throw std::runtime_error("Failed to map " + name);
+            }
+            data_ = static_cast<const char *>(mapping);
+        }
+        ::close(fd);
+    }
+
+    MappedFile(MappedFile &&other) noexcept
+        : data_(std::exchange(other.data_, nullptr)), size_(std::exchange(other.size_, 0)) {}
+
+    MappedFile &operator=(MappedFile &&other) noexcept {
+        if (this != &other) {
+            unmap();
+            data_ = std::exchange(other.data_, nullptr);
+            size_ = std::exchange(other.size_, 0);
+        }
+        return *this;
+    }
+
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    ~MappedFile() { unmap(); }
+
+    std::string_view view() const { return std::string_view(data_, size_); }
+
+    // Hints that the file will be read once from front to back, so the
+    // kernel reads ahead aggressively and drops pages behind the reader.
+    void advise_sequential() const {
+        if (data_) {
+            ::madvise(const_cast<char *>(data_), size_, MADV_SEQUENTIAL);
+        }
+    }
+
+private:
+    void unmap() {
+        if (data_) {
+            ::munmap(const_cast<char *>(data_), size_);
+            data_ = nullptr;
+        }
+    }
+
+    const char *data_ = nullptr;
+    size_t size_ = 0;
+};
+
+} // namespace binary
@@ -0,0 +1,176 @@
+#pragma once
+
+#include <algorithm>
+#include <charconv>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <vector>
+
+namespace csv {
+
+// How floating-point fields are rendered. Shortest emits the fewest digits
+// that parse back to the same double; Fixed always emits `digits` decimals.
+struct NumberFormat {
+    enum class Style { Shortest, Fixed };
+
+    Style style = Style::Shortest;
+    int digits = 0;
+
+    static NumberFormat shortest() { return {}; }
+    static NumberFormat fixed(int digits) { return {Style::Fixed, digits}; }
+};
+
+// Buffered CSV writer. Fields are formatted with std::to_chars and escaped
+// directly into one reusable buffer, which is handed to the OS in large
+// writes, so a row costs no allocations, locale lookups or virtual calls.
+class Writer {
+public:
+    static constexpr size_t kDefaultBufferSize = 1 << 16;
+
+    Writer(const std::filesystem::path &path, bool append, size_t buffer_size = kDefaultBufferSize)
+        : path_(path.string()), buffer_(std::max<size_t>(buffer_size, 64)) {
+        file_ = std::fopen(path_.c_str(), append ? "ab" : "wb");
+        if (!file_) {
+            throw std::runtime_error("Failed to open " + path.filename().string() + " for writing");
+        }
+        // The writer does its own buffering; stdio's would only add a copy.
+        std::setvbuf(file_, nullptr, _IONBF, 0);
+    }
+
+    Writer(const Writer &) = delete;
+    Writer &operator=(const Writer &) = delete;
+
+    // Flushes on a best-effort basis; call close() to observe write errors.
+    ~Writer() {
+        if (file_) {
+            try {
+                flush();
+            } catch (...) {
+            }
+            std::fclose(file_);
+        }
+    }
+
+    // Writes a text field, quoting it only when it contains a separator,
+    // quote or newline.
+    void field(std::string_view value) {
+        separate();
+        if (value.find_first_of(",\"\n") == std::string_view::npos) {
+            put(value);
+            return;
+        }
+        char *out = reserve(value.size() * 2 + 2);
+        *out++ = '"';
+        for (char ch : value) {
+            if (ch == '"') {
+                *out++ = '"';
+            }
+            *out++ = ch;
+        }
+        *out++ = '"';
+        commit(out);
+    }
+
+    void field(double value, NumberFormat format = {}) {
+        separate();
+        // Fixed notation of the largest doubles needs over 300 digits.
+        char *out = reserve(format.style == NumberFormat::Style::Fixed ? 330 + static_cast<size_t>(format.digits) : 32);
+        char *last = buffer_.data() + buffer_.size();
+        std::to_chars_result result = format.style == NumberFormat::Style::Fixed
+                                          ? std::to_chars(out, last, value, std::chars_format::fixed, format.digits)
+                                          : std::to_chars(out, last, value);
+        if (result.ec != std::errc()) {
+            throw std::runtime_error("Failed to format number for " + path_);
+        }
+        commit(result.ptr);
+    }
+
+    // Missing values are written as empty fields.
+    void field(const std::optional<double> &value, NumberFormat format = {}) {
+        if (value) {
+            field(*value, format);
+        } else {
+            separate();
+        }
+    }
+
+    // Writes a field that is known not to need quoting.
+    void raw_field(std::string_view value) {
+        separate();
+        put(value);
+    }
+
+    void end_row() {
+        *reserve(1) = '\n';
+        ++used_;
+        at_row_start_ = true;
+    }
+
+    void flush() {
+        if (used_ == 0) {
+            return;
+        }
+        size_t written = std::fwrite(buffer_.data(), 1, used_, file_);
+        if (written != used_) {
+            used_ = 0;
+            throw std::runtime_error("Failed to write " + path_);
+        }
+        used_ = 0;
+    }
+
+    void close() {
+        flush();
+        int result = std::fclose(file_);
+        file_ = nullptr;
+        if (result != 0) {
+            throw std::runtime_error("Failed to close " + path_);
+        }
+    }
+
+private:
+    void separate() {
+        if (at_row_start_) {
+            at_row_start_ = false;
+            return;
+        }
+        *reserve(1) = ',';
+        ++used_;
+    }
+
+    void put(std::string_view text) {
+        char *out = reserve(text.size());
+        std::memcpy(out, text.data(), text.size());
+        used_ += text.size();
+    }
+
+    // Returns space for at least `size` bytes, flushing or (for oversized
+    // fields) growing the buffer as needed.
+    char *reserve(size_t size) {
+        if (buffer_.size() - used_ < size) {
+            flush();
+            if (buffer_.size() < size) {
+                buffer_.resize(size);
+            }
+        }
+        return buffer_.data() + used_;
+    }
+
+    void commit(char *end) {
+        used_ = static_cast<size_t>(end - buffer_.data());
+    }
+
+    std::string path_;
+    std::FILE *file_ = nullptr;
+    std::vector<char> buffer_;
+    size_t used_ = 0;
+    bool at_row_start_ = true;
+};
+
+} // namespace csv
@@ -0,0 +1,158 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <limits>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "binary_io.hpp"
+
+namespace dedup {
+
+// Persistent set of the events already written, keyed by feed event id.
+// Each entry keeps the event time (for retention) and the last `updated`
+// stamp written, so revised events can be told apart from repeats, plus the
+// magnitude and depth that went into the aggregate report, so a revision can
+// take the old values back out.
+//
+// On disk the index is a single binary run: the magic "EQIDX002", an entry
+// count, then per entry the event time, updated time (little-endian int64),
+// magnitude and depth (float64, NaN when absent) and a length-prefixed id.
+// It is read with one read() and rewritten atomically through a temporary
+// file. "EQIDX001" files, which lack the two values, are still read.
+class EventIndex {
+public:
+    struct Entry {
+        int64_t time_ms = 0;
+        int64_t updated_ms = 0;
+        std::optional<double> magnitude;
+        std::optional<double> depth_km;
+        // False for entries from an older index that never fed the
+        // aggregates; their values are unknown.
+        bool counted = false;
+    };
+
+    // A missing file yields an empty index.
+    static EventIndex load(const std::filesystem::path &path) {
+        EventIndex index;
+        std::optional<std::vector<char>> data = binary::read_file(path);
+        if (!data) {
+            return index;
+        }
+
+        binary::Reader reader(data->data(), data->data() + data->size(), "event index");
+        std::string_view magic = reader.bytes(kMagic.size());
+        bool counted = magic == kMagic;
+        if (!counted && magic != kMagicV1) {
+            throw std::runtime_error("Unrecognized event index " + path.string());
+        }
+        uint64_t count = reader.u64();
+        // Every entry takes at least its fixed fields and an empty id, so a
+        // count the file cannot hold is corrupt, not a reason to reserve.
+        const size_t entry_bytes = (counted ? 32 : 16) + 4;
+        if (count > reader.remaining() / entry_bytes) {
+            throw std::runtime_error("Truncated event index " + path.string());
+        }
+        index.entries_.reserve(static_cast<size_t>(count));
+        for (uint64_t i = 0; i < count; ++i) {
+            Entry entry;
+            entry.time_ms = reader.i64();
+            entry.updated_ms = reader.i64();
+            if (counted) {
+                entry.magnitude = from_stored(reader.f64());
+                entry.depth_km = from_stored(reader.f64());
+                entry.counted = true;
+            }
+            uint32_t length = reader.u32();
+            index.entries_.emplace(std::string(reader.bytes(length)), entry);
+        }
+        return index;
+    }
+
+    // True when `id` has not been written yet, or only an older revision of
+    // it has.
+    bool is_new_or_revised(std::string_view id, int64_t updated_ms) const {
+        const Entry *entry = find(id);
+        return !entry || updated_ms > entry->updated_ms;
+    }
+
+    const Entry *find(std::string_view id) const {
+        // Feed ids are short enough for the small-string buffer, so building
+        // the key does not allocate.
+        auto it = entries_.find(std::string(id));
+        return it == entries_.end() ? nullptr : &it->second;
+    }
+
+    void record(std::string_view id, int64_t time_ms, int64_t updated_ms, std::optional<double> magnitude,
+                std::optional<double> depth_km) {
+        Entry &entry = entries_[std::string(id)];
+        entry.time_ms = time_ms;
+        entry.updated_ms = std::max(entry.updated_ms, updated_ms);
+        entry.magnitude = magnitude;
+        entry.depth_km = depth_km;
+        entry.counted = true;
+    }
+
+    // Forgets events older than `cutoff_ms`, bounding the index to the
+    // retention window. A forgotten event that shows up again is new to
+    // the index, and its earlier values can no longer be taken out of the
+    // aggregates. Returns the number of entries removed.
+    size_t prune(int64_t cutoff_ms) {
+        size_t removed = 0;
+        for (auto it = entries_.begin(); it != entries_.end();) {
+            if (it->second.time_ms < cutoff_ms) {
+                it = entries_.erase(it);
+                ++removed;
+            } else {
+                ++it;
+            }
+        }
+        return removed;
+    }
+
+    void save(const std::filesystem::path &path) const { binary::write_file_atomically(path, encode()); }
+
+    // The file contents save() writes.
+    std::string encode() const {
+        std::string data(kMagic);
+        binary::put_u64(data, entries_.size());
+        for (const auto &[id, entry] : entries_) {
+            binary::put_i64(data, entry.time_ms);
+            binary::put_i64(data, entry.updated_ms);
+            binary::put_f64(data, to_stored(entry.magnitude));
+            binary::put_f64(data, to_stored(entry.depth_km));
+            binary::put_u32(data, static_cast<uint32_t>(id.size()));
+            data += id;
+        }
+        return data;
+    }
+
+    size_t size() const { return entries_.size(); }
+
+private:
+    static constexpr std::string_view kMagic = "EQIDX002";
+    static constexpr std::string_view kMagicV1 = "EQIDX001";
+
+    static double to_stored(std::optional<double> value) {
+        return value.value_or(std::numeric_limits<double>::quiet_NaN());
+    }
+
+    static std::optional<double> from_stored(double value) {
+        if (std::isnan(value)) {
+            return std::nullopt;
+        }
+        return value;
+    }
+
+    std::unordered_map<std::string, Entry> entries_;
+};
+
+} // namespace dedup
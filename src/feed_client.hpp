@@ -0,0 +1,354 @@
+#pragma once
+
+#include <curl/curl.h>
+
+#include <atomic>
+#include <cctype>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace feed {
+
+using ChunkSink = std::function<void(std::string_view)>;
+
+// Outcome of one FeedClient::fetch. The validators describe the response
+// that was received; they only take effect for the next request once the
+// caller has consumed the body successfully and passes them to
+// FeedClient::commit.
+struct FetchResult {
+    bool not_modified = false;
+    std::string etag;
+    std::string last_modified;
+    // Body size as transferred (possibly compressed) and after decoding.
+    curl_off_t wire_bytes = 0;
+    curl_off_t decoded_bytes = 0;
+    // When each phase of the transfer ended, in seconds since it started,
+    // as curl reports them; phases that were skipped, such as DNS and TLS
+    // on a reused connection, are zero.
+    struct Timings {
+        double name_lookup = 0.0;
+        double connect = 0.0;
+        double tls = 0.0;
+        double first_byte = 0.0;
+        double total = 0.0;
+    } timings;
+};
+
+// A connection, including DNS and TLS, must be set up within
+// kConnectTimeoutSeconds, and a transfer that receives less than a byte per
+// second for kStallSeconds is aborted, so that a dead server or network
+// fails the feed instead of holding up every later cycle. The stall limit
+// is loose because, in bounded memory mode, the body is parsed and written
+// inside the write callback, during which nothing is received.
+constexpr long kConnectTimeoutSeconds = 15;
+constexpr long kStallSeconds = 60;
+
+// Fetches one feed URL over a long-lived easy handle, so repeated fetches
+// reuse the connection and TLS session. Requests are made conditional on
+// the ETag/Last-Modified of the last committed response, letting the server
+// answer 304 when the feed has not been regenerated.
+class FeedClient {
+public:
+    explicit FeedClient(std::string url) : url_(std::move(url)), curl_(curl_easy_init()) {
+        if (!curl_) {
+            throw std::runtime_error("Failed to initialize CURL");
+        }
+        curl_easy_setopt(curl_, CURLOPT_URL, url_.c_str());
+        curl_easy_setopt(curl_, CURLOPT_WRITEFUNCTION, write_callback);
+        curl_easy_setopt(curl_, CURLOPT_WRITEDATA, &transfer_);
+        curl_easy_setopt(curl_, CURLOPT_HEADERFUNCTION, header_callback);
+        curl_easy_setopt(curl_, CURLOPT_HEADERDATA, &transfer_);
+        curl_easy_setopt(curl_, CURLOPT_USERAGENT, "earthquake-data-pipeline/1.0");
+        curl_easy_setopt(curl_, CURLOPT_FOLLOWLOCATION, 1L);
+        curl_easy_setopt(curl_, CURLOPT_TCP_KEEPALIVE, 1L);
+        curl_easy_setopt(curl_, CURLOPT_CONNECTTIMEOUT, kConnectTimeoutSeconds);
+        curl_easy_setopt(curl_, CURLOPT_LOW_SPEED_LIMIT, 1L);
+        curl_easy_setopt(curl_, CURLOPT_LOW_SPEED_TIME, kStallSeconds);
+        // An empty string offers every encoding this libcurl can decode
+        // (gzip, and brotli/zstd when built in). Bodies are decompressed
+        // incrementally before they reach the write callback.
+        curl_easy_setopt(curl_, CURLOPT_ACCEPT_ENCODING, "");
+    }
+
+    // Aborts transfers in flight once `*flag` becomes true.
+    void set_cancel_flag(const std::atomic<bool> *flag) {
+        curl_easy_setopt(curl_, CURLOPT_XFERINFOFUNCTION, progress_callback);
+        curl_easy_setopt(curl_, CURLOPT_XFERINFODATA, flag);
+        curl_easy_setopt(curl_, CURLOPT_NOPROGRESS, flag ? 0L : 1L);
+    }
+
+    // Aborts transfers whose decoded body grows past `max_bytes`; 0 for no
+    // limit.
+    void set_max_bytes(uint64_t max_bytes) { max_bytes_ = max_bytes; }
+
+    FeedClient(const FeedClient &) = delete;
+    FeedClient &operator=(const FeedClient &) = delete;
+
+    ~FeedClient() {
+        curl_easy_cleanup(curl_);
+        curl_slist_free_all(request_headers_);
+    }
+
+    const std::string &url() const { return url_; }
+    CURL *handle() const { return curl_; }
+
+    // Downloads the feed, passing the body to `sink` as it arrives. A 304
+    // response delivers no body and is reported through not_modified.
+    FetchResult fetch(const ChunkSink &sink) {
+        begin(sink);
+        return complete(curl_easy_perform(curl_));
+    }
+
+    // Split form of fetch() for driving the handle from a multi handle:
+    // begin() prepares the transfer, the caller performs it, and complete()
+    // turns its result into a FetchResult or an exception. `sink` must stay
+    // alive until complete() returns.
+    void begin(const ChunkSink &sink) {
+        set_conditional_headers();
+        transfer_ = Transfer{};
+        transfer_.curl = curl_;
+        transfer_.sink = &sink;
+        transfer_.max_bytes = max_bytes_;
+    }
+
+    FetchResult complete(CURLcode result) {
+        long response_code = 0;
+        curl_easy_getinfo(curl_, CURLINFO_RESPONSE_CODE, &response_code);
+
+        if (transfer_.error) {
+            std::rethrow_exception(transfer_.error);
+        }
+        if (response_code >= 400) {
+            std::ostringstream oss;
+            oss << "HTTP error " << response_code;
+            throw std::runtime_error(oss.str());
+        }
+        if (result != CURLE_OK) {
+            throw std::runtime_error(std::string("Failed to fetch feed: ") + curl_easy_strerror(result));
+        }
+
+        FetchResult fetched;
+        fetched.not_modified = response_code == 304;
+        fetched.etag = std::move(transfer_.etag);
+        fetched.last_modified = std::move(transfer_.last_modified);
+        curl_easy_getinfo(curl_, CURLINFO_SIZE_DOWNLOAD_T, &fetched.wire_bytes);
+        fetched.decoded_bytes = transfer_.decoded_bytes;
+        fetched.timings.name_lookup = seconds(CURLINFO_NAMELOOKUP_TIME_T);
+        fetched.timings.connect = seconds(CURLINFO_CONNECT_TIME_T);
+        fetched.timings.tls = seconds(CURLINFO_APPCONNECT_TIME_T);
+        fetched.timings.first_byte = seconds(CURLINFO_STARTTRANSFER_TIME_T);
+        fetched.timings.total = seconds(CURLINFO_TOTAL_TIME_T);
+        return fetched;
+    }
+
+    // Makes the validators of a fully processed response the condition for
+    // the next request.
+    void commit(const FetchResult &fetched) {
+        if (fetched.not_modified) {
+            return;
+        }
+        etag_ = fetched.etag;
+        last_modified_ = fetched.last_modified;
+    }
+
+private:
+    double seconds(CURLINFO info) const {
+        curl_off_t microseconds = 0;
+        curl_easy_getinfo(curl_, info, &microseconds);
+        return static_cast<double>(microseconds) / 1e6;
+    }
+
+    struct Transfer {
+        CURL *curl = nullptr;
+        const ChunkSink *sink = nullptr;
+        std::exception_ptr error;
+        std::string etag;
+        std::string last_modified;
+        curl_off_t decoded_bytes = 0;
+        uint64_t max_bytes = 0;
+    };
+
+    void set_conditional_headers() {
+        curl_slist_free_all(request_headers_);
+        request_headers_ = nullptr;
+        if (!etag_.empty()) {
+            request_headers_ = curl_slist_append(request_headers_, ("If-None-Match: " + etag_).c_str());
+        }
+        if (!last_modified_.empty()) {
+            request_headers_ = curl_slist_append(request_headers_, ("If-Modified-Since: " + last_modified_).c_str());
+        }
+        curl_easy_setopt(curl_, CURLOPT_HTTPHEADER, request_headers_);
+    }
+
+    // Hands each received chunk to the sink. Exceptions must not unwind
+    // through libcurl, so they are parked in the transfer and abort it.
+    static size_t write_callback(void *contents, size_t size, size_t nmemb, void *userp) {
+        size_t real_size = size * nmemb;
+        auto *transfer = static_cast<Transfer *>(userp);
+
+        long response_code = 0;
+        curl_easy_getinfo(transfer->curl, CURLINFO_RESPONSE_CODE, &response_code);
+        if (response_code >= 400) {
+            return 0;
+        }
+
+        transfer->decoded_bytes += static_cast<curl_off_t>(real_size);
+        if (transfer->max_bytes > 0 && static_cast<uint64_t>(transfer->decoded_bytes) > transfer->max_bytes) {
+            transfer->error = std::make_exception_ptr(
+                std::runtime_error("Feed body exceeds " + std::to_string(transfer->max_bytes) + " bytes"));
+            return 0;
+        }
+        try {
+            (*transfer->sink)(std::string_view(static_cast<char *>(contents), real_size));
+        } catch (...) {
+            transfer->error = std::current_exception();
+            return 0;
+        }
+        return real_size;
+    }
+
+    static int progress_callback(void *userp, curl_off_t, curl_off_t, curl_off_t, curl_off_t) {
+        return static_cast<const std::atomic<bool> *>(userp)->load() ? 1 : 0;
+    }
+
+    // Collects the validators of the final response; a status line starts
+    // a new response when redirects are followed.
+    static size_t header_callback(char *buffer, size_t size, size_t nitems, void *userp) {
+        size_t real_size = size * nitems;
+        auto *transfer = static_cast<Transfer *>(userp);
+        std::string_view line(buffer, real_size);
+
+        if (line.substr(0, 5) == "HTTP/") {
+            transfer->etag.clear();
+            transfer->last_modified.clear();
+        } else if (header_name_is(line, "etag")) {
+            transfer->etag = header_value(line);
+        } else if (header_name_is(line, "last-modified")) {
+            transfer->last_modified = header_value(line);
+        }
+        return real_size;
+    }
+
+    static bool header_name_is(std::string_view line, std::string_view name) {
+        if (line.size() <= name.size() || line[name.size()] != ':') {
+            return false;
+        }
+        for (size_t i = 0; i < name.size(); ++i) {
+            if (std::tolower(static_cast<unsigned char>(line[i])) != name[i]) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    static std::string header_value(std::string_view line) {
+        line.remove_prefix(line.find(':') + 1);
+        while (!line.empty() && (line.front() == ' ' || line.front() == '\t')) {
+            line.remove_prefix(1);
+        }
+        while (!line.empty() && std::isspace(static_cast<unsigned char>(line.back()))) {
+            line.remove_suffix(1);
+        }
+        return std::string(line);
+    }
+
+    std::string url_;
+    CURL *curl_;
+    curl_slist *request_headers_ = nullptr;
+    std::string etag_;
+    std::string last_modified_;
+    uint64_t max_bytes_ = 0;
+    Transfer transfer_;
+};
+
+// Outcome of one transfer run by MultiFetcher: either a result or the
+// exception FeedClient::complete raised.
+struct FetchOutcome {
+    FetchResult transfer;
+    std::exception_ptr error;
+};
+
+// Runs the transfers of several FeedClients concurrently on one thread via
+// a curl multi handle. The multi handle is kept between calls so its
+// connection cache (and with it keep-alive and TLS session reuse) survives
+// from one cycle to the next.
+class MultiFetcher {
+public:
+    MultiFetcher() : multi_(curl_multi_init()) {
+        if (!multi_) {
+            throw std::runtime_error("Failed to initialize CURL multi handle");
+        }
+    }
+
+    MultiFetcher(const MultiFetcher &) = delete;
+    MultiFetcher &operator=(const MultiFetcher &) = delete;
+
+    ~MultiFetcher() {
+        curl_multi_cleanup(multi_);
+    }
+
+    // Fetches every client at once; sinks[i] receives the body of
+    // clients[i]. Returns one outcome per client, in the same order.
+    std::vector<FetchOutcome> fetch_all(const std::vector<FeedClient *> &clients, const std::vector<ChunkSink> &sinks) {
+        std::vector<FetchOutcome> outcomes(clients.size());
+        for (size_t i = 0; i < clients.size(); ++i) {
+            clients[i]->begin(sinks[i]);
+            curl_easy_setopt(clients[i]->handle(), CURLOPT_PRIVATE, reinterpret_cast<char *>(i));
+            check(curl_multi_add_handle(multi_, clients[i]->handle()));
+        }
+
+        int running = 0;
+        size_t finished = 0;
+        try {
+            do {
+                check(curl_multi_perform(multi_, &running));
+                int queued = 0;
+                while (CURLMsg *message = curl_multi_info_read(multi_, &queued)) {
+                    if (message->msg != CURLMSG_DONE) {
+                        continue;
+                    }
+                    char *tag = nullptr;
+                    curl_easy_getinfo(message->easy_handle, CURLINFO_PRIVATE, &tag);
+                    auto index = reinterpret_cast<size_t>(tag);
+                    CURLcode result = message->data.result;
+                    curl_multi_remove_handle(multi_, message->easy_handle);
+                    ++finished;
+                    try {
+                        outcomes[index].transfer = clients[index]->complete(result);
+                    } catch (...) {
+                        outcomes[index].error = std::current_exception();
+                    }
+                }
+                if (running > 0) {
+                    check(curl_multi_poll(multi_, nullptr, 0, 1000, nullptr));
+                }
+            } while (running > 0 || finished < clients.size());
+        } catch (...) {
+            for (FeedClient *client : clients) {
+                curl_multi_remove_handle(multi_, client->handle());
+            }
+            throw;
+        }
+        return outcomes;
+    }
+
+private:
+    static void check(CURLMcode code) {
+        if (code != CURLM_OK) {
+            throw std::runtime_error(std::string("CURL multi error: ") + curl_multi_strerror(code));
+        }
+    }
+
+    CURLM *multi_;
+};
+
+} // namespace feed
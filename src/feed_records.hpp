@@ -0,0 +1,530 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <iterator>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "json.hpp"
+#include "record_batch.hpp"
+#include "thread_pool.hpp"
+
+namespace records {
+
+using columnar::RecordBatch;
+
+// The parts of a feed document the extractor descends into.
+enum class Scope : uint8_t { Document, Root, Metadata, Features, Feature, Properties, Geometry, Coordinates };
+
+// Fields of the document itself rather than of a feature.
+struct FeedMetadata {
+    // metadata.generated: when the server last regenerated the feed.
+    std::optional<int64_t> generated_ms;
+};
+
+// One member of the projection: a key of the objects in `scope`, and either
+// the scope its value opens or the Row or FeedMetadata field its value is
+// stored in.
+struct Member {
+    Scope scope;
+    std::string_view key;
+    // Document for a leaf.
+    Scope opens = Scope::Document;
+    int64_t columnar::Row::*integer = nullptr;
+    std::optional<double> columnar::Row::*number = nullptr;
+    std::string columnar::Row::*text = nullptr;
+    std::optional<int64_t> FeedMetadata::*metadata = nullptr;
+    // Features lacking a required member are dropped.
+    bool required = false;
+};
+
+constexpr Member opens(Scope scope, std::string_view key, Scope child, bool required = false) {
+    Member member{scope, key};
+    member.opens = child;
+    member.required = required;
+    return member;
+}
+
+constexpr Member integer_field(Scope scope, std::string_view key, int64_t columnar::Row::*field,
+                               bool required = false) {
+    Member member{scope, key};
+    member.integer = field;
+    member.required = required;
+    return member;
+}
+
+constexpr Member number_field(Scope scope, std::string_view key, std::optional<double> columnar::Row::*field) {
+    Member member{scope, key};
+    member.number = field;
+    return member;
+}
+
+constexpr Member text_field(Scope scope, std::string_view key, std::string columnar::Row::*field) {
+    Member member{scope, key};
+    member.text = field;
+    return member;
+}
+
+constexpr Member metadata_field(Scope scope, std::string_view key, std::optional<int64_t> FeedMetadata::*field) {
+    Member member{scope, key};
+    member.metadata = field;
+    return member;
+}
+
+// Everything taken from a feed. Members under any other key are skipped by
+// the parser without being decoded, so a field costs nothing until it is
+// listed here; adding a column takes its Row and RecordBatch fields and one
+// line below.
+inline constexpr Member kProjection[] = {
+    opens(Scope::Root, "metadata", Scope::Metadata),
+    metadata_field(Scope::Metadata, "generated", &FeedMetadata::generated_ms),
+    opens(Scope::Root, "features", Scope::Features),
+    opens(Scope::Feature, "properties", Scope::Properties, true),
+    opens(Scope::Feature, "geometry", Scope::Geometry, true),
+    text_field(Scope::Feature, "id", &columnar::Row::id),
+    integer_field(Scope::Properties, "time", &columnar::Row::time_ms, true),
+    integer_field(Scope::Properties, "updated", &columnar::Row::updated_ms),
+    number_field(Scope::Properties, "mag", &columnar::Row::magnitude),
+    text_field(Scope::Properties, "place", &columnar::Row::place),
+    integer_field(Scope::Properties, "tsunami", &columnar::Row::tsunami),
+    opens(Scope::Geometry, "coordinates", Scope::Coordinates),
+};
+
+// geometry.coordinates, by position.
+inline constexpr std::optional<double> columnar::Row::*kCoordinates[] = {
+    &columnar::Row::longitude, &columnar::Row::latitude, &columnar::Row::depth_km};
+
+namespace detail {
+
+constexpr std::size_t kMemberCount = std::size(kProjection);
+static_assert(kMemberCount <= 32, "Presence of members is tracked in a 32-bit mask");
+
+// A key's length, first, middle and last byte, and the scope it appears
+// in. Cheap to compute from a key the parser has just delimited, and enough
+// to tell the projected keys apart; build_key_table() checks that they are.
+constexpr uint32_t key_mix(Scope scope, std::string_view key) {
+    uint32_t mix = static_cast<uint32_t>(scope);
+    mix = mix * 131 + static_cast<uint32_t>(key.size());
+    mix = mix * 131 + static_cast<unsigned char>(key[0]);
+    mix = mix * 131 + static_cast<unsigned char>(key[key.size() / 2]);
+    return mix * 131 + static_cast<unsigned char>(key[key.size() - 1]);
+}
+
+// A perfect hash of the projected keys: a multiplier under which every
+// key's mix lands in a slot of its own, found at compile time. Matching a
+// key then takes one multiplication, one table load and one comparison
+// against the only projected key it can be.
+struct KeyTable {
+    static constexpr unsigned kBits = 6;
+
+    uint32_t multiplier = 0;
+    // Index into kProjection plus one; 0 for an empty slot.
+    std::array<uint8_t, std::size_t{1} << kBits> slots{};
+
+    constexpr std::size_t slot(uint32_t mix) const { return (mix * multiplier) >> (32 - kBits); }
+};
+
+constexpr KeyTable build_key_table() {
+    for (uint32_t attempt = 0; attempt < 4096; ++attempt) {
+        KeyTable table;
+        table.multiplier = 0x9E3779B1u + 2 * attempt;
+        bool unique = true;
+        for (std::size_t i = 0; i < kMemberCount && unique; ++i) {
+            uint8_t &slot = table.slots[table.slot(key_mix(kProjection[i].scope, kProjection[i].key))];
+            unique = slot == 0;
+            slot = static_cast<uint8_t>(i + 1);
+        }
+        if (unique) {
+            return table;
+        }
+    }
+    return KeyTable{};
+}
+
+inline constexpr KeyTable kKeyTable = build_key_table();
+static_assert(kKeyTable.multiplier != 0, "No perfect hash for the projected keys; extend key_mix()");
+
+constexpr std::size_t member_index(Scope scope, std::string_view key) {
+    for (std::size_t i = 0; i < kMemberCount; ++i) {
+        if (kProjection[i].scope == scope && kProjection[i].key == key) {
+            return i;
+        }
+    }
+    return kMemberCount;
+}
+
+constexpr uint32_t required_mask() {
+    uint32_t mask = 0;
+    for (std::size_t i = 0; i < kMemberCount; ++i) {
+        mask |= kProjection[i].required ? uint32_t{1} << i : 0;
+    }
+    return mask;
+}
+
+} // namespace detail
+
+// Called with each complete feature as soon as it is parsed, before it is
+// appended to the batch.
+using RowObserver = std::function<void(const columnar::Row &)>;
+
+// Receives the records extracted while they are streamed out in batches.
+// The batch is emptied once the call returns, so it may be moved from.
+using BatchSink = std::function<void(RecordBatch &)>;
+
+// Bounds on what one feed document may make the pipeline hold, so that a
+// malformed or oversized response fails instead of exhausting memory.
+struct Limits {
+    // Decoded bytes of the document; 0 means no limit.
+    uint64_t max_bytes = 0;
+    // Nesting of arrays and objects. Always enforced, and at least
+    // kMinDepth, which a document with features needs.
+    size_t max_depth = simplejson::kMaxDepth;
+    // Elements of the features array; 0 means no limit.
+    size_t max_features = 0;
+
+    static constexpr size_t kMinDepth = 3;
+};
+
+inline std::runtime_error too_many_features(size_t max_features) {
+    return std::runtime_error("Feed has more than " + std::to_string(max_features) + " features");
+}
+
+// Pulls the projected fields out of a GeoJSON FeatureCollection while it is
+// being parsed. Only the members of kProjection and the coordinates are
+// descended into; every other member is skipped by the parser without
+// being decoded.
+class RecordExtractor {
+public:
+    explicit RecordExtractor(RecordBatch &records) : records_(records) {}
+
+    // An extractor for individual elements of the features array, each
+    // parsed as a document of its own.
+    static RecordExtractor for_features(RecordBatch &records) {
+        RecordExtractor extractor(records);
+        extractor.stack_[0] = Scope::Features;
+        extractor.has_features_ = true;
+        return extractor;
+    }
+
+    bool start_object() {
+        const Member *member = take_member();
+        switch (top()) {
+            case Scope::Document:
+                push(Scope::Root);
+                return true;
+            case Scope::Features:
+                if (max_features_ > 0 && ++features_ > max_features_) {
+                    throw too_many_features(max_features_);
+                }
+                feature_.clear();
+                push(Scope::Feature);
+                return true;
+            case Scope::Coordinates:
+                ++coordinate_index_;
+                return false;
+            default:
+                if (member && member->opens == Scope::Metadata) {
+                    push(Scope::Metadata);
+                    return true;
+                }
+                if (member && (member->opens == Scope::Properties || member->opens == Scope::Geometry)) {
+                    mark_seen(member);
+                    push(member->opens);
+                    return true;
+                }
+                return false;
+        }
+    }
+
+    void end_object() {
+        if (pop() == Scope::Feature) {
+            finish_feature();
+        }
+    }
+
+    bool start_array() {
+        const Member *member = take_member();
+        switch (top()) {
+            case Scope::Document:
+                throw std::runtime_error("Unexpected JSON root type");
+            case Scope::Coordinates:
+                ++coordinate_index_;
+                return false;
+            default:
+                if (member && member->opens == Scope::Features) {
+                    has_features_ = true;
+                    push(Scope::Features);
+                    return true;
+                }
+                if (member && member->opens == Scope::Coordinates) {
+                    coordinate_index_ = 0;
+                    push(Scope::Coordinates);
+                    return true;
+                }
+                return false;
+        }
+    }
+
+    void end_array() {
+        pop();
+    }
+
+    bool key(std::string_view name) {
+        member_ = nullptr;
+        if (name.empty()) {
+            return false;
+        }
+        std::size_t slot = detail::kKeyTable.slots[detail::kKeyTable.slot(detail::key_mix(top(), name))];
+        if (slot != 0) {
+            const Member &candidate = kProjection[slot - 1];
+            if (candidate.scope == top() && candidate.key == name) {
+                member_ = &candidate;
+            }
+        }
+        return member_ != nullptr;
+    }
+
+    void null() {
+        scalar();
+    }
+
+    void boolean(bool) {
+        scalar();
+    }
+
+    void integer(int64_t value) {
+        if (member_ && member_->integer) {
+            const Member *member = take_member();
+            feature_.row.*(member->integer) = value;
+            mark_seen(member);
+            return;
+        }
+        if (member_ && member_->metadata) {
+            metadata_.*(take_member()->metadata) = value;
+            return;
+        }
+        number(static_cast<double>(value));
+    }
+
+    void number(double value) {
+        const Member *member = take_member();
+        switch (top()) {
+            case Scope::Document:
+                throw std::runtime_error("Unexpected JSON root type");
+            case Scope::Coordinates:
+                if (coordinate_index_ < std::size(kCoordinates)) {
+                    feature_.row.*(kCoordinates[coordinate_index_]) = value;
+                }
+                ++coordinate_index_;
+                break;
+            default:
+                if (member && member->integer) {
+                    feature_.row.*(member->integer) = static_cast<int64_t>(value);
+                    mark_seen(member);
+                } else if (member && member->number) {
+                    feature_.row.*(member->number) = value;
+                    mark_seen(member);
+                }
+                break;
+        }
+    }
+
+    void string(std::string_view value) {
+        const Member *member = take_member();
+        if (member && member->text) {
+            (feature_.row.*(member->text)).assign(value.data(), value.size());
+            mark_seen(member);
+            return;
+        }
+        scalar_in(top());
+    }
+
+    // Shows every feature kept to `observer`, which must outlive the
+    // extractor; null for none.
+    void observe(const RowObserver *observer) { observer_ = observer; }
+
+    // Fails the parse once the features array has more than `max_features`
+    // elements; 0 for no limit.
+    void limit_features(size_t max_features) { max_features_ = max_features; }
+
+    // Hands the records to `sink` whenever `rows` of them have accumulated,
+    // and the rest in finish(), so that no more than `rows` are held at a
+    // time. `sink` must outlive the extractor.
+    void stream_batches(size_t rows, const BatchSink *sink) {
+        batch_rows_ = rows;
+        batches_ = sink;
+    }
+
+    // The document's metadata fields, complete once parsing finished.
+    const FeedMetadata &metadata() const { return metadata_; }
+
+    // Must be called once parsing finished successfully.
+    void finish() {
+        if (!has_features_) {
+            throw std::runtime_error("Missing features array");
+        }
+        if (batches_ && !records_.empty()) {
+            flush();
+        }
+    }
+
+private:
+    static constexpr std::size_t kUpdated = detail::member_index(Scope::Properties, "updated");
+    static constexpr uint32_t kRequired = detail::required_mask();
+
+    // Reused from feature to feature, so its strings stop allocating once
+    // they have grown to the longest id and place seen.
+    struct FeatureState {
+        columnar::Row row;
+        // Bit i is set once kProjection[i] was found.
+        uint32_t seen = 0;
+
+        void clear() {
+            row.clear();
+            seen = 0;
+        }
+
+        bool has(std::size_t member) const { return (seen >> member) & 1; }
+    };
+
+    // Only the scopes listed above are ever entered, so the nesting depth
+    // is fixed.
+    static constexpr std::size_t kMaxDepth = 8;
+
+    Scope top() const {
+        return stack_[depth_];
+    }
+
+    void push(Scope scope) {
+        stack_[++depth_] = scope;
+    }
+
+    Scope pop() {
+        return stack_[depth_--];
+    }
+
+    const Member *take_member() {
+        return std::exchange(member_, nullptr);
+    }
+
+    void mark_seen(const Member *member) {
+        feature_.seen |= uint32_t{1} << (member - kProjection);
+    }
+
+    void scalar() {
+        take_member();
+        scalar_in(top());
+    }
+
+    void scalar_in(Scope scope) {
+        if (scope == Scope::Document) {
+            throw std::runtime_error("Unexpected JSON root type");
+        }
+        if (scope == Scope::Coordinates) {
+            ++coordinate_index_;
+        }
+    }
+
+    void finish_feature() {
+        if ((feature_.seen & kRequired) != kRequired) {
+            return;
+        }
+        if (!feature_.has(kUpdated)) {
+            feature_.row.updated_ms = feature_.row.time_ms;
+        }
+        if (observer_) {
+            (*observer_)(feature_.row);
+        }
+        records_.append(feature_.row);
+        if (batches_ && records_.size() >= batch_rows_) {
+            flush();
+        }
+    }
+
+    void flush() {
+        (*batches_)(records_);
+        records_.clear();
+    }
+
+    RecordBatch &records_;
+    std::array<Scope, kMaxDepth> stack_{};
+    std::size_t depth_ = 0;
+    // The projected member whose value comes next, if any.
+    const Member *member_ = nullptr;
+    std::size_t coordinate_index_ = 0;
+    bool has_features_ = false;
+    FeatureState feature_;
+    FeedMetadata metadata_;
+    const RowObserver *observer_ = nullptr;
+    size_t max_features_ = 0;
+    size_t features_ = 0;
+    size_t batch_rows_ = 0;
+    const BatchSink *batches_ = nullptr;
+};
+
+// Parses a complete feed document using every worker of the pool. A
+// structural scan, itself split across the workers, delimits the features,
+// which are then parsed in contiguous slices, each into its own vector, and
+// concatenated in feed order. The slices outnumber the workers so uneven
+// features balance out. `observer` sees the features as the slices are
+// parsed, so from several threads at once and not in feed order.
+inline RecordBatch parse_records_parallel(std::string_view document, concurrency::ThreadPool &pool,
+                                          const RowObserver *observer = nullptr, const Limits &limits = {}) {
+    std::optional<std::vector<std::string_view>> features = simplejson::ElementSplitter(document).split(
+        "features", pool.size(), [&](size_t count, const std::function<void(size_t)> &task) {
+            pool.parallel_for(count, task);
+        });
+    if (!features) {
+        throw std::runtime_error("Missing features array");
+    }
+
+    const size_t count = features->size();
+    if (limits.max_features > 0 && count > limits.max_features) {
+        throw too_many_features(limits.max_features);
+    }
+    // The elements sit two levels down in the document. A lower limit
+    // would reject any feature, as the streaming parsers do.
+    if (limits.max_depth < Limits::kMinDepth) {
+        throw std::invalid_argument("Nesting limit below " + std::to_string(Limits::kMinDepth) + " levels");
+    }
+    const size_t element_depth = limits.max_depth - 2;
+    const size_t slices = std::min(count, pool.size() * 4);
+    std::vector<RecordBatch> outputs(slices);
+    pool.parallel_for(slices, [&](size_t slice) {
+        size_t first = count * slice / slices;
+        size_t last = count * (slice + 1) / slices;
+        RecordBatch &records = outputs[slice];
+        records.reserve(last - first);
+        RecordExtractor extractor = RecordExtractor::for_features(records);
+        extractor.observe(observer);
+        for (size_t i = first; i < last; ++i) {
+            simplejson::parse_sax((*features)[i], extractor, element_depth);
+        }
+    });
+
+    RecordBatch records;
+    for (const RecordBatch &slice : outputs) {
+        records.append(slice);
+    }
+    return records;
+}
+
+// Parses a complete feed document on the calling thread.
+inline RecordBatch parse_records(std::string_view document, const Limits &limits = {}) {
+    RecordBatch records;
+    RecordExtractor extractor(records);
+    extractor.limit_features(limits.max_features);
+    simplejson::parse_sax(document, extractor, limits.max_depth);
+    extractor.finish();
+    return records;
+}
+
+} // namespace records
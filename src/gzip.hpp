@@ -0,0 +1,85 @@
+#pragma once
+
+#include <zlib.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <filesystem>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "binary_io.hpp"
+#include "thread_pool.hpp"
+
+namespace gzip {
+
+// Independent deflate blocks of this much input. Each becomes a gzip member
+// of its own, so blocks compress in parallel and a reader can start
+// decompressing at any member boundary; the cost in ratio is well under 1%.
+constexpr size_t kBlockSize = size_t(1) << 20;
+
+// Compresses `data` into one complete gzip member.
+inline std::string compress_member(std::string_view data, int level = Z_DEFAULT_COMPRESSION) {
+    z_stream stream{};
+    // 15 bits of window, plus 16 for a gzip header and trailer.
+    if (deflateInit2(&stream, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        throw std::runtime_error("Failed to initialise zlib");
+    }
+    std::string out(deflateBound(&stream, static_cast<uLong>(data.size())), '\0');
+    stream.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(data.data()));
+    stream.avail_in = static_cast<uInt>(data.size());
+    stream.next_out = reinterpret_cast<Bytef *>(out.data());
+    stream.avail_out = static_cast<uInt>(out.size());
+    int result = deflate(&stream, Z_FINISH);
+    out.resize(stream.total_out);
+    deflateEnd(&stream);
+    if (result != Z_STREAM_END) {
+        throw std::runtime_error("Failed to compress");
+    }
+    return out;
+}
+
+// Writes `source` to `target` as a multi-member gzip file, which gzip,
+// zcat and zlib read as the concatenation of the members. Blocks are
+// compressed on the pool, a few per worker at a time so that memory stays
+// bounded, and written in order. The target appears only once complete.
+inline void compress_file(const std::filesystem::path &source, const std::filesystem::path &target,
+                          concurrency::ThreadPool &pool, int level = Z_DEFAULT_COMPRESSION) {
+    binary::MappedFile file(source);
+    file.advise_sequential();
+    const std::string_view data = file.view();
+
+    std::filesystem::path temporary = target;
+    temporary += ".tmp";
+    {
+        std::ofstream out(temporary, std::ios::binary | std::ios::trunc);
+        if (!out) {
+            throw std::runtime_error("Failed to open " + temporary.string());
+        }
+        const size_t blocks = std::max<size_t>(1, (data.size() + kBlockSize - 1) / kBlockSize);
+        const size_t round = std::max<size_t>(1, pool.size()) * 2;
+        std::vector<std::string> members(std::min(blocks, round));
+        for (size_t first = 0; first < blocks; first += round) {
+            const size_t count = std::min(round, blocks - first);
+            pool.parallel_for(count, [&](size_t i) {
+                const size_t offset = (first + i) * kBlockSize;
+                members[i] = compress_member(data.substr(std::min(offset, data.size()), kBlockSize), level);
+            });
+            for (size_t i = 0; i < count; ++i) {
+                out.write(members[i].data(), static_cast<std::streamsize>(members[i].size()));
+            }
+            if (!out) {
+                throw std::runtime_error("Failed to write " + temporary.string());
+            }
+        }
+        if (!out.flush()) {
+            throw std::runtime_error("Failed to write " + temporary.string());
+        }
+    }
+    std::filesystem::rename(temporary, target);
+}
+
+} // namespace gzip
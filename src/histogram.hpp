@@ -0,0 +1,242 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <limits>
+#include <ratio>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+// The block kernel uses SSE2 or NEON when available; define
+// HISTOGRAM_NO_SIMD to force the portable loop.
+#if !defined(HISTOGRAM_NO_SIMD)
+#if defined(__SSE2__) || defined(_M_X64)
+#define HISTOGRAM_SSE2 1
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#define HISTOGRAM_NEON 1
+#include <arm_neon.h>
+#endif
+#endif
+
+namespace histogram {
+
+// Bins of a fixed width, given at compile time as a std::ratio (e.g.
+// std::ratio<1, 10> for 0.1). Bin 0 holds values below the first edge, bins
+// 1..interior the intervals [edge, edge + width), and the last bin values at
+// or above the last edge. The bin of a value is computed directly:
+// floor((value - first) / width) + 1, clamped, then corrected by one if it
+// disagrees with the decimal edges.
+template <typename Width>
+class UniformBins {
+public:
+    static constexpr bool kUniform = true;
+    static constexpr double kInverseWidth = static_cast<double>(Width::den) / static_cast<double>(Width::num);
+
+    UniformBins(double first_edge, size_t interior) : first_edge_(first_edge) {
+        // first + i * width as a single rounding of the exact decimal, so
+        // that 1.0 + 3 * 0.1 is the double nearest 1.3.
+        for (size_t i = 0; i <= interior; ++i) {
+            edges_.push_back((first_edge * Width::den + static_cast<double>(i) * Width::num) / Width::den);
+        }
+    }
+
+    size_t size() const { return edges_.size() + 1; }
+    const std::vector<double> &edges() const { return edges_; }
+    double first_edge() const { return first_edge_; }
+
+private:
+    double first_edge_;
+    std::vector<double> edges_;
+};
+
+// Bins between arbitrary, strictly increasing edges chosen at runtime, laid
+// out like UniformBins. The bin of a value is the number of edges at or
+// below it, found by comparing against every edge, which suits the handful
+// of edges a report has.
+class CustomBins {
+public:
+    static constexpr bool kUniform = false;
+
+    explicit CustomBins(std::vector<double> edges) : edges_(std::move(edges)) {
+        if (edges_.empty()) {
+            throw std::invalid_argument("Histogram needs at least one edge");
+        }
+        for (size_t i = 1; i < edges_.size(); ++i) {
+            if (!(edges_[i - 1] < edges_[i])) {
+                throw std::invalid_argument("Histogram edges must be strictly increasing");
+            }
+        }
+    }
+
+    size_t size() const { return edges_.size() + 1; }
+    const std::vector<double> &edges() const { return edges_; }
+
+private:
+    std::vector<double> edges_;
+};
+
+// Counts per bin. Histograms over disjoint ranges, e.g. one per thread,
+// are combined with merge(), so parallel counting needs no locks.
+class Histogram {
+public:
+    explicit Histogram(size_t bins) : counts_(bins, 0) {}
+
+    // Counts values[first, last). `valid` is a validity bitmap (bit i % 64
+    // of word i / 64 for row i) or null when every value is present.
+    // Missing and NaN values are not counted.
+    template <typename Bins>
+    void add(const Bins &bins, const double *values, const uint64_t *valid, size_t first, size_t last);
+
+    void merge(const Histogram &other) {
+        for (size_t i = 0; i < counts_.size(); ++i) {
+            counts_[i] += other.counts_[i];
+        }
+    }
+
+    size_t size() const { return counts_.size(); }
+    uint64_t operator[](size_t bin) const { return counts_[bin]; }
+
+private:
+    std::vector<uint64_t> counts_;
+};
+
+namespace detail {
+
+constexpr size_t kBlock = 8;
+
+// First guess at the bins of a block, exact up to one bin either way:
+// (value - first) / width + 1 clamped to [0, last_bin] and truncated,
+// which equals the floor for the non-negative clamped range. NaNs end up
+// anywhere in range and are discarded by the caller.
+template <typename Width>
+void estimate_bins(const UniformBins<Width> &bins, const double *values, int32_t *out) {
+    const double first = bins.first_edge();
+    const double last_bin = static_cast<double>(bins.size() - 1);
+#if defined(HISTOGRAM_SSE2)
+    const __m128d first_v = _mm_set1_pd(first);
+    const __m128d scale = _mm_set1_pd(UniformBins<Width>::kInverseWidth);
+    const __m128d one = _mm_set1_pd(1.0);
+    const __m128d zero = _mm_setzero_pd();
+    const __m128d top = _mm_set1_pd(last_bin);
+    for (size_t i = 0; i < kBlock; i += 2) {
+        __m128d scaled = _mm_add_pd(_mm_mul_pd(_mm_sub_pd(_mm_loadu_pd(values + i), first_v), scale), one);
+        __m128d clamped = _mm_min_pd(_mm_max_pd(scaled, zero), top);
+        _mm_storel_epi64(reinterpret_cast<__m128i *>(out + i), _mm_cvttpd_epi32(clamped));
+    }
+#elif defined(HISTOGRAM_NEON)
+    const float64x2_t first_v = vdupq_n_f64(first);
+    const float64x2_t scale = vdupq_n_f64(UniformBins<Width>::kInverseWidth);
+    const float64x2_t one = vdupq_n_f64(1.0);
+    const float64x2_t zero = vdupq_n_f64(0.0);
+    const float64x2_t top = vdupq_n_f64(last_bin);
+    for (size_t i = 0; i < kBlock; i += 2) {
+        float64x2_t scaled = vaddq_f64(vmulq_f64(vsubq_f64(vld1q_f64(values + i), first_v), scale), one);
+        float64x2_t clamped = vminnmq_f64(vmaxnmq_f64(scaled, zero), top);
+        vst1_s32(out + i, vmovn_s64(vcvtq_s64_f64(clamped)));
+    }
+#else
+    for (size_t i = 0; i < kBlock; ++i) {
+        double scaled = (values[i] - first) * UniformBins<Width>::kInverseWidth + 1.0;
+        double clamped = scaled > 0.0 ? (scaled < last_bin ? scaled : last_bin) : 0.0;
+        out[i] = static_cast<int32_t>(clamped);
+    }
+#endif
+}
+
+// Number of edges at or below each value of a block, by comparing against
+// every edge; NaNs compare false everywhere.
+inline void estimate_bins(const CustomBins &bins, const double *values, int32_t *out) {
+    const std::vector<double> &edges = bins.edges();
+#if defined(HISTOGRAM_SSE2)
+    for (size_t i = 0; i < kBlock; i += 2) {
+        __m128d value = _mm_loadu_pd(values + i);
+        __m128i count = _mm_setzero_si128();
+        for (double edge : edges) {
+            // An all-ones lane is -1, so subtracting the mask counts.
+            count = _mm_sub_epi64(count, _mm_castpd_si128(_mm_cmpge_pd(value, _mm_set1_pd(edge))));
+        }
+        out[i] = _mm_cvtsi128_si32(count);
+        out[i + 1] = _mm_cvtsi128_si32(_mm_srli_si128(count, 8));
+    }
+#elif defined(HISTOGRAM_NEON)
+    for (size_t i = 0; i < kBlock; i += 2) {
+        float64x2_t value = vld1q_f64(values + i);
+        uint64x2_t count = vdupq_n_u64(0);
+        for (double edge : edges) {
+            count = vsubq_u64(count, vcgeq_f64(value, vdupq_n_f64(edge)));
+        }
+        vst1_s32(out + i, vmovn_s64(vreinterpretq_s64_u64(count)));
+    }
+#else
+    for (size_t i = 0; i < kBlock; ++i) {
+        int32_t count = 0;
+        for (double edge : edges) {
+            count += values[i] >= edge ? 1 : 0;
+        }
+        out[i] = count;
+    }
+#endif
+}
+
+inline bool is_valid(const uint64_t *valid, size_t row) {
+    return !valid || ((valid[row / 64] >> (row % 64)) & 1);
+}
+
+} // namespace detail
+
+template <typename Bins>
+void Histogram::add(const Bins &bins, const double *values, const uint64_t *valid, size_t first, size_t last) {
+    const size_t discard = bins.size();
+    if (counts_.size() != discard) {
+        throw std::invalid_argument("Histogram and bins differ in size");
+    }
+    // Consecutive rows often share a bin; spreading them over four count
+    // arrays keeps the increments from waiting on each other. The extra
+    // slot of each array collects discarded rows.
+    std::vector<uint64_t> lanes(4 * (discard + 1), 0);
+
+    // Lower and upper edge of every bin, for the one-bin correction of a
+    // uniform estimate. The outer bins are open: -inf never compares below
+    // and NaN never compares at or above, so even infinities stay put.
+    std::vector<double> lower(discard), upper(discard);
+    const std::vector<double> &edges = bins.edges();
+    for (size_t bin = 0; bin < discard; ++bin) {
+        lower[bin] = bin == 0 ? -std::numeric_limits<double>::infinity() : edges[bin - 1];
+        upper[bin] = bin == discard - 1 ? std::numeric_limits<double>::quiet_NaN() : edges[bin];
+    }
+
+    double padded[detail::kBlock];
+    int32_t estimate[detail::kBlock];
+    for (size_t row = first; row < last; row += detail::kBlock) {
+        size_t count = std::min(detail::kBlock, last - row);
+        const double *block = values + row;
+        if (count < detail::kBlock) {
+            std::fill(std::begin(padded), std::end(padded), 0.0);
+            std::copy(block, block + count, padded);
+            block = padded;
+        }
+        detail::estimate_bins(bins, block, estimate);
+        for (size_t i = 0; i < count; ++i) {
+            double value = block[i];
+            size_t bin = static_cast<size_t>(estimate[i]);
+            if constexpr (Bins::kUniform) {
+                bin -= value < lower[bin] ? 1 : 0;
+                bin += value >= upper[bin] ? 1 : 0;
+            }
+            bool keep = detail::is_valid(valid, row + i) && value == value;
+            bin = keep ? bin : discard;
+            ++lanes[(i % 4) * (discard + 1) + bin];
+        }
+    }
+    for (size_t lane = 0; lane < 4; ++lane) {
+        for (size_t bin = 0; bin < discard; ++bin) {
+            counts_[bin] += lanes[lane * (discard + 1) + bin];
+        }
+    }
+}
+
+} // namespace histogram
@@ -0,0 +1,115 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <string_view>
+
+namespace iso8601 {
+
+// "YYYY-MM-DDTHH:MM:SS.mmmZ" for years 0 to 9999. Other years take the
+// expanded form, a sign and at least four digits ("+10000-01-01T...",
+// "-0001-..."), which for any int64 millisecond count fits in kMaxLength.
+constexpr size_t kLength = 24;
+constexpr size_t kMaxLength = kLength + 6;
+using Buffer = char[kMaxLength];
+// "THH:MM:SS.mmmZ", the part after the date.
+constexpr size_t kTimeLength = 14;
+
+struct CivilDate {
+    int64_t year;
+    unsigned month;
+    unsigned day;
+};
+
+// Proleptic Gregorian date of a day count relative to 1970-01-01, using
+// Howard Hinnant's civil_from_days algorithm.
+constexpr CivilDate civil_from_days(int64_t days) {
+    days += 719468;
+    const int64_t era = (days >= 0 ? days : days - 146096) / 146097;
+    const unsigned doe = static_cast<unsigned>(days - era * 146097);
+    const unsigned yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    const unsigned doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    const unsigned mp = (5 * doy + 2) / 153;
+    const unsigned day = doy - (153 * mp + 2) / 5 + 1;
+    const unsigned month = mp < 10 ? mp + 3 : mp - 9;
+    return {static_cast<int64_t>(yoe) + era * 400 + (month <= 2 ? 1 : 0), month, day};
+}
+
+constexpr int64_t floor_div(int64_t value, int64_t divisor) {
+    int64_t quotient = value / divisor;
+    return (value % divisor < 0) ? quotient - 1 : quotient;
+}
+
+// Formats UTC millisecond timestamps. Events in one feed are close together,
+// so the "YYYY-MM-DDTHH:MM:" prefix is cached per minute and usually only the
+// seconds and milliseconds have to be rendered.
+class Formatter {
+public:
+    // Writes the timestamp into `out` and returns a view of it.
+    std::string_view format(int64_t millis_since_epoch, Buffer &out) {
+        int64_t minute = floor_div(millis_since_epoch, 60000);
+        if (minute != cached_minute_) {
+            fill_prefix(minute);
+            cached_minute_ = minute;
+        }
+        std::memcpy(out, prefix_, prefix_length_);
+
+        char *seconds = out + prefix_length_;
+        auto within_minute = static_cast<unsigned>(millis_since_epoch - minute * 60000);
+        write_digits(seconds, within_minute / 1000, 2);
+        seconds[2] = '.';
+        write_digits(seconds + 3, within_minute % 1000, 3);
+        seconds[6] = 'Z';
+        return std::string_view(out, prefix_length_ + 7);
+    }
+
+private:
+    static constexpr size_t kMaxPrefixLength = kMaxLength - 7;
+
+    void fill_prefix(int64_t minute) {
+        int64_t days = floor_div(minute, 24 * 60);
+        auto minute_of_day = static_cast<unsigned>(minute - days * 24 * 60);
+        CivilDate date = civil_from_days(days);
+        char *out = prefix_;
+        if (date.year >= 0 && date.year <= 9999) {
+            write_digits(out, static_cast<uint64_t>(date.year), 4);
+            out += 4;
+        } else {
+            *out++ = date.year < 0 ? '-' : '+';
+            // The negation cannot overflow: int64 milliseconds span less
+            // than 300 million years.
+            uint64_t year = static_cast<uint64_t>(date.year < 0 ? -date.year : date.year);
+            int width = 4;
+            for (uint64_t rest = year / 10000; rest > 0; rest /= 10) {
+                ++width;
+            }
+            write_digits(out, year, width);
+            out += width;
+        }
+        out[0] = '-';
+        write_digits(out + 1, date.month, 2);
+        out[3] = '-';
+        write_digits(out + 4, date.day, 2);
+        out[6] = 'T';
+        write_digits(out + 7, minute_of_day / 60, 2);
+        out[9] = ':';
+        write_digits(out + 10, minute_of_day % 60, 2);
+        out[12] = ':';
+        prefix_length_ = static_cast<size_t>(out + 13 - prefix_);
+    }
+
+    static void write_digits(char *out, uint64_t value, int width) {
+        for (int i = width - 1; i >= 0; --i) {
+            out[i] = static_cast<char>('0' + value % 10);
+            value /= 10;
+        }
+    }
+
+    int64_t cached_minute_ = std::numeric_limits<int64_t>::min();
+    char prefix_[kMaxPrefixLength] = {};
+    size_t prefix_length_ = 0;
+};
+
+} // namespace iso8601
@@ -3,35 +3,73 @@
 #include <cctype>
 #include <cmath>
 #include <cstddef>
+#include <algorithm>
+#include <charconv>
 #include <cstdint>
+#include <cstring>
+#include <functional>
+#include <limits>
 #include <map>
+#include <memory>
+#include <memory_resource>
+#include <optional>
 #include <stdexcept>
 #include <string>
 #include <string_view>
+#include <system_error>
 #include <variant>
 #include <vector>
 
+// Vectorized scanning is picked automatically: SSE2 on x86-64 with an AVX2
+// variant selected at runtime, NEON on AArch64, and a portable scalar loop
+// elsewhere or when SIMPLEJSON_NO_SIMD is defined.
+#if !defined(SIMPLEJSON_NO_SIMD)
+#if defined(__SSE2__) || defined(_M_X64)
+#define SIMPLEJSON_SSE2 1
+#include <emmintrin.h>
+#if defined(__GNUC__) && !defined(_WIN32)
+#define SIMPLEJSON_AVX2 1
+#include <immintrin.h>
+#endif
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#define SIMPLEJSON_NEON 1
+#include <arm_neon.h>
+#endif
+#endif
+
+// Marks a function that is rarely called, such as one that only throws, so
+// the compiler keeps it out of line and away from the hot path.
+#if defined(__GNUC__)
+#define SIMPLEJSON_NOINLINE_COLD __attribute__((noinline, cold))
+#elif defined(_MSC_VER)
+#define SIMPLEJSON_NOINLINE_COLD __declspec(noinline)
+#else
+#define SIMPLEJSON_NOINLINE_COLD
+#endif
+
 namespace simplejson {
 
 class JsonValue;
-using JsonObject = std::map<std::string, JsonValue>;
+using JsonObject = std::map<std::string, JsonValue, std::less<>>;
 using JsonArray = std::vector<JsonValue>;
 
 class JsonValue {
 public:
-    using Variant = std::variant<std::nullptr_t, bool, double, std::string, JsonArray, JsonObject>;
+    using Variant = std::variant<std::nullptr_t, bool, double, int64_t, std::string, JsonArray, JsonObject>;
 
     JsonValue() : value_(nullptr) {}
     JsonValue(std::nullptr_t) : value_(nullptr) {}
     JsonValue(bool b) : value_(b) {}
     JsonValue(double d) : value_(d) {}
+    JsonValue(int64_t i) : value_(i) {}
     JsonValue(std::string s) : value_(std::move(s)) {}
     JsonValue(JsonArray arr) : value_(std::move(arr)) {}
     JsonValue(JsonObject obj) : value_(std::move(obj)) {}
 
     bool is_null() const { return std::holds_alternative<std::nullptr_t>(value_); }
     bool is_bool() const { return std::holds_alternative<bool>(value_); }
-    bool is_number() const { return std::holds_alternative<double>(value_); }
+    bool is_number() const { return std::holds_alternative<double>(value_) || is_integer(); }
+    bool is_integer() const { return std::holds_alternative<int64_t>(value_); }
     bool is_string() const { return std::holds_alternative<std::string>(value_); }
     bool is_array() const { return std::holds_alternative<JsonArray>(value_); }
     bool is_object() const { return std::holds_alternative<JsonObject>(value_); }
@@ -39,7 +77,13 @@ public:
     const Variant &variant() const { return value_; }
 
     const std::string &as_string() const { return std::get<std::string>(value_); }
-    double as_number() const { return std::get<double>(value_); }
+    double as_number() const {
+        if (const int64_t *integer = std::get_if<int64_t>(&value_)) {
+            return static_cast<double>(*integer);
+        }
+        return std::get<double>(value_);
+    }
+    int64_t as_integer() const { return std::get<int64_t>(value_); }
     bool as_bool() const { return std::get<bool>(value_); }
     const JsonArray &as_array() const { return std::get<JsonArray>(value_); }
     const JsonObject &as_object() const { return std::get<JsonObject>(value_); }
@@ -57,297 +101,2532 @@ public:
     explicit ParseError(const std::string &message) : std::runtime_error(message) {}
 };
 
-class Parser {
-public:
-    explicit Parser(std::string_view input) : input_(input), pos_(0) {}
+// Default limit on how deeply arrays and objects may nest. GeoJSON needs
+// five levels; the recursive parsers take a stack frame for each.
+constexpr size_t kMaxDepth = 512;
 
-    JsonValue parse() {
-        skip_whitespace();
-        JsonValue value = parse_value();
-        skip_whitespace();
-        if (!eof()) {
-            throw ParseError("Unexpected characters after JSON value");
-        }
-        return value;
-    }
+namespace detail {
 
-private:
-    JsonValue parse_value() {
-        if (eof()) {
-            throw ParseError("Unexpected end of input");
-        }
-        char ch = peek();
-        switch (ch) {
-            case 'n':
-                return parse_null();
-            case 't':
-            case 'f':
-                return parse_bool();
-            case '"':
-                return parse_string();
-            case '[':
-                return parse_array();
-            case '{':
-                return parse_object();
-            default:
-                if (ch == '-' || std::isdigit(static_cast<unsigned char>(ch))) {
-                    return parse_number();
-                }
-                throw ParseError("Invalid JSON value");
-        }
+// Returns the length of the JSON number at the start of `text`.
+inline size_t match_number(std::string_view text) {
+    size_t n = text.size();
+    size_t i = 0;
+    auto is_digit = [&](size_t k) {
+        return k < n && std::isdigit(static_cast<unsigned char>(text[k]));
+    };
+
+    if (i < n && text[i] == '-') {
+        ++i;
+    }
+    if (i >= n) {
+        throw ParseError("Unexpected end of input in number");
     }
 
-    JsonValue parse_null() {
-        expect("null");
-        return JsonValue(nullptr);
+    if (text[i] == '0') {
+        ++i;
+    } else if (is_digit(i)) {
+        while (is_digit(i)) {
+            ++i;
+        }
+    } else {
+        throw ParseError("Invalid number");
     }
 
-    JsonValue parse_bool() {
-        if (match("true")) {
-            return JsonValue(true);
+    if (i < n && text[i] == '.') {
+        ++i;
+        if (!is_digit(i)) {
+            throw ParseError("Invalid number fraction");
         }
-        if (match("false")) {
-            return JsonValue(false);
+        while (is_digit(i)) {
+            ++i;
         }
-        throw ParseError("Invalid boolean value");
     }
 
-    JsonValue parse_number() {
-        size_t start = pos_;
-        if (peek() == '-') {
-            advance();
+    if (i < n && (text[i] == 'e' || text[i] == 'E')) {
+        ++i;
+        if (i < n && (text[i] == '+' || text[i] == '-')) {
+            ++i;
         }
-        if (eof()) {
-            throw ParseError("Unexpected end of input in number");
+        if (!is_digit(i)) {
+            throw ParseError("Invalid number exponent");
         }
-
-        if (peek() == '0') {
-            advance();
-        } else if (std::isdigit(static_cast<unsigned char>(peek()))) {
-            while (!eof() && std::isdigit(static_cast<unsigned char>(peek()))) {
-                advance();
-            }
-        } else {
-            throw ParseError("Invalid number");
+        while (is_digit(i)) {
+            ++i;
         }
+    }
+    return i;
+}
 
-        if (!eof() && peek() == '.') {
-            advance();
-            if (eof() || !std::isdigit(static_cast<unsigned char>(peek()))) {
-                throw ParseError("Invalid number fraction");
-            }
-            while (!eof() && std::isdigit(static_cast<unsigned char>(peek()))) {
-                advance();
-            }
+// Decodes a number token validated by match_number. Integral tokens that fit
+// in an int64_t are stored exactly, so large values such as millisecond
+// timestamps never round-trip through double. Returns true for integers.
+inline bool decode_number(std::string_view text, int64_t &integer, double &real) {
+    const char *first = text.data();
+    const char *last = first + text.size();
+    // "-0" stays a double so the sign survives.
+    if (text.find_first_of(".eE") == std::string_view::npos && text != "-0") {
+        auto [end, ec] = std::from_chars(first, last, integer);
+        if (ec == std::errc() && end == last) {
+            return true;
         }
+    }
+    auto [end, ec] = std::from_chars(first, last, real);
+    if (ec == std::errc::result_out_of_range) {
+        throw ParseError("Number out of range");
+    }
+    if (ec != std::errc() || end != last) {
+        throw ParseError("Invalid number");
+    }
+    return false;
+}
 
-        if (!eof() && (peek() == 'e' || peek() == 'E')) {
-            advance();
-            if (!eof() && (peek() == '+' || peek() == '-')) {
-                advance();
-            }
-            if (eof() || !std::isdigit(static_cast<unsigned char>(peek()))) {
-                throw ParseError("Invalid number exponent");
-            }
-            while (!eof() && std::isdigit(static_cast<unsigned char>(peek()))) {
-                advance();
-            }
-        }
+// Decodes the character following a backslash, except for 'u'.
+inline char unescape(char escaped) {
+    switch (escaped) {
+        case '"': return '"';
+        case '\\': return '\\';
+        case '/': return '/';
+        case 'b': return '\b';
+        case 'f': return '\f';
+        case 'n': return '\n';
+        case 'r': return '\r';
+        case 't': return '\t';
+        default:
+            throw ParseError("Invalid escape sequence");
+    }
+}
 
-        double value = std::stod(std::string(input_.substr(start, pos_ - start)));
-        return JsonValue(value);
+inline uint32_t hex_digit(char ch) {
+    if (ch >= '0' && ch <= '9') {
+        return static_cast<uint32_t>(ch - '0');
+    }
+    if (ch >= 'a' && ch <= 'f') {
+        return static_cast<uint32_t>(10 + ch - 'a');
+    }
+    if (ch >= 'A' && ch <= 'F') {
+        return static_cast<uint32_t>(10 + ch - 'A');
     }
+    throw ParseError("Invalid unicode escape");
+}
 
-    JsonValue parse_string() {
-        expect('"');
-        std::string result;
-        while (!eof()) {
-            char ch = advance();
-            if (ch == '"') {
-                return JsonValue(result);
-            }
-            if (ch == '\\') {
-                if (eof()) {
-                    throw ParseError("Unterminated escape sequence");
-                }
-                char escaped = advance();
-                switch (escaped) {
-                    case '"': result.push_back('"'); break;
-                    case '\\': result.push_back('\\'); break;
-                    case '/': result.push_back('/'); break;
-                    case 'b': result.push_back('\b'); break;
-                    case 'f': result.push_back('\f'); break;
-                    case 'n': result.push_back('\n'); break;
-                    case 'r': result.push_back('\r'); break;
-                    case 't': result.push_back('\t'); break;
-                    case 'u':
-                        result.push_back(parse_unicode_escape());
-                        break;
-                    default:
-                        throw ParseError("Invalid escape sequence");
-                }
-            } else if (static_cast<unsigned char>(ch) < 0x20) {
-                throw ParseError("Invalid control character in string");
-            } else {
-                result.push_back(ch);
-            }
-        }
-        throw ParseError("Unterminated string");
+// Substituted for \u escapes of unpaired UTF-16 surrogates, which have no
+// UTF-8 encoding. Rejecting them would lose the whole document over one
+// damaged character.
+constexpr uint32_t kReplacementCharacter = 0xFFFD;
+
+constexpr bool is_high_surrogate(uint32_t value) {
+    return value >= 0xD800 && value <= 0xDBFF;
+}
+
+constexpr bool is_low_surrogate(uint32_t value) {
+    return value >= 0xDC00 && value <= 0xDFFF;
+}
+
+constexpr uint32_t combine_surrogates(uint32_t high, uint32_t low) {
+    return 0x10000 + ((high - 0xD800) << 10) + (low - 0xDC00);
+}
+
+// Appends a code point as UTF-8; surrogates become U+FFFD.
+inline void append_code_point(std::string &out, uint32_t value) {
+    if (value >= 0xD800 && value <= 0xDFFF) {
+        value = kReplacementCharacter;
+    }
+    char bytes[4];
+    size_t size;
+    if (value < 0x80) {
+        bytes[0] = static_cast<char>(value);
+        size = 1;
+    } else if (value < 0x800) {
+        bytes[0] = static_cast<char>(0xC0 | (value >> 6));
+        bytes[1] = static_cast<char>(0x80 | (value & 0x3F));
+        size = 2;
+    } else if (value < 0x10000) {
+        bytes[0] = static_cast<char>(0xE0 | (value >> 12));
+        bytes[1] = static_cast<char>(0x80 | ((value >> 6) & 0x3F));
+        bytes[2] = static_cast<char>(0x80 | (value & 0x3F));
+        size = 3;
+    } else {
+        bytes[0] = static_cast<char>(0xF0 | (value >> 18));
+        bytes[1] = static_cast<char>(0x80 | ((value >> 12) & 0x3F));
+        bytes[2] = static_cast<char>(0x80 | ((value >> 6) & 0x3F));
+        bytes[3] = static_cast<char>(0x80 | (value & 0x3F));
+        size = 4;
     }
+    out.append(bytes, size);
+}
 
-    char parse_unicode_escape() {
-        uint32_t value = 0;
-        for (int i = 0; i < 4; ++i) {
-            if (eof()) {
-                throw ParseError("Unexpected end of input in unicode escape");
-            }
-            char ch = advance();
-            value <<= 4;
-            if (ch >= '0' && ch <= '9') {
-                value += static_cast<uint32_t>(ch - '0');
-            } else if (ch >= 'a' && ch <= 'f') {
-                value += static_cast<uint32_t>(10 + ch - 'a');
-            } else if (ch >= 'A' && ch <= 'F') {
-                value += static_cast<uint32_t>(10 + ch - 'A');
-            } else {
-                throw ParseError("Invalid unicode escape");
-            }
-        }
+inline bool is_control(char ch) {
+    return static_cast<unsigned char>(ch) < 0x20;
+}
 
-        // Handle basic multilingual plane only. Surrogates are not supported.
-        if (value <= 0x7F) {
-            return static_cast<char>(value);
-        }
-        // For simplicity, we only support ASCII output. For higher code points,
-        // replace with '?' to avoid multi-byte encoding complexities.
-        return '?';
+inline bool is_string_special(char ch) {
+    return ch == '"' || ch == '\\' || is_control(ch);
+}
+
+inline bool is_json_whitespace(char ch) {
+    return ch == ' ' || ch == '\n' || ch == '\r' || ch == '\t';
+}
+
+// Block scanners over [first, last). find_string_special returns the first
+// quote, backslash or control character; skip_json_whitespace returns the
+// first byte that is not JSON whitespace. Both return `last` if none found.
+namespace scan {
+
+inline const char *find_string_special_scalar(const char *first, const char *last) {
+    while (first < last && !is_string_special(*first)) {
+        ++first;
     }
+    return first;
+}
 
-    JsonValue parse_array() {
-        expect('[');
-        JsonArray array;
-        skip_whitespace();
-        if (peek() == ']') {
-            advance();
-            return JsonValue(std::move(array));
-        }
-        while (true) {
-            array.push_back(parse_value());
-            skip_whitespace();
-            if (peek() == ',') {
-                advance();
-                skip_whitespace();
-                continue;
-            }
-            if (peek() == ']') {
-                advance();
-                break;
-            }
-            throw ParseError("Expected ',' or ']' in array");
-        }
-        return JsonValue(std::move(array));
+inline const char *skip_json_whitespace_scalar(const char *first, const char *last) {
+    while (first < last && is_json_whitespace(*first)) {
+        ++first;
     }
+    return first;
+}
 
-    JsonValue parse_object() {
-        expect('{');
-        JsonObject object;
-        skip_whitespace();
-        if (peek() == '}') {
-            advance();
-            return JsonValue(std::move(object));
-        }
-        while (true) {
-            if (peek() != '"') {
-                throw ParseError("Expected string key in object");
-            }
-            std::string key = parse_string().as_string();
-            skip_whitespace();
-            expect(':');
-            skip_whitespace();
-            JsonValue value = parse_value();
-            object.emplace(std::move(key), std::move(value));
-            skip_whitespace();
-            if (peek() == ',') {
-                advance();
-                skip_whitespace();
-                continue;
-            }
-            if (peek() == '}') {
-                advance();
-                break;
-            }
-            throw ParseError("Expected ',' or '}' in object");
+inline unsigned count_trailing_zeros(uint32_t mask) {
+#if defined(__GNUC__)
+    return static_cast<unsigned>(__builtin_ctz(mask));
+#else
+    unsigned n = 0;
+    while ((mask & 1u) == 0) {
+        mask >>= 1;
+        ++n;
+    }
+    return n;
+#endif
+}
+
+#if defined(SIMPLEJSON_SSE2)
+inline const char *find_string_special_sse2(const char *first, const char *last) {
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    const __m128i control_max = _mm_set1_epi8(0x1F);
+    for (; last - first >= 16; first += 16) {
+        __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(first));
+        __m128i special = _mm_or_si128(_mm_cmpeq_epi8(chunk, quote), _mm_cmpeq_epi8(chunk, backslash));
+        // Unsigned chunk <= 0x1F, i.e. max(chunk, 0x1F) == 0x1F.
+        special = _mm_or_si128(special, _mm_cmpeq_epi8(_mm_max_epu8(chunk, control_max), control_max));
+        uint32_t mask = static_cast<uint32_t>(_mm_movemask_epi8(special));
+        if (mask != 0) {
+            return first + count_trailing_zeros(mask);
         }
-        return JsonValue(std::move(object));
     }
+    return find_string_special_scalar(first, last);
+}
 
-    bool match(std::string_view text) {
-        if (input_.substr(pos_, text.size()) == text) {
-            pos_ += text.size();
-            return true;
+inline const char *skip_json_whitespace_sse2(const char *first, const char *last) {
+    const __m128i space = _mm_set1_epi8(' ');
+    const __m128i newline = _mm_set1_epi8('\n');
+    const __m128i carriage_return = _mm_set1_epi8('\r');
+    const __m128i tab = _mm_set1_epi8('\t');
+    for (; last - first >= 16; first += 16) {
+        __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(first));
+        __m128i ws = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, space), _mm_cmpeq_epi8(chunk, newline)),
+                                  _mm_or_si128(_mm_cmpeq_epi8(chunk, carriage_return), _mm_cmpeq_epi8(chunk, tab)));
+        uint32_t mask = ~static_cast<uint32_t>(_mm_movemask_epi8(ws)) & 0xFFFFu;
+        if (mask != 0) {
+            return first + count_trailing_zeros(mask);
         }
-        return false;
     }
+    return skip_json_whitespace_scalar(first, last);
+}
+#endif
 
-    void expect(std::string_view text) {
-        if (!match(text)) {
-            throw ParseError("Expected '" + std::string(text) + "'");
+#if defined(SIMPLEJSON_AVX2)
+__attribute__((target("avx2"))) inline const char *find_string_special_avx2(const char *first, const char *last) {
+    const __m256i quote = _mm256_set1_epi8('"');
+    const __m256i backslash = _mm256_set1_epi8('\\');
+    const __m256i control_max = _mm256_set1_epi8(0x1F);
+    for (; last - first >= 32; first += 32) {
+        __m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(first));
+        __m256i special = _mm256_or_si256(_mm256_cmpeq_epi8(chunk, quote), _mm256_cmpeq_epi8(chunk, backslash));
+        special = _mm256_or_si256(special, _mm256_cmpeq_epi8(_mm256_max_epu8(chunk, control_max), control_max));
+        uint32_t mask = static_cast<uint32_t>(_mm256_movemask_epi8(special));
+        if (mask != 0) {
+            return first + count_trailing_zeros(mask);
         }
     }
+    return find_string_special_sse2(first, last);
+}
 
-    void expect(char expected) {
-        if (eof() || advance() != expected) {
-            throw ParseError(std::string("Expected '") + expected + "'");
+__attribute__((target("avx2"))) inline const char *skip_json_whitespace_avx2(const char *first, const char *last) {
+    const __m256i space = _mm256_set1_epi8(' ');
+    const __m256i newline = _mm256_set1_epi8('\n');
+    const __m256i carriage_return = _mm256_set1_epi8('\r');
+    const __m256i tab = _mm256_set1_epi8('\t');
+    for (; last - first >= 32; first += 32) {
+        __m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(first));
+        __m256i ws = _mm256_or_si256(
+            _mm256_or_si256(_mm256_cmpeq_epi8(chunk, space), _mm256_cmpeq_epi8(chunk, newline)),
+            _mm256_or_si256(_mm256_cmpeq_epi8(chunk, carriage_return), _mm256_cmpeq_epi8(chunk, tab)));
+        uint32_t mask = ~static_cast<uint32_t>(_mm256_movemask_epi8(ws));
+        if (mask != 0) {
+            return first + count_trailing_zeros(mask);
         }
     }
+    return skip_json_whitespace_sse2(first, last);
+}
+#endif
 
-    void skip_whitespace() {
-        while (!eof() && std::isspace(static_cast<unsigned char>(peek()))) {
-            advance();
+#if defined(SIMPLEJSON_NEON)
+// Narrows a byte mask to one nibble per lane and returns the first set lane,
+// or 16 when the mask is empty.
+inline unsigned first_lane_neon(uint8x16_t mask) {
+    uint64_t nibbles = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(mask), 4)), 0);
+    if (nibbles == 0) {
+        return 16;
+    }
+    return static_cast<unsigned>(__builtin_ctzll(nibbles)) / 4;
+}
+
+inline const char *find_string_special_neon(const char *first, const char *last) {
+    const uint8x16_t quote = vdupq_n_u8('"');
+    const uint8x16_t backslash = vdupq_n_u8('\\');
+    const uint8x16_t control_max = vdupq_n_u8(0x1F);
+    for (; last - first >= 16; first += 16) {
+        uint8x16_t chunk = vld1q_u8(reinterpret_cast<const uint8_t *>(first));
+        uint8x16_t special = vorrq_u8(vorrq_u8(vceqq_u8(chunk, quote), vceqq_u8(chunk, backslash)),
+                                      vcleq_u8(chunk, control_max));
+        unsigned lane = first_lane_neon(special);
+        if (lane < 16) {
+            return first + lane;
         }
     }
+    return find_string_special_scalar(first, last);
+}
 
-    char peek() const {
-        if (eof()) {
-            throw ParseError("Unexpected end of input");
+inline const char *skip_json_whitespace_neon(const char *first, const char *last) {
+    const uint8x16_t space = vdupq_n_u8(' ');
+    const uint8x16_t newline = vdupq_n_u8('\n');
+    const uint8x16_t carriage_return = vdupq_n_u8('\r');
+    const uint8x16_t tab = vdupq_n_u8('\t');
+    for (; last - first >= 16; first += 16) {
+        uint8x16_t chunk = vld1q_u8(reinterpret_cast<const uint8_t *>(first));
+        uint8x16_t ws = vorrq_u8(vorrq_u8(vceqq_u8(chunk, space), vceqq_u8(chunk, newline)),
+                                 vorrq_u8(vceqq_u8(chunk, carriage_return), vceqq_u8(chunk, tab)));
+        unsigned lane = first_lane_neon(vmvnq_u8(ws));
+        if (lane < 16) {
+            return first + lane;
         }
-        return input_[pos_];
     }
+    return skip_json_whitespace_scalar(first, last);
+}
+#endif
 
-    char advance() {
-        if (eof()) {
-            throw ParseError("Unexpected end of input");
+// Classification of a 64-byte block: bit i of each mask describes byte i.
+// Brackets are folded with 0x20, which maps '[' and ']' onto '{' and '}'.
+struct BlockMasks {
+    uint64_t quote = 0;
+    uint64_t backslash = 0;
+    uint64_t open = 0;
+    uint64_t close = 0;
+    uint64_t comma = 0;
+};
+
+inline BlockMasks block_masks_scalar(const char *block) {
+    BlockMasks masks;
+    for (unsigned i = 0; i < 64; ++i) {
+        uint64_t bit = uint64_t{1} << i;
+        char ch = block[i];
+        char folded = static_cast<char>(ch | 0x20);
+        if (ch == '"') {
+            masks.quote |= bit;
+        } else if (ch == '\\') {
+            masks.backslash |= bit;
+        } else if (folded == '{') {
+            masks.open |= bit;
+        } else if (folded == '}') {
+            masks.close |= bit;
+        } else if (ch == ',') {
+            masks.comma |= bit;
         }
-        return input_[pos_++];
     }
+    return masks;
+}
 
-    bool eof() const {
-        return pos_ >= input_.size();
+#if defined(SIMPLEJSON_SSE2)
+inline BlockMasks block_masks_sse2(const char *block) {
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    const __m128i fold = _mm_set1_epi8(0x20);
+    const __m128i open = _mm_set1_epi8('{');
+    const __m128i close = _mm_set1_epi8('}');
+    const __m128i comma = _mm_set1_epi8(',');
+    BlockMasks masks;
+    for (unsigned i = 0; i < 4; ++i) {
+        __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(block + 16 * i));
+        __m128i folded = _mm_or_si128(chunk, fold);
+        auto lanes = [](__m128i matches) {
+            return static_cast<uint64_t>(static_cast<uint32_t>(_mm_movemask_epi8(matches)));
+        };
+        masks.quote |= lanes(_mm_cmpeq_epi8(chunk, quote)) << (16 * i);
+        masks.backslash |= lanes(_mm_cmpeq_epi8(chunk, backslash)) << (16 * i);
+        masks.open |= lanes(_mm_cmpeq_epi8(folded, open)) << (16 * i);
+        masks.close |= lanes(_mm_cmpeq_epi8(folded, close)) << (16 * i);
+        masks.comma |= lanes(_mm_cmpeq_epi8(chunk, comma)) << (16 * i);
     }
+    return masks;
+}
+#endif
 
-    std::string_view input_;
-    size_t pos_;
+#if defined(SIMPLEJSON_NEON)
+inline BlockMasks block_masks_neon(const char *block) {
+    const uint8x16_t quote = vdupq_n_u8('"');
+    const uint8x16_t backslash = vdupq_n_u8('\\');
+    const uint8x16_t fold = vdupq_n_u8(0x20);
+    const uint8x16_t open = vdupq_n_u8('{');
+    const uint8x16_t close = vdupq_n_u8('}');
+    const uint8x16_t comma = vdupq_n_u8(',');
+    const uint8x16_t weights = {1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128};
+    BlockMasks masks;
+    for (unsigned i = 0; i < 4; ++i) {
+        uint8x16_t chunk = vld1q_u8(reinterpret_cast<const uint8_t *>(block + 16 * i));
+        uint8x16_t folded = vorrq_u8(chunk, fold);
+        auto lanes = [&](uint8x16_t matches) {
+            uint8x16_t bits = vandq_u8(matches, weights);
+            return static_cast<uint64_t>(vaddv_u8(vget_low_u8(bits))) |
+                   (static_cast<uint64_t>(vaddv_u8(vget_high_u8(bits))) << 8);
+        };
+        masks.quote |= lanes(vceqq_u8(chunk, quote)) << (16 * i);
+        masks.backslash |= lanes(vceqq_u8(chunk, backslash)) << (16 * i);
+        masks.open |= lanes(vceqq_u8(folded, open)) << (16 * i);
+        masks.close |= lanes(vceqq_u8(folded, close)) << (16 * i);
+        masks.comma |= lanes(vceqq_u8(chunk, comma)) << (16 * i);
+    }
+    return masks;
+}
+#endif
+
+using ScanFunction = const char *(*)(const char *, const char *);
+
+struct Kernels {
+    ScanFunction find_string_special;
+    ScanFunction skip_json_whitespace;
+    const char *name;
 };
 
-inline JsonValue parse(std::string_view input) {
-    Parser parser(input);
-    return parser.parse();
+inline Kernels select_kernels() {
+#if defined(SIMPLEJSON_AVX2)
+    if (__builtin_cpu_supports("avx2")) {
+        return {find_string_special_avx2, skip_json_whitespace_avx2, "avx2"};
+    }
+#endif
+#if defined(SIMPLEJSON_SSE2)
+    return {find_string_special_sse2, skip_json_whitespace_sse2, "sse2"};
+#elif defined(SIMPLEJSON_NEON)
+    return {find_string_special_neon, skip_json_whitespace_neon, "neon"};
+#else
+    return {find_string_special_scalar, skip_json_whitespace_scalar, "scalar"};
+#endif
 }
 
-inline const JsonValue *get(const JsonObject &object, const std::string &key) {
-    auto it = object.find(key);
-    if (it == object.end()) {
-        return nullptr;
+// The kernels chosen for this CPU; selected once on first use.
+inline const Kernels &kernels() {
+    static const Kernels selected = select_kernels();
+    return selected;
+}
+
+inline const char *find_string_special(const char *first, const char *last) {
+    return kernels().find_string_special(first, last);
+}
+
+// Most calls land on a token straight away (compact feeds have no
+// whitespace at all), so the first byte is checked before dispatching.
+inline const char *skip_json_whitespace(const char *first, const char *last) {
+    if (first == last || !is_json_whitespace(*first)) {
+        return first;
     }
-    return &it->second;
+    return kernels().skip_json_whitespace(first + 1, last);
 }
 
-inline const JsonValue *get(const JsonArray &array, size_t index) {
-    if (index >= array.size()) {
-        return nullptr;
+// Memory bandwidth rather than vector width limits this scan, so unlike the
+// kernels above it is not dispatched at runtime.
+inline BlockMasks block_masks(const char *block) {
+#if defined(SIMPLEJSON_SSE2)
+    return block_masks_sse2(block);
+#elif defined(SIMPLEJSON_NEON)
+    return block_masks_neon(block);
+#else
+    return block_masks_scalar(block);
+#endif
+}
+
+// Without a popcnt instruction in the target, GCC's builtin becomes a
+// library call, which is slower than counting in registers.
+inline unsigned popcount(uint64_t bits) {
+#if defined(__GNUC__) && (defined(__POPCNT__) || defined(__aarch64__))
+    return static_cast<unsigned>(__builtin_popcountll(bits));
+#else
+    bits = bits - ((bits >> 1) & 0x5555555555555555ULL);
+    bits = (bits & 0x3333333333333333ULL) + ((bits >> 2) & 0x3333333333333333ULL);
+    bits = (bits + (bits >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+    return static_cast<unsigned>((bits * 0x0101010101010101ULL) >> 56);
+#endif
+}
+
+inline unsigned count_trailing_zeros64(uint64_t mask) {
+#if defined(__GNUC__)
+    return static_cast<unsigned>(__builtin_ctzll(mask));
+#else
+    return popcount((mask & (0 - mask)) - 1);
+#endif
+}
+
+// Bit i is set when an odd number of bits at or below i are set.
+inline uint64_t prefix_xor(uint64_t bits) {
+    for (unsigned shift = 1; shift < 64; shift *= 2) {
+        bits ^= bits << shift;
     }
-    return &array[index];
+    return bits;
 }
 
-} // namespace simplejson
+// Characters preceded by an odd-length run of backslashes, as in simdjson's
+// stage 1. `carry` says whether the first byte of the block is escaped and
+// is updated for the next block.
+inline uint64_t escaped_bits(uint64_t backslash, uint64_t &carry) {
+    const uint64_t even_bits = 0x5555555555555555ULL;
+    backslash &= ~carry;
+    uint64_t follows_escape = (backslash << 1) | carry;
+    uint64_t odd_starts = backslash & ~even_bits & ~follows_escape;
+    uint64_t even_starts = odd_starts + backslash;
+    carry = even_starts < backslash ? 1 : 0;
+    return (even_bits ^ (even_starts << 1)) & follows_escape;
+}
+
+// Calls visit(block, masks, in_string) for the 64-byte blocks of
+// [first, last), the last one padded with spaces. `in_string` marks the bytes
+// inside strings (including the opening quote) by a prefix XOR over the
+// unescaped quotes; `in_string_carry` is all ones if `first` lies inside a
+// string. `first` must not follow a backslash. Stops early when visit
+// returns false; returns the in-string state at the end otherwise.
+template <typename Visit>
+uint64_t for_each_block(const char *first, const char *last, uint64_t in_string_carry, Visit &&visit) {
+    uint64_t escape_carry = 0;
+    char tail[64];
+    for (const char *block = first; block < last; block += 64) {
+        BlockMasks masks;
+        if (last - block >= 64) {
+            masks = block_masks(block);
+        } else {
+            std::memset(tail, ' ', sizeof(tail));
+            std::memcpy(tail, block, static_cast<size_t>(last - block));
+            masks = block_masks(tail);
+        }
+        uint64_t quotes = masks.quote & ~escaped_bits(masks.backslash, escape_carry);
+        uint64_t in_string = prefix_xor(quotes) ^ in_string_carry;
+        in_string_carry = 0 - (in_string >> 63);
+        if (!visit(block, masks, in_string)) {
+            break;
+        }
+    }
+    return in_string_carry;
+}
+
+} // namespace scan
+
+// Tokenizer shared by the DOM and SAX parsers. It validates and decodes the
+// individual JSON tokens but leaves the grammar to the derived parser.
+class Lexer {
+protected:
+    explicit Lexer(std::string_view input, size_t max_depth = kMaxDepth)
+        : input_(input), pos_(0), max_depth_(max_depth) {}
+
+    // Held while an array or object is parsed, so that input nested deeper
+    // than max_depth_ fails instead of exhausting the stack.
+    class Nested {
+    public:
+        explicit Nested(Lexer &lexer) : lexer_(lexer) {
+            if (++lexer_.depth_ > lexer_.max_depth_) {
+                --lexer_.depth_;
+                too_deep(lexer_.max_depth_);
+            }
+        }
+        Nested(const Nested &) = delete;
+        Nested &operator=(const Nested &) = delete;
+        ~Nested() { --lexer_.depth_; }
+
+    private:
+        // Out of line, so that the check stays small enough to inline.
+        [[noreturn]] SIMPLEJSON_NOINLINE_COLD static void too_deep(size_t max_depth) {
+            throw ParseError("Nesting deeper than " + std::to_string(max_depth) + " levels");
+        }
+
+        Lexer &lexer_;
+    };
+
+    bool parse_bool_literal() {
+        if (match("true")) {
+            return true;
+        }
+        if (match("false")) {
+            return false;
+        }
+        throw ParseError("Invalid boolean value");
+    }
+
+    // Validates a number token and returns its text.
+    std::string_view scan_number() {
+        std::string_view text = input_.substr(pos_, detail::match_number(input_.substr(pos_)));
+        pos_ += text.size();
+        return text;
+    }
 
+    // Decodes a string token. Strings without escapes are returned as a view
+    // into the input; escaped strings are decoded into a reused scratch
+    // buffer, so the result is only valid until the next call. Between
+    // escapes, unescaped runs are found by the vector scan and copied whole.
+    std::string_view read_string() {
+        expect('"');
+        size_t start = pos_;
+        pos_ = offset_of(detail::scan::find_string_special(cursor(), end()));
+        if (!eof()) {
+            char ch = input_[pos_];
+            if (ch == '"') {
+                ++pos_;
+                return input_.substr(start, pos_ - start - 1);
+            }
+            if (ch != '\\') {
+                throw ParseError("Invalid control character in string");
+            }
+        }
+
+        scratch_.assign(input_.data() + start, pos_ - start);
+        while (!eof()) {
+            char ch = advance();
+            if (ch == '"') {
+                return scratch_;
+            }
+            if (ch != '\\') {
+                throw ParseError("Invalid control character in string");
+            }
+            parse_escape(scratch_);
+            size_t run = pos_;
+            pos_ = offset_of(detail::scan::find_string_special(cursor(), end()));
+            scratch_.append(input_.data() + run, pos_ - run);
+        }
+        throw ParseError("Unterminated string");
+    }
+
+    void skip_string() {
+        expect('"');
+        while (!eof()) {
+            pos_ = offset_of(detail::scan::find_string_special(cursor(), end()));
+            if (eof()) {
+                break;
+            }
+            char ch = advance();
+            if (ch == '"') {
+                return;
+            }
+            if (ch == '\\') {
+                skip_escape();
+            } else if (detail::is_control(ch)) {
+                throw ParseError("Invalid control character in string");
+            }
+        }
+        throw ParseError("Unterminated string");
+    }
+
+    // Validates the next value and steps over it without decoding anything.
+    void skip_value() {
+        char ch = peek();
+        switch (ch) {
+            case 'n':
+                expect("null");
+                return;
+            case 't':
+            case 'f':
+                parse_bool_literal();
+                return;
+            case '"':
+                skip_string();
+                return;
+            case '[':
+                skip_array();
+                return;
+            case '{':
+                skip_object();
+                return;
+            default:
+                if (ch == '-' || std::isdigit(static_cast<unsigned char>(ch))) {
+                    scan_number();
+                    return;
+                }
+                throw ParseError("Invalid JSON value");
+        }
+    }
+
+    void parse_escape(std::string &out) {
+        if (eof()) {
+            throw ParseError("Unterminated escape sequence");
+        }
+        char escaped = advance();
+        if (escaped != 'u') {
+            out.push_back(detail::unescape(escaped));
+            return;
+        }
+        uint32_t value = parse_unicode_escape();
+        // A high surrogate pairs with a low one in the escape right after
+        // it; anything else leaves it unpaired.
+        if (detail::is_high_surrogate(value) && input_.substr(pos_, 2) == "\\u") {
+            size_t saved = pos_;
+            pos_ += 2;
+            uint32_t low = parse_unicode_escape();
+            if (detail::is_low_surrogate(low)) {
+                value = detail::combine_surrogates(value, low);
+            } else {
+                pos_ = saved;
+            }
+        }
+        detail::append_code_point(out, value);
+    }
+
+    void skip_escape() {
+        if (eof()) {
+            throw ParseError("Unterminated escape sequence");
+        }
+        char escaped = advance();
+        if (escaped == 'u') {
+            parse_unicode_escape();
+        } else {
+            detail::unescape(escaped);
+        }
+    }
+
+    uint32_t parse_unicode_escape() {
+        uint32_t value = 0;
+        for (int i = 0; i < 4; ++i) {
+            if (eof()) {
+                throw ParseError("Unexpected end of input in unicode escape");
+            }
+            value = (value << 4) + detail::hex_digit(advance());
+        }
+        return value;
+    }
+
+    bool match(std::string_view text) {
+        if (input_.substr(pos_, text.size()) == text) {
+            pos_ += text.size();
+            return true;
+        }
+        return false;
+    }
+
+    void expect(std::string_view text) {
+        if (!match(text)) {
+            throw ParseError("Expected '" + std::string(text) + "'");
+        }
+    }
+
+    void expect(char expected) {
+        if (eof() || advance() != expected) {
+            throw ParseError(std::string("Expected '") + expected + "'");
+        }
+    }
+
+    void skip_whitespace() {
+        while (true) {
+            pos_ = offset_of(detail::scan::skip_json_whitespace(cursor(), end()));
+            // Vertical tab and form feed are tolerated as in std::isspace.
+            if (eof() || (input_[pos_] != '\v' && input_[pos_] != '\f')) {
+                return;
+            }
+            ++pos_;
+        }
+    }
+
+    const char *cursor() const {
+        return input_.data() + pos_;
+    }
+
+    const char *end() const {
+        return input_.data() + input_.size();
+    }
+
+    size_t offset_of(const char *position) const {
+        return static_cast<size_t>(position - input_.data());
+    }
+
+    char peek() const {
+        if (eof()) {
+            throw ParseError("Unexpected end of input");
+        }
+        return input_[pos_];
+    }
+
+    char advance() {
+        if (eof()) {
+            throw ParseError("Unexpected end of input");
+        }
+        return input_[pos_++];
+    }
+
+    bool eof() const {
+        return pos_ >= input_.size();
+    }
+
+    std::string_view input_;
+    size_t pos_;
+    std::string scratch_;
+
+private:
+    size_t max_depth_;
+    size_t depth_ = 0;
+
+    void skip_array() {
+        const Nested nested(*this);
+        expect('[');
+        skip_whitespace();
+        if (peek() == ']') {
+            advance();
+            return;
+        }
+        while (true) {
+            skip_value();
+            skip_whitespace();
+            if (peek() == ',') {
+                advance();
+                skip_whitespace();
+                continue;
+            }
+            if (peek() == ']') {
+                advance();
+                return;
+            }
+            throw ParseError("Expected ',' or ']' in array");
+        }
+    }
+
+    void skip_object() {
+        const Nested nested(*this);
+        expect('{');
+        skip_whitespace();
+        if (peek() == '}') {
+            advance();
+            return;
+        }
+        while (true) {
+            if (peek() != '"') {
+                throw ParseError("Expected string key in object");
+            }
+            skip_string();
+            skip_whitespace();
+            expect(':');
+            skip_whitespace();
+            skip_value();
+            skip_whitespace();
+            if (peek() == ',') {
+                advance();
+                skip_whitespace();
+                continue;
+            }
+            if (peek() == '}') {
+                advance();
+                return;
+            }
+            throw ParseError("Expected ',' or '}' in object");
+        }
+    }
+};
+
+} // namespace detail
+
+class Parser : private detail::Lexer {
+public:
+    explicit Parser(std::string_view input) : Lexer(input) {}
+
+    JsonValue parse() {
+        skip_whitespace();
+        JsonValue value = parse_value();
+        skip_whitespace();
+        if (!eof()) {
+            throw ParseError("Unexpected characters after JSON value");
+        }
+        return value;
+    }
+
+private:
+    JsonValue parse_value() {
+        if (eof()) {
+            throw ParseError("Unexpected end of input");
+        }
+        char ch = peek();
+        switch (ch) {
+            case 'n':
+                expect("null");
+                return JsonValue(nullptr);
+            case 't':
+            case 'f':
+                return JsonValue(parse_bool_literal());
+            case '"':
+                return JsonValue(std::string(read_string()));
+            case '[':
+                return parse_array();
+            case '{':
+                return parse_object();
+            default:
+                if (ch == '-' || std::isdigit(static_cast<unsigned char>(ch))) {
+                    return parse_number();
+                }
+                throw ParseError("Invalid JSON value");
+        }
+    }
+
+    JsonValue parse_number() {
+        int64_t integer = 0;
+        double real = 0.0;
+        if (detail::decode_number(scan_number(), integer, real)) {
+            return JsonValue(integer);
+        }
+        return JsonValue(real);
+    }
+
+    JsonValue parse_array() {
+        const Nested nested(*this);
+        expect('[');
+        JsonArray array;
+        skip_whitespace();
+        if (peek() == ']') {
+            advance();
+            return JsonValue(std::move(array));
+        }
+        while (true) {
+            array.push_back(parse_value());
+            skip_whitespace();
+            if (peek() == ',') {
+                advance();
+                skip_whitespace();
+                continue;
+            }
+            if (peek() == ']') {
+                advance();
+                break;
+            }
+            throw ParseError("Expected ',' or ']' in array");
+        }
+        return JsonValue(std::move(array));
+    }
+
+    JsonValue parse_object() {
+        const Nested nested(*this);
+        expect('{');
+        JsonObject object;
+        skip_whitespace();
+        if (peek() == '}') {
+            advance();
+            return JsonValue(std::move(object));
+        }
+        while (true) {
+            if (peek() != '"') {
+                throw ParseError("Expected string key in object");
+            }
+            std::string key(read_string());
+            skip_whitespace();
+            expect(':');
+            skip_whitespace();
+            JsonValue value = parse_value();
+            object.emplace(std::move(key), std::move(value));
+            skip_whitespace();
+            if (peek() == ',') {
+                advance();
+                skip_whitespace();
+                continue;
+            }
+            if (peek() == '}') {
+                advance();
+                break;
+            }
+            throw ParseError("Expected ',' or '}' in object");
+        }
+        return JsonValue(std::move(object));
+    }
+};
+
+// Event-driven parser that reports values to a handler instead of building a
+// JsonValue tree. The handler provides:
+//
+//   bool start_object();              // false skips the object, no end_object()
+//   void end_object();
+//   bool start_array();               // false skips the array, no end_array()
+//   void end_array();
+//   bool key(std::string_view name);  // false skips the member's value
+//   void null();
+//   void boolean(bool value);
+//   void integer(int64_t value);      // integral numbers that fit in int64_t
+//   void number(double value);        // every other number
+//   void string(std::string_view value);
+//
+// String views passed to the handler are only valid for the duration of the
+// call. Skipped values are still validated but never decoded or allocated.
+template <typename Handler>
+class SaxParser : private detail::Lexer {
+public:
+    SaxParser(std::string_view input, Handler &handler, size_t max_depth = kMaxDepth)
+        : Lexer(input, max_depth), handler_(handler) {}
+
+    void parse() {
+        skip_whitespace();
+        parse_value();
+        skip_whitespace();
+        if (!eof()) {
+            throw ParseError("Unexpected characters after JSON value");
+        }
+    }
+
+private:
+    void parse_value() {
+        if (eof()) {
+            throw ParseError("Unexpected end of input");
+        }
+        char ch = peek();
+        switch (ch) {
+            case 'n':
+                expect("null");
+                handler_.null();
+                return;
+            case 't':
+            case 'f':
+                handler_.boolean(parse_bool_literal());
+                return;
+            case '"':
+                handler_.string(read_string());
+                return;
+            case '[':
+                parse_array();
+                return;
+            case '{':
+                parse_object();
+                return;
+            default:
+                if (ch == '-' || std::isdigit(static_cast<unsigned char>(ch))) {
+                    number(scan_number());
+                    return;
+                }
+                throw ParseError("Invalid JSON value");
+        }
+    }
+
+    void number(std::string_view text) {
+        int64_t integer = 0;
+        double real = 0.0;
+        if (detail::decode_number(text, integer, real)) {
+            handler_.integer(integer);
+        } else {
+            handler_.number(real);
+        }
+    }
+
+    void parse_array() {
+        if (!handler_.start_array()) {
+            skip_value();
+            return;
+        }
+        const Nested nested(*this);
+        expect('[');
+        skip_whitespace();
+        if (peek() == ']') {
+            advance();
+            handler_.end_array();
+            return;
+        }
+        while (true) {
+            parse_value();
+            skip_whitespace();
+            if (peek() == ',') {
+                advance();
+                skip_whitespace();
+                continue;
+            }
+            if (peek() == ']') {
+                advance();
+                break;
+            }
+            throw ParseError("Expected ',' or ']' in array");
+        }
+        handler_.end_array();
+    }
+
+    void parse_object() {
+        if (!handler_.start_object()) {
+            skip_value();
+            return;
+        }
+        const Nested nested(*this);
+        expect('{');
+        skip_whitespace();
+        if (peek() == '}') {
+            advance();
+            handler_.end_object();
+            return;
+        }
+        while (true) {
+            if (peek() != '"') {
+                throw ParseError("Expected string key in object");
+            }
+            bool wanted = handler_.key(read_string());
+            skip_whitespace();
+            expect(':');
+            skip_whitespace();
+            if (wanted) {
+                parse_value();
+            } else {
+                skip_value();
+            }
+            skip_whitespace();
+            if (peek() == ',') {
+                advance();
+                skip_whitespace();
+                continue;
+            }
+            if (peek() == '}') {
+                advance();
+                break;
+            }
+            throw ParseError("Expected ',' or '}' in object");
+        }
+        handler_.end_object();
+    }
+
+    Handler &handler_;
+};
+
+// Resumable counterpart of SaxParser for input that arrives in pieces, such as
+// a network transfer. Each feed() consumes one chunk and reports every value
+// completed so far to the same kind of handler SaxParser uses; tokens split
+// across chunks are carried over internally. finish() must be called after
+// the last chunk. String views passed to the handler point either into the
+// current chunk or into an internal buffer and are only valid during the
+// call.
+template <typename Handler>
+class PushParser {
+public:
+    explicit PushParser(Handler &handler, size_t max_depth = kMaxDepth) : handler_(handler), max_depth_(max_depth) {}
+
+    void feed(std::string_view chunk) {
+        size_t pos = 0;
+        while (pos < chunk.size()) {
+            switch (token_) {
+                case Token::None:
+                    pos = begin_token(chunk, pos);
+                    break;
+                case Token::String:
+                    pos = continue_string(chunk, pos);
+                    break;
+                case Token::Number:
+                case Token::Literal:
+                    pos = continue_word(chunk, pos);
+                    break;
+            }
+        }
+    }
+
+    void finish() {
+        if (token_ == Token::String) {
+            throw ParseError("Unterminated string");
+        }
+        if (token_ == Token::Number || token_ == Token::Literal) {
+            finish_word(text_);
+        }
+        if (expect_ != Expect::Done) {
+            throw ParseError("Unexpected end of input");
+        }
+    }
+
+private:
+    enum class Token { None, String, Number, Literal };
+    enum class Expect { Value, FirstElementOrEnd, FirstKeyOrEnd, Key, Colon, CommaOrEnd, Done };
+
+    size_t begin_token(std::string_view chunk, size_t pos) {
+        char ch = chunk[pos];
+        switch (ch) {
+            case ' ':
+            case '\t':
+            case '\n':
+            case '\r': {
+                const char *first = chunk.data();
+                return static_cast<size_t>(
+                    detail::scan::skip_json_whitespace(first + pos, first + chunk.size()) - first);
+            }
+            case '\v':
+            case '\f':
+                return pos + 1;
+            case '{':
+            case '[':
+                begin_value();
+                open(ch == '{');
+                return pos + 1;
+            case '}':
+                if (expect_ != Expect::FirstKeyOrEnd && !(expect_ == Expect::CommaOrEnd && stack_.back())) {
+                    unexpected();
+                }
+                close(true);
+                return pos + 1;
+            case ']':
+                if (expect_ != Expect::FirstElementOrEnd && !(expect_ == Expect::CommaOrEnd && !stack_.back())) {
+                    unexpected();
+                }
+                close(false);
+                return pos + 1;
+            case ':':
+                if (expect_ != Expect::Colon) {
+                    unexpected();
+                }
+                expect_ = Expect::Value;
+                return pos + 1;
+            case ',':
+                if (expect_ != Expect::CommaOrEnd) {
+                    unexpected();
+                }
+                expect_ = stack_.back() ? Expect::Key : Expect::Value;
+                return pos + 1;
+            case '"':
+                is_key_ = expect_ == Expect::FirstKeyOrEnd || expect_ == Expect::Key;
+                if (!is_key_) {
+                    begin_value();
+                }
+                token_ = Token::String;
+                buffered_ = false;
+                return pos + 1;
+            default:
+                begin_value();
+                if (ch == '-' || std::isdigit(static_cast<unsigned char>(ch))) {
+                    token_ = Token::Number;
+                } else if (ch == 't' || ch == 'f' || ch == 'n') {
+                    token_ = Token::Literal;
+                } else {
+                    throw ParseError("Invalid JSON value");
+                }
+                buffered_ = false;
+                return continue_word(chunk, pos);
+        }
+    }
+
+    size_t continue_string(std::string_view chunk, size_t pos) {
+        size_t end = chunk.size();
+        if (!buffered_) {
+            size_t run = find_string_special(chunk, pos);
+            if (run < end && chunk[run] == '"') {
+                finish_string(chunk.substr(pos, run - pos));
+                return run + 1;
+            }
+            text_.assign(chunk.data() + pos, run - pos);
+            buffered_ = true;
+            escape_ = false;
+            unicode_digits_ = 0;
+            high_surrogate_ = 0;
+            pos = run;
+        }
+
+        while (pos < end) {
+            char ch = chunk[pos++];
+            if (unicode_digits_ > 0) {
+                code_point_ = (code_point_ << 4) + detail::hex_digit(ch);
+                if (--unicode_digits_ == 0) {
+                    end_unicode_escape();
+                }
+                continue;
+            }
+            if (escape_) {
+                escape_ = false;
+                if (ch == 'u') {
+                    unicode_digits_ = 4;
+                    code_point_ = 0;
+                    continue;
+                }
+                flush_high_surrogate();
+                text_.push_back(detail::unescape(ch));
+            } else if (ch == '\\') {
+                // A pending high surrogate waits to see whether a \u
+                // follows.
+                escape_ = true;
+                continue;
+            } else {
+                flush_high_surrogate();
+                if (ch == '"') {
+                    finish_string(text_);
+                    return pos;
+                }
+                if (detail::is_control(ch)) {
+                    throw ParseError("Invalid control character in string");
+                }
+                --pos;
+            }
+            // Copy the unescaped run up to the next quote or escape.
+            size_t run = find_string_special(chunk, pos);
+            text_.append(chunk.data() + pos, run - pos);
+            pos = run;
+        }
+        return end;
+    }
+
+    // A high surrogate is held until the next escape shows whether it is
+    // half of a pair.
+    void end_unicode_escape() {
+        if (high_surrogate_ != 0 && detail::is_low_surrogate(code_point_)) {
+            detail::append_code_point(text_, detail::combine_surrogates(high_surrogate_, code_point_));
+            high_surrogate_ = 0;
+            return;
+        }
+        flush_high_surrogate();
+        if (detail::is_high_surrogate(code_point_)) {
+            high_surrogate_ = code_point_;
+        } else {
+            detail::append_code_point(text_, code_point_);
+        }
+    }
+
+    // Emits a held high surrogate that turned out to be unpaired.
+    void flush_high_surrogate() {
+        if (high_surrogate_ != 0) {
+            detail::append_code_point(text_, high_surrogate_);
+            high_surrogate_ = 0;
+        }
+    }
+
+    static size_t find_string_special(std::string_view chunk, size_t pos) {
+        const char *first = chunk.data();
+        return static_cast<size_t>(detail::scan::find_string_special(first + pos, first + chunk.size()) - first);
+    }
+
+    size_t continue_word(std::string_view chunk, size_t pos) {
+        size_t run = pos;
+        while (run < chunk.size() && is_word_char(chunk[run])) {
+            ++run;
+        }
+        if (run == chunk.size()) {
+            if (buffered_) {
+                text_.append(chunk.data() + pos, run - pos);
+            } else {
+                text_.assign(chunk.data() + pos, run - pos);
+                buffered_ = true;
+            }
+            return run;
+        }
+        if (buffered_) {
+            text_.append(chunk.data() + pos, run - pos);
+            finish_word(text_);
+        } else {
+            finish_word(chunk.substr(pos, run - pos));
+        }
+        return run;
+    }
+
+    bool is_word_char(char ch) const {
+        if (token_ == Token::Literal) {
+            return ch >= 'a' && ch <= 'z';
+        }
+        return std::isdigit(static_cast<unsigned char>(ch)) || ch == '-' || ch == '+' || ch == '.' || ch == 'e' ||
+               ch == 'E';
+    }
+
+    void finish_string(std::string_view text) {
+        token_ = Token::None;
+        if (is_key_) {
+            if (skip_depth_ == 0) {
+                skip_next_ = !handler_.key(text);
+            }
+            expect_ = Expect::Colon;
+            return;
+        }
+        if (deliver()) {
+            handler_.string(text);
+        }
+        end_value();
+    }
+
+    void finish_word(std::string_view text) {
+        Token token = token_;
+        token_ = Token::None;
+        if (token == Token::Number) {
+            if (detail::match_number(text) != text.size()) {
+                throw ParseError("Invalid number");
+            }
+            int64_t integer = 0;
+            double real = 0.0;
+            bool is_integer = detail::decode_number(text, integer, real);
+            if (deliver()) {
+                if (is_integer) {
+                    handler_.integer(integer);
+                } else {
+                    handler_.number(real);
+                }
+            }
+        } else if (text == "null") {
+            if (deliver()) {
+                handler_.null();
+            }
+        } else if (text == "true" || text == "false") {
+            if (deliver()) {
+                handler_.boolean(text == "true");
+            }
+        } else if (text[0] == 'n') {
+            throw ParseError("Expected 'null'");
+        } else {
+            throw ParseError("Invalid boolean value");
+        }
+        end_value();
+    }
+
+    void begin_value() {
+        if (expect_ != Expect::Value && expect_ != Expect::FirstElementOrEnd) {
+            unexpected();
+        }
+    }
+
+    void end_value() {
+        expect_ = stack_.empty() ? Expect::Done : Expect::CommaOrEnd;
+    }
+
+    // Consumes a pending "skip this value" request from the handler.
+    bool deliver() {
+        bool skipped = skip_depth_ > 0 || skip_next_;
+        skip_next_ = false;
+        return !skipped;
+    }
+
+    void open(bool object) {
+        if (skip_depth_ > 0) {
+            ++skip_depth_;
+        } else if (skip_next_) {
+            skip_next_ = false;
+            skip_depth_ = 1;
+        } else if (!(object ? handler_.start_object() : handler_.start_array())) {
+            skip_depth_ = 1;
+        }
+        if (stack_.size() == max_depth_) {
+            throw ParseError("Nesting deeper than " + std::to_string(max_depth_) + " levels");
+        }
+        stack_.push_back(object);
+        expect_ = object ? Expect::FirstKeyOrEnd : Expect::FirstElementOrEnd;
+    }
+
+    void close(bool object) {
+        stack_.pop_back();
+        if (skip_depth_ > 0) {
+            --skip_depth_;
+        } else if (object) {
+            handler_.end_object();
+        } else {
+            handler_.end_array();
+        }
+        end_value();
+    }
+
+    [[noreturn]] void unexpected() const {
+        switch (expect_) {
+            case Expect::Done:
+                throw ParseError("Unexpected characters after JSON value");
+            case Expect::FirstKeyOrEnd:
+            case Expect::Key:
+                throw ParseError("Expected string key in object");
+            case Expect::Colon:
+                throw ParseError("Expected ':'");
+            case Expect::CommaOrEnd:
+                if (stack_.back()) {
+                    throw ParseError("Expected ',' or '}' in object");
+                }
+                throw ParseError("Expected ',' or ']' in array");
+            default:
+                throw ParseError("Invalid JSON value");
+        }
+    }
+
+    Handler &handler_;
+    size_t max_depth_;
+    std::vector<bool> stack_;  // true for objects, false for arrays
+    Expect expect_ = Expect::Value;
+    Token token_ = Token::None;
+    bool is_key_ = false;
+    bool buffered_ = false;
+    bool escape_ = false;
+    int unicode_digits_ = 0;
+    uint32_t code_point_ = 0;
+    // A high surrogate awaiting its low half, or 0.
+    uint32_t high_surrogate_ = 0;
+    bool skip_next_ = false;
+    size_t skip_depth_ = 0;
+    std::string text_;
+};
+
+// Locates the elements of an array member of the root object without
+// parsing them, so that they can be parsed independently, e.g. on several
+// threads. Everything outside that array is validated as usual, but the
+// elements are only delimited by the commas between them: each returned
+// slice must still be parsed, which is where its contents are validated.
+// The slices point into the input.
+//
+// The array itself is scanned 64 bytes at a time with bit masks and can be
+// split into pieces scanned in parallel. Each piece is first summarized
+// (net bracket depth and whether it flips the in-string state) for both
+// possible starting states; a quick serial pass then fixes the real state
+// at each piece's start, and a second parallel pass collects the commas at
+// element depth.
+class ElementSplitter : private detail::Lexer {
+public:
+    // Calls task(0) ... task(count - 1), possibly concurrently, and returns
+    // once all of them finished.
+    using ForEach = std::function<void(size_t count, const std::function<void(size_t)> &task)>;
+
+    explicit ElementSplitter(std::string_view input) : Lexer(input) {}
+
+    // Returns the elements of every array stored under `key`, or nothing
+    // when the root is not an object or holds no such array. The scan of
+    // the array runs as `tasks` pieces through `for_each`.
+    std::optional<std::vector<std::string_view>> split(std::string_view key, size_t tasks = 1,
+                                                       const ForEach &for_each = run_serially) {
+        std::optional<std::vector<std::string_view>> elements;
+        skip_whitespace();
+        if (peek() != '{') {
+            skip_value();
+        } else {
+            split_object(key, std::max<size_t>(tasks, 1), for_each, elements);
+        }
+        skip_whitespace();
+        if (!eof()) {
+            throw ParseError("Unexpected characters after JSON value");
+        }
+        return elements;
+    }
+
+private:
+    // Pieces smaller than this are not worth a task.
+    static constexpr size_t kMinPiece = 1 << 16;
+
+    static void run_serially(size_t count, const std::function<void(size_t)> &task) {
+        for (size_t i = 0; i < count; ++i) {
+            task(i);
+        }
+    }
+
+    // Bracket balance of a piece for one assumed starting state: the net
+    // change in depth, and the lowest depth reached by a closing bracket
+    // relative to the start.
+    struct Balance {
+        int64_t delta = 0;
+        int64_t lowest = std::numeric_limits<int64_t>::max();
+
+        void add(uint64_t open, uint64_t close) {
+            int64_t closes = detail::scan::popcount(close);
+            if (closes == 0 || delta - closes >= lowest) {
+                delta += static_cast<int64_t>(detail::scan::popcount(open)) - closes;
+                return;
+            }
+            for (uint64_t brackets = open | close; brackets != 0; brackets &= brackets - 1) {
+                if (open & brackets & (0 - brackets)) {
+                    ++delta;
+                } else {
+                    lowest = std::min(lowest, --delta);
+                }
+            }
+        }
+    };
+
+    struct Piece {
+        const char *first = nullptr;
+        const char *last = nullptr;
+        // Index 0 assumes the piece starts outside a string, index 1 inside.
+        Balance balance[2];
+        uint64_t flips_string = 0;
+        // Filled in by the second pass.
+        uint64_t in_string = 0;
+        int64_t depth = 0;
+        std::vector<const char *> commas;
+        const char *close = nullptr;
+    };
+
+    void split_object(std::string_view key, size_t tasks, const ForEach &for_each,
+                      std::optional<std::vector<std::string_view>> &elements) {
+        expect('{');
+        skip_whitespace();
+        if (peek() == '}') {
+            advance();
+            return;
+        }
+        while (true) {
+            if (peek() != '"') {
+                throw ParseError("Expected string key in object");
+            }
+            bool wanted = read_string() == key;
+            skip_whitespace();
+            expect(':');
+            skip_whitespace();
+            if (wanted && peek() == '[') {
+                if (!elements) {
+                    elements.emplace();
+                }
+                split_array(tasks, for_each, *elements);
+            } else {
+                skip_value();
+            }
+            skip_whitespace();
+            if (peek() == ',') {
+                advance();
+                skip_whitespace();
+                continue;
+            }
+            if (peek() == '}') {
+                advance();
+                return;
+            }
+            throw ParseError("Expected ',' or '}' in object");
+        }
+    }
+
+    void split_array(size_t tasks, const ForEach &for_each, std::vector<std::string_view> &elements) {
+        std::vector<Piece> pieces = make_pieces(tasks);
+
+        // Pass 1: summarize each piece for both starting states. A lone
+        // piece starts at the '[' and needs no summary.
+        if (pieces.size() > 1) {
+            for_each(pieces.size(), [&](size_t i) { summarize(pieces[i]); });
+        }
+
+        // Fix the state at each piece's start and find the piece in which
+        // the array closes.
+        size_t closing = pieces.size();
+        uint64_t in_string = 0;
+        int64_t depth = 0;
+        for (size_t i = 0; i < pieces.size(); ++i) {
+            pieces[i].in_string = in_string;
+            pieces[i].depth = depth;
+            const Balance &balance = pieces[i].balance[in_string & 1];
+            if (pieces.size() == 1 || balance.lowest <= -depth) {
+                closing = i;
+                break;
+            }
+            depth += balance.delta;
+            in_string ^= pieces[i].flips_string;
+        }
+        if (closing == pieces.size()) {
+            throw ParseError("Unexpected end of input");
+        }
+
+        // Pass 2: collect the element separators up to the closing bracket.
+        for_each(closing + 1, [&](size_t i) { find_separators(pieces[i]); });
+        const char *close = pieces[closing].close;
+        if (!close) {
+            throw ParseError("Unexpected end of input");
+        }
+        if (*close != ']') {
+            throw ParseError("Expected ',' or ']' in array");
+        }
+
+        const char *start = cursor() + 1;
+        size_t first_element = elements.size();
+        for (size_t i = 0; i <= closing; ++i) {
+            for (const char *comma : pieces[i].commas) {
+                add_element(elements, start, comma);
+                start = comma + 1;
+            }
+        }
+        std::string_view last_element = trim(start, close);
+        if (!last_element.empty()) {
+            elements.push_back(last_element);
+        } else if (elements.size() != first_element) {
+            throw ParseError("Invalid JSON value");
+        }
+        pos_ = offset_of(close) + 1;
+    }
+
+    // Cuts [cursor(), end()) into pieces. A piece never starts right after
+    // a backslash, so no escape sequence spans two pieces.
+    std::vector<Piece> make_pieces(size_t tasks) const {
+        size_t length = input_.size() - pos_;
+        size_t count = std::max<size_t>(1, std::min(tasks, length / kMinPiece));
+        std::vector<Piece> pieces;
+        const char *first = cursor();
+        for (size_t i = 1; i <= count; ++i) {
+            const char *last = i == count ? end() : cursor() + length * i / count;
+            while (last < end() && last[-1] == '\\') {
+                ++last;
+            }
+            if (last > first) {
+                Piece piece;
+                piece.first = first;
+                piece.last = last;
+                pieces.push_back(std::move(piece));
+                first = last;
+            }
+        }
+        return pieces;
+    }
+
+    static void summarize(Piece &piece) {
+        piece.flips_string = detail::scan::for_each_block(
+            piece.first, piece.last, 0, [&](const char *, const detail::scan::BlockMasks &masks, uint64_t in_string) {
+                piece.balance[0].add(masks.open & ~in_string, masks.close & ~in_string);
+                piece.balance[1].add(masks.open & in_string, masks.close & in_string);
+                return true;
+            });
+    }
+
+    // Records the commas at element depth and the bracket that closes the
+    // array, if it lies in this piece.
+    static void find_separators(Piece &piece) {
+        int64_t depth = piece.depth;
+        detail::scan::for_each_block(
+            piece.first, piece.last, piece.in_string,
+            [&](const char *block, const detail::scan::BlockMasks &masks, uint64_t in_string) {
+                uint64_t open = masks.open & ~in_string;
+                uint64_t close = masks.close & ~in_string;
+                int64_t closes = detail::scan::popcount(close);
+                if (depth - closes >= 2) {
+                    depth += static_cast<int64_t>(detail::scan::popcount(open)) - closes;
+                    return true;
+                }
+                // Walk the brackets only; the commas between two brackets
+                // at element depth are picked out with a mask.
+                uint64_t comma = masks.comma & ~in_string;
+                unsigned run_start = 0;
+                for (uint64_t brackets = open | close; brackets != 0; brackets &= brackets - 1) {
+                    unsigned index = detail::scan::count_trailing_zeros64(brackets);
+                    if (depth == 1) {
+                        add_commas(piece, block, comma, run_start, index);
+                    }
+                    if (open & brackets & (0 - brackets)) {
+                        ++depth;
+                    } else if (--depth == 0) {
+                        piece.close = block + index;
+                        return false;
+                    }
+                    run_start = index + 1;
+                }
+                if (depth == 1) {
+                    add_commas(piece, block, comma, run_start, 64);
+                }
+                return true;
+            });
+    }
+
+    // Records the commas at bit positions [first, last) of a block.
+    static void add_commas(Piece &piece, const char *block, uint64_t comma, unsigned first, unsigned last) {
+        if (first >= last) {
+            return;
+        }
+        uint64_t below_last = last == 64 ? ~uint64_t{0} : (uint64_t{1} << last) - 1;
+        for (comma &= below_last & ~((uint64_t{1} << first) - 1); comma != 0; comma &= comma - 1) {
+            piece.commas.push_back(block + detail::scan::count_trailing_zeros64(comma));
+        }
+    }
+
+    static void add_element(std::vector<std::string_view> &elements, const char *first, const char *last) {
+        std::string_view element = trim(first, last);
+        if (element.empty()) {
+            throw ParseError("Invalid JSON value");
+        }
+        elements.push_back(element);
+    }
+
+    // Whitespace as accepted by skip_whitespace().
+    static std::string_view trim(const char *first, const char *last) {
+        auto is_space = [](char ch) { return detail::is_json_whitespace(ch) || ch == '\v' || ch == '\f'; };
+        while (first < last && is_space(*first)) {
+            ++first;
+        }
+        while (last > first && is_space(last[-1])) {
+            --last;
+        }
+        return std::string_view(first, static_cast<size_t>(last - first));
+    }
+};
+
+class FlatValue;
+class FlatArray;
+class FlatObject;
+struct FlatMember;
+
+// Immutable JSON value stored in a Document's arena. Arrays and objects are
+// contiguous runs of children; object members are sorted by key so lookups
+// are a binary search. Strings and keys are views into the parsed input
+// unless they contained escapes, in which case they live in the arena.
+class FlatValue {
+public:
+    // Integer is a Number whose token was integral and fits in int64_t.
+    enum class Type : unsigned char { Null, Bool, Number, Integer, String, Array, Object };
+
+    FlatValue() : number_(0) {}
+
+    Type type() const { return type_; }
+
+    bool is_null() const { return type_ == Type::Null; }
+    bool is_bool() const { return type_ == Type::Bool; }
+    bool is_number() const { return type_ == Type::Number || type_ == Type::Integer; }
+    bool is_integer() const { return type_ == Type::Integer; }
+    bool is_string() const { return type_ == Type::String; }
+    bool is_array() const { return type_ == Type::Array; }
+    bool is_object() const { return type_ == Type::Object; }
+
+    std::string_view as_string() const {
+        require(Type::String);
+        return std::string_view(chars_, size_);
+    }
+    double as_number() const {
+        if (type_ == Type::Integer) {
+            return static_cast<double>(integer_);
+        }
+        require(Type::Number);
+        return number_;
+    }
+    int64_t as_integer() const {
+        require(Type::Integer);
+        return integer_;
+    }
+    bool as_bool() const {
+        require(Type::Bool);
+        return boolean_;
+    }
+    FlatArray as_array() const;
+    FlatObject as_object() const;
+
+private:
+    friend class ArenaParser;
+
+    void require(Type type) const {
+        if (type_ != type) {
+            throw std::bad_variant_access();
+        }
+    }
+
+    Type type_ = Type::Null;
+    size_t size_ = 0;
+    union {
+        bool boolean_;
+        double number_;
+        int64_t integer_;
+        const char *chars_;
+        const FlatValue *items_;
+        const FlatMember *members_;
+    };
+};
+
+struct FlatMember {
+    std::string_view key;
+    FlatValue value;
+};
+
+class FlatArray {
+public:
+    FlatArray(const FlatValue *items, size_t size) : items_(items), size_(size) {}
+
+    const FlatValue *begin() const { return items_; }
+    const FlatValue *end() const { return items_ + size_; }
+    size_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+    const FlatValue &operator[](size_t index) const { return items_[index]; }
+
+private:
+    const FlatValue *items_;
+    size_t size_;
+};
+
+class FlatObject {
+public:
+    FlatObject(const FlatMember *members, size_t size) : members_(members), size_(size) {}
+
+    const FlatMember *begin() const { return members_; }
+    const FlatMember *end() const { return members_ + size_; }
+    size_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+
+    // Returns the first member named `key`, mirroring std::map::emplace
+    // keeping the first of duplicate keys.
+    const FlatValue *find(std::string_view key) const {
+        const FlatMember *it = std::lower_bound(begin(), end(), key, [](const FlatMember &member, std::string_view k) {
+            return member.key < k;
+        });
+        if (it == end() || it->key != key) {
+            return nullptr;
+        }
+        return &it->value;
+    }
+
+private:
+    const FlatMember *members_;
+    size_t size_;
+};
+
+inline FlatArray FlatValue::as_array() const {
+    require(Type::Array);
+    return FlatArray(items_, size_);
+}
+
+inline FlatObject FlatValue::as_object() const {
+    require(Type::Object);
+    return FlatObject(members_, size_);
+}
+
+// Builds FlatValues into a monotonic arena. Children are collected on reused
+// scratch stacks and copied into the arena in one block when their container
+// closes, so the only allocations are the arena's own growth.
+class ArenaParser : private detail::Lexer {
+public:
+    ArenaParser(std::string_view input, std::pmr::memory_resource &arena) : Lexer(input), arena_(arena) {}
+
+    FlatValue parse() {
+        skip_whitespace();
+        FlatValue value = parse_value();
+        skip_whitespace();
+        if (!eof()) {
+            throw ParseError("Unexpected characters after JSON value");
+        }
+        return value;
+    }
+
+private:
+    FlatValue parse_value() {
+        if (eof()) {
+            throw ParseError("Unexpected end of input");
+        }
+        FlatValue value;
+        char ch = peek();
+        switch (ch) {
+            case 'n':
+                expect("null");
+                return value;
+            case 't':
+            case 'f':
+                value.type_ = FlatValue::Type::Bool;
+                value.boolean_ = parse_bool_literal();
+                return value;
+            case '"': {
+                std::string_view text = intern(read_string());
+                value.type_ = FlatValue::Type::String;
+                value.chars_ = text.data();
+                value.size_ = text.size();
+                return value;
+            }
+            case '[':
+                return parse_array();
+            case '{':
+                return parse_object();
+            default:
+                if (ch == '-' || std::isdigit(static_cast<unsigned char>(ch))) {
+                    return parse_number();
+                }
+                throw ParseError("Invalid JSON value");
+        }
+    }
+
+    FlatValue parse_number() {
+        int64_t integer = 0;
+        double real = 0.0;
+        FlatValue value;
+        if (detail::decode_number(scan_number(), integer, real)) {
+            value.type_ = FlatValue::Type::Integer;
+            value.integer_ = integer;
+        } else {
+            value.type_ = FlatValue::Type::Number;
+            value.number_ = real;
+        }
+        return value;
+    }
+
+    FlatValue parse_array() {
+        const Nested nested(*this);
+        expect('[');
+        size_t base = items_.size();
+        skip_whitespace();
+        if (peek() == ']') {
+            advance();
+        } else {
+            while (true) {
+                FlatValue item = parse_value();
+                items_.push_back(item);
+                skip_whitespace();
+                if (peek() == ',') {
+                    advance();
+                    skip_whitespace();
+                    continue;
+                }
+                if (peek() == ']') {
+                    advance();
+                    break;
+                }
+                throw ParseError("Expected ',' or ']' in array");
+            }
+        }
+
+        FlatValue value;
+        value.type_ = FlatValue::Type::Array;
+        value.size_ = items_.size() - base;
+        value.items_ = copy_to_arena(items_.data() + base, value.size_);
+        items_.resize(base);
+        return value;
+    }
+
+    FlatValue parse_object() {
+        const Nested nested(*this);
+        expect('{');
+        size_t base = members_.size();
+        skip_whitespace();
+        if (peek() == '}') {
+            advance();
+        } else {
+            while (true) {
+                if (peek() != '"') {
+                    throw ParseError("Expected string key in object");
+                }
+                std::string_view key = intern(read_string());
+                skip_whitespace();
+                expect(':');
+                skip_whitespace();
+                FlatValue value = parse_value();
+                members_.push_back(FlatMember{key, value});
+                skip_whitespace();
+                if (peek() == ',') {
+                    advance();
+                    skip_whitespace();
+                    continue;
+                }
+                if (peek() == '}') {
+                    advance();
+                    break;
+                }
+                throw ParseError("Expected ',' or '}' in object");
+            }
+        }
+
+        sort_members(base);
+
+        FlatValue value;
+        value.type_ = FlatValue::Type::Object;
+        value.size_ = members_.size() - base;
+        value.members_ = copy_to_arena(members_.data() + base, value.size_);
+        members_.resize(base);
+        return value;
+    }
+
+    // Stable insertion sort: objects are small and often already sorted, and
+    // unlike std::stable_sort this never allocates a temporary buffer.
+    void sort_members(size_t base) {
+        for (size_t i = base + 1; i < members_.size(); ++i) {
+            FlatMember member = members_[i];
+            size_t j = i;
+            while (j > base && member.key < members_[j - 1].key) {
+                members_[j] = members_[j - 1];
+                --j;
+            }
+            members_[j] = member;
+        }
+    }
+
+    // Strings decoded into the lexer's scratch buffer are moved into the
+    // arena; everything else already points into the input.
+    std::string_view intern(std::string_view text) {
+        if (text.empty() || text.data() != scratch_.data()) {
+            return text;
+        }
+        char *copy = static_cast<char *>(arena_.allocate(text.size(), 1));
+        std::copy(text.begin(), text.end(), copy);
+        return std::string_view(copy, text.size());
+    }
+
+    template <typename T>
+    const T *copy_to_arena(const T *items, size_t count) {
+        if (count == 0) {
+            return nullptr;
+        }
+        T *copy = static_cast<T *>(arena_.allocate(count * sizeof(T), alignof(T)));
+        std::uninitialized_copy(items, items + count, copy);
+        return copy;
+    }
+
+    std::pmr::memory_resource &arena_;
+    std::vector<FlatValue> items_;
+    std::vector<FlatMember> members_;
+};
+
+// Owns the arena behind a tree of FlatValues. The input passed to the
+// constructor must outlive the document; destroying the document releases
+// every node at once.
+class Document {
+public:
+    explicit Document(std::string_view input) : arena_(initial_arena_size(input.size())) {
+        ArenaParser parser(input, arena_);
+        root_ = parser.parse();
+    }
+
+    Document(const Document &) = delete;
+    Document &operator=(const Document &) = delete;
+
+    const FlatValue &root() const { return root_; }
+
+private:
+    // A FlatValue is larger than most of the tokens it describes, so start
+    // the arena at about the input size and let it grow from there.
+    static size_t initial_arena_size(size_t input_size) {
+        return std::max<size_t>(input_size, 1024);
+    }
+
+    std::pmr::monotonic_buffer_resource arena_;
+    FlatValue root_;
+};
+
+class TapeValue;
+class TapeArray;
+class TapeObject;
+struct TapeMember;
+
+// JSON value recorded on a TapeDocument's tape. The tape is one array of
+// these in document order, a container followed by its whole subtree, so
+// building it is a single validating pass with no per-node allocation.
+// Decoding is left to the accessors: numbers are converted from their token
+// each time they are read, and strings are views into the input. Only
+// strings with escapes are decoded during the pass, into the document's
+// arena, since nothing else could own the result.
+//
+// Containers are walked rather than indexed: operator[] and find() step
+// over the children before the one they return.
+class TapeValue {
+public:
+    using Type = FlatValue::Type;
+
+    // Tells Integer from Number by decoding the token.
+    Type type() const {
+        switch (kind()) {
+            case Kind::Null: return Type::Null;
+            case Kind::True:
+            case Kind::False: return Type::Bool;
+            case Kind::Number: return is_integer() ? Type::Integer : Type::Number;
+            case Kind::String: return Type::String;
+            case Kind::Array: return Type::Array;
+            case Kind::Object: return Type::Object;
+        }
+        return Type::Null;
+    }
+
+    bool is_null() const { return kind() == Kind::Null; }
+    bool is_bool() const { return kind() == Kind::True || kind() == Kind::False; }
+    bool is_number() const { return kind() == Kind::Number; }
+    bool is_integer() const {
+        int64_t integer = 0;
+        double real = 0.0;
+        return is_number() && detail::decode_number(token(), integer, real);
+    }
+    bool is_string() const { return kind() == Kind::String; }
+    bool is_array() const { return kind() == Kind::Array; }
+    bool is_object() const { return kind() == Kind::Object; }
+
+    std::string_view as_string() const {
+        require(Kind::String);
+        return token();
+    }
+    double as_number() const {
+        require(Kind::Number);
+        int64_t integer = 0;
+        double real = 0.0;
+        return detail::decode_number(token(), integer, real) ? static_cast<double>(integer) : real;
+    }
+    int64_t as_integer() const {
+        require(Kind::Number);
+        int64_t integer = 0;
+        double real = 0.0;
+        if (!detail::decode_number(token(), integer, real)) {
+            throw std::bad_variant_access();
+        }
+        return integer;
+    }
+    bool as_bool() const {
+        if (!is_bool()) {
+            throw std::bad_variant_access();
+        }
+        return kind() == Kind::True;
+    }
+    TapeArray as_array() const;
+    TapeObject as_object() const;
+
+private:
+    friend class TapeArray;
+    friend class TapeObject;
+    friend class TapeParser;
+
+    enum class Kind : uint32_t { Null, True, False, Number, String, Array, Object };
+
+    static constexpr uint32_t kKindBits = 3;
+    static constexpr uint32_t kMaxCount = std::numeric_limits<uint32_t>::max() >> kKindBits;
+
+    Kind kind() const { return static_cast<Kind>(tag_ & ((1u << kKindBits) - 1)); }
+    // Children of a container.
+    uint32_t count() const { return tag_ >> kKindBits; }
+    // The value after this one and its subtree.
+    const TapeValue *next() const { return this + 1 + (kind() >= Kind::Array ? size_ : 0); }
+    std::string_view token() const { return std::string_view(text_, size_); }
+
+    void require(Kind kind) const {
+        if (this->kind() != kind) {
+            throw std::bad_variant_access();
+        }
+    }
+
+    // Number token or string contents; unused for other kinds.
+    const char *text_ = nullptr;
+    // Token length, or for containers the number of tape entries in the
+    // subtree.
+    uint32_t size_ = 0;
+    // Kind in the low bits, child count above them.
+    uint32_t tag_ = 0;
+};
+
+struct TapeMember {
+    std::string_view key;
+    const TapeValue &value;
+};
+
+class TapeArray {
+public:
+    class iterator {
+    public:
+        explicit iterator(const TapeValue *item) : item_(item) {}
+
+        const TapeValue &operator*() const { return *item_; }
+        const TapeValue *operator->() const { return item_; }
+        iterator &operator++() {
+            item_ = item_->next();
+            return *this;
+        }
+        bool operator==(const iterator &other) const { return item_ == other.item_; }
+        bool operator!=(const iterator &other) const { return item_ != other.item_; }
+
+    private:
+        const TapeValue *item_;
+    };
+
+    explicit TapeArray(const TapeValue &array) : array_(&array) {}
+
+    iterator begin() const { return iterator(array_ + 1); }
+    iterator end() const { return iterator(array_->next()); }
+    size_t size() const { return array_->count(); }
+    bool empty() const { return size() == 0; }
+    const TapeValue &operator[](size_t index) const {
+        iterator it = begin();
+        while (index-- > 0) {
+            ++it;
+        }
+        return *it;
+    }
+
+private:
+    const TapeValue *array_;
+};
+
+class TapeObject {
+public:
+    // Members are a key entry followed by the value's entries.
+    class iterator {
+    public:
+        explicit iterator(const TapeValue *key) : key_(key) {}
+
+        TapeMember operator*() const { return TapeMember{key_->token(), key_[1]}; }
+        iterator &operator++() {
+            key_ = key_[1].next();
+            return *this;
+        }
+        bool operator==(const iterator &other) const { return key_ == other.key_; }
+        bool operator!=(const iterator &other) const { return key_ != other.key_; }
+
+    private:
+        const TapeValue *key_;
+    };
+
+    explicit TapeObject(const TapeValue &object) : object_(&object) {}
+
+    iterator begin() const { return iterator(object_ + 1); }
+    iterator end() const { return iterator(object_->next()); }
+    size_t size() const { return object_->count(); }
+    bool empty() const { return size() == 0; }
+
+    // Returns the first member named `key`, like FlatObject::find.
+    const TapeValue *find(std::string_view key) const {
+        for (TapeMember member : *this) {
+            if (member.key == key) {
+                return &member.value;
+            }
+        }
+        return nullptr;
+    }
+
+private:
+    const TapeValue *object_;
+};
+
+inline TapeArray TapeValue::as_array() const {
+    require(Kind::Array);
+    return TapeArray(*this);
+}
+
+inline TapeObject TapeValue::as_object() const {
+    require(Kind::Object);
+    return TapeObject(*this);
+}
+
+// Records the tape for a TapeDocument. Tokens are validated as the other
+// parsers do, but only escaped strings are decoded; a container's entry is
+// written when it opens and completed with its size when it closes.
+class TapeParser : private detail::Lexer {
+public:
+    TapeParser(std::string_view input, std::vector<TapeValue> &tape, std::pmr::memory_resource &arena)
+        : Lexer(input), tape_(tape), arena_(arena) {}
+
+    void parse() {
+        skip_whitespace();
+        parse_value();
+        skip_whitespace();
+        if (!eof()) {
+            throw ParseError("Unexpected characters after JSON value");
+        }
+    }
+
+private:
+    using Kind = TapeValue::Kind;
+
+    void parse_value() {
+        if (eof()) {
+            throw ParseError("Unexpected end of input");
+        }
+        char ch = peek();
+        switch (ch) {
+            case 'n':
+                expect("null");
+                push(Kind::Null);
+                return;
+            case 't':
+            case 'f':
+                push(parse_bool_literal() ? Kind::True : Kind::False);
+                return;
+            case '"':
+                parse_string();
+                return;
+            case '[':
+                parse_array();
+                return;
+            case '{':
+                parse_object();
+                return;
+            default:
+                if (ch == '-' || std::isdigit(static_cast<unsigned char>(ch))) {
+                    push(Kind::Number, scan_number());
+                    return;
+                }
+                throw ParseError("Invalid JSON value");
+        }
+    }
+
+    void parse_string() {
+        std::string_view text = read_string();
+        if (!text.empty() && text.data() == scratch_.data()) {
+            char *copy = static_cast<char *>(arena_.allocate(text.size(), 1));
+            std::copy(text.begin(), text.end(), copy);
+            text = std::string_view(copy, text.size());
+        }
+        push(Kind::String, text);
+    }
+
+    void parse_array() {
+        const Nested nested(*this);
+        expect('[');
+        size_t entry = open(Kind::Array);
+        uint32_t count = 0;
+        skip_whitespace();
+        if (peek() == ']') {
+            advance();
+        } else {
+            while (true) {
+                parse_value();
+                ++count;
+                skip_whitespace();
+                if (peek() == ',') {
+                    advance();
+                    skip_whitespace();
+                    continue;
+                }
+                if (peek() == ']') {
+                    advance();
+                    break;
+                }
+                throw ParseError("Expected ',' or ']' in array");
+            }
+        }
+        close(entry, count);
+    }
+
+    void parse_object() {
+        const Nested nested(*this);
+        expect('{');
+        size_t entry = open(Kind::Object);
+        uint32_t count = 0;
+        skip_whitespace();
+        if (peek() == '}') {
+            advance();
+        } else {
+            while (true) {
+                if (peek() != '"') {
+                    throw ParseError("Expected string key in object");
+                }
+                parse_string();
+                skip_whitespace();
+                expect(':');
+                skip_whitespace();
+                parse_value();
+                ++count;
+                skip_whitespace();
+                if (peek() == ',') {
+                    advance();
+                    skip_whitespace();
+                    continue;
+                }
+                if (peek() == '}') {
+                    advance();
+                    break;
+                }
+                throw ParseError("Expected ',' or '}' in object");
+            }
+        }
+        close(entry, count);
+    }
+
+    void push(Kind kind, std::string_view token = {}) {
+        if (token.size() > std::numeric_limits<uint32_t>::max()) {
+            throw ParseError("Token too long");
+        }
+        TapeValue &value = tape_.emplace_back();
+        value.text_ = token.data();
+        value.size_ = static_cast<uint32_t>(token.size());
+        value.tag_ = static_cast<uint32_t>(kind);
+    }
+
+    size_t open(Kind kind) {
+        push(kind);
+        return tape_.size() - 1;
+    }
+
+    void close(size_t entry, uint32_t count) {
+        size_t span = tape_.size() - entry - 1;
+        if (span > std::numeric_limits<uint32_t>::max() || count > TapeValue::kMaxCount) {
+            throw ParseError("Container too large");
+        }
+        TapeValue &value = tape_[entry];
+        value.size_ = static_cast<uint32_t>(span);
+        value.tag_ |= count << TapeValue::kKindBits;
+    }
+
+    std::vector<TapeValue> &tape_;
+    std::pmr::memory_resource &arena_;
+};
+
+// Owns the tape behind a tree of TapeValues. Like Document, the input
+// passed to the constructor must outlive it. Building one costs a fraction
+// of Document or parse(), which pays off when only some of the fields are
+// read; reading everything repeatedly is better served by Document.
+class TapeDocument {
+public:
+    // 1 MiB of 16-byte entries.
+    static constexpr size_t kInitialTapeEntries = size_t(1) << 16;
+
+    explicit TapeDocument(std::string_view input) {
+        // Compact feeds have a token every 8 bytes or so, but input with
+        // long strings has far fewer. The tape starts at half the compact
+        // density, at most kInitialTapeEntries, and grows only when the
+        // input needs it.
+        tape_.reserve(std::min(input.size() / 16 + 1, kInitialTapeEntries));
+        TapeParser parser(input, tape_, arena_);
+        parser.parse();
+    }
+
+    TapeDocument(const TapeDocument &) = delete;
+    TapeDocument &operator=(const TapeDocument &) = delete;
+
+    const TapeValue &root() const { return tape_.front(); }
+
+    // Tape entries, 16 bytes each.
+    size_t size() const { return tape_.size(); }
+
+private:
+    std::vector<TapeValue> tape_;
+    std::pmr::monotonic_buffer_resource arena_;
+};
+
+// Appends `value` to `out` as a JSON string literal. Quotes, backslashes
+// and control characters are escaped; other bytes, UTF-8 included, are
+// copied as they are.
+inline void append_string(std::string &out, std::string_view value) {
+    out += '"';
+    for (char ch : value) {
+        if (ch == '"' || ch == '\\') {
+            out += '\\';
+            out += ch;
+        } else if (static_cast<unsigned char>(ch) < 0x20) {
+            static constexpr char kHex[] = "0123456789abcdef";
+            out += "\\u00";
+            out += kHex[static_cast<unsigned char>(ch) >> 4];
+            out += kHex[static_cast<unsigned char>(ch) & 0xF];
+        } else {
+            out += ch;
+        }
+    }
+    out += '"';
+}
+
+// Appends the shortest representation of `value` that reads back the same,
+// or null for infinities and NaN, which JSON cannot express.
+inline void append_number(std::string &out, double value) {
+    char buffer[32];
+    auto [end, ec] = std::to_chars(buffer, buffer + sizeof(buffer), value);
+    if (!std::isfinite(value) || ec != std::errc()) {
+        out += "null";
+        return;
+    }
+    out.append(buffer, end);
+}
+
+inline JsonValue parse(std::string_view input) {
+    Parser parser(input);
+    return parser.parse();
+}
+
+template <typename Handler>
+void parse_sax(std::string_view input, Handler &handler, size_t max_depth = kMaxDepth) {
+    SaxParser<Handler> parser(input, handler, max_depth);
+    parser.parse();
+}
+
+inline const JsonValue *get(const JsonObject &object, std::string_view key) {
+    auto it = object.find(key);
+    if (it == object.end()) {
+        return nullptr;
+    }
+    return &it->second;
+}
+
+inline const JsonValue *get(const JsonArray &array, size_t index) {
+    if (index >= array.size()) {
+        return nullptr;
+    }
+    return &array[index];
+}
+
+inline const FlatValue *get(const FlatObject &object, std::string_view key) {
+    return object.find(key);
+}
+
+inline const FlatValue *get(const FlatArray &array, size_t index) {
+    if (index >= array.size()) {
+        return nullptr;
+    }
+    return &array[index];
+}
+
+inline const TapeValue *get(const TapeObject &object, std::string_view key) {
+    return object.find(key);
+}
+
+inline const TapeValue *get(const TapeArray &array, size_t index) {
+    if (index >= array.size()) {
+        return nullptr;
+    }
+    return &array[index];
+}
+
+} // namespace simplejson
@@ -0,0 +1,164 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <optional>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "aggregate_state.hpp"
+#include "archive.hpp"
+#include "record_batch.hpp"
+#include "spatial_index.hpp"
+
+namespace live {
+
+using columnar::RecordBatch;
+
+// What queries see: the events of the window and the aggregates as of one
+// publish. A snapshot never changes once published.
+struct Snapshot {
+    // The latest revision of every event whose time was inside the window,
+    // ordered by event time, so a query starting at some time begins with
+    // a binary search.
+    RecordBatch events;
+    // The events bucketed by coordinates, for area queries. Unset before
+    // the first publish, when there are no events.
+    std::optional<spatial::GridIndex> grid;
+    aggregate::State aggregates;
+    // When it was published, and the window's start then.
+    int64_t published_ms = 0;
+    int64_t from_ms = 0;
+
+    explicit Snapshot(aggregate::State state) : aggregates(std::move(state)) {}
+
+    // First row with an event time at or after `time_ms`.
+    size_t lower_bound(int64_t time_ms) const {
+        const std::vector<int64_t> &times = events.time_ms();
+        return static_cast<size_t>(std::lower_bound(times.begin(), times.end(), time_ms) - times.begin());
+    }
+};
+
+// The events of the last `span` of event time, kept in memory for the query
+// server. The pipeline thread add()s each batch of new or revised events
+// and publish()es once per cycle; publishing builds a new snapshot beside
+// the current one and swaps a pointer to it, read-copy-update style, so
+// readers on other threads never wait for the pipeline and the pipeline
+// never waits for them. A reader keeps the snapshot it loaded alive for as
+// long as it holds it.
+//
+// A publish costs a copy of the window and a grid index over it, which is
+// why batches are collected until the end of the cycle rather than
+// published one by one.
+class Window {
+public:
+    Window(std::chrono::milliseconds span, aggregate::State aggregates) : span_ms_(span.count()) {
+        current_ = std::make_shared<const Snapshot>(std::move(aggregates));
+    }
+
+    // Queues the rows of `batch`. Later rows replace earlier ones, and the
+    // rows already published, with the same id.
+    void add(const RecordBatch &batch) { pending_.append(batch); }
+
+    // Queues what the archive holds of the window ending at `now_ms`, to
+    // start from the events of earlier runs. Only rows whose event time is
+    // inside the window are read, so an event whose last revision moved it
+    // out keeps its earlier revision.
+    void load(const std::filesystem::path &directory, int64_t now_ms) {
+        if (!std::filesystem::exists(directory)) {
+            return;
+        }
+        archive::Query query;
+        query.from_ms = now_ms - span_ms_;
+        columnar::Row row;
+        archive::scan(directory, query, [&](const archive::Segment &segment, size_t index) {
+            segment.read(index, row);
+            pending_.append(row);
+        });
+    }
+
+    // Publishes the queued rows merged into the current snapshot, without
+    // the events that have left the window by `now_ms`, together with a
+    // copy of `aggregates`.
+    void publish(const aggregate::State &aggregates, int64_t now_ms) {
+        std::shared_ptr<const Snapshot> current = snapshot();
+        const RecordBatch &old = current->events;
+        const int64_t from_ms = now_ms - span_ms_;
+
+        // The last queued row of every id, whether or not it is still in
+        // the window, as it supersedes the published one either way.
+        std::unordered_map<std::string_view, size_t> latest;
+        std::vector<size_t> added;
+        for (size_t row = 0; row < pending_.size(); ++row) {
+            std::string_view id = pending_.ids()[row];
+            if (id.empty()) {
+                added.push_back(row);
+            } else {
+                latest[id] = row;
+            }
+        }
+        for (const auto &entry : latest) {
+            added.push_back(entry.second);
+        }
+        const std::vector<int64_t> &added_times = pending_.time_ms();
+        added.erase(std::remove_if(added.begin(), added.end(),
+                                   [&](size_t row) { return added_times[row] < from_ms; }),
+                    added.end());
+        std::sort(added.begin(), added.end(), [&](size_t a, size_t b) {
+            return added_times[a] != added_times[b] ? added_times[a] < added_times[b] : a < b;
+        });
+
+        auto next = std::make_shared<Snapshot>(aggregates);
+        next->published_ms = now_ms;
+        next->from_ms = from_ms;
+        RecordBatch &events = next->events;
+        events.reserve(old.size() + added.size(),
+                       old.ids().heap_size() + old.places().heap_size() + pending_.ids().heap_size() +
+                           pending_.places().heap_size());
+        // Both sides are in time order, so they merge in one pass.
+        const std::vector<int64_t> &old_times = old.time_ms();
+        size_t kept = current->lower_bound(from_ms);
+        auto superseded = [&](size_t row) {
+            std::string_view id = old.ids()[row];
+            return !id.empty() && latest.count(id) > 0;
+        };
+        for (size_t row : added) {
+            for (; kept < old.size() && old_times[kept] <= added_times[row]; ++kept) {
+                if (!superseded(kept)) {
+                    events.append(old, kept);
+                }
+            }
+            events.append(pending_, row);
+        }
+        for (; kept < old.size(); ++kept) {
+            if (!superseded(kept)) {
+                events.append(old, kept);
+            }
+        }
+
+        next->grid.emplace(events);
+
+        std::atomic_store(&current_, std::shared_ptr<const Snapshot>(std::move(next)));
+        // Released rather than cleared: after load() it can be large.
+        pending_ = RecordBatch();
+    }
+
+    // The last published snapshot. Safe to call from any thread.
+    std::shared_ptr<const Snapshot> snapshot() const { return std::atomic_load(&current_); }
+
+    std::chrono::milliseconds span() const { return std::chrono::milliseconds(span_ms_); }
+
+private:
+    int64_t span_ms_;
+    // Rows added since the last publish; only the pipeline thread uses it.
+    RecordBatch pending_;
+    std::shared_ptr<const Snapshot> current_;
+};
+
+} // namespace live
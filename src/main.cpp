@@ -1,315 +1,1413 @@
+#include "aggregate_state.hpp"
+#include "alerts.hpp"
+#include "allocation_hook.hpp"
+#include "archive.hpp"
+#include "async_writer.hpp"
+#include "binary_io.hpp"
+#include "event_index.hpp"
+#include "feed_client.hpp"
+#include "feed_records.hpp"
+#include "gzip.hpp"
 #include "json.hpp"
+#include "live_window.hpp"
+#include "metrics.hpp"
+#include "poll_schedule.hpp"
+#include "query_server.hpp"
+#include "record_batch.hpp"
+#include "reports.hpp"
+#include "rotation.hpp"
+#include "spatial_index.hpp"
+#include "thread_pool.hpp"
+#include "units.hpp"
 
 #include <curl/curl.h>
 
+#include <algorithm>
+#include <atomic>
+#include <charconv>
 #include <chrono>
-#include <ctime>
+#include <cmath>
+#include <condition_variable>
+#include <csignal>
+#include <deque>
 #include <filesystem>
+#include <exception>
 #include <fstream>
 #include <iomanip>
 #include <iostream>
 #include <limits>
+#include <memory>
+#include <mutex>
 #include <optional>
-#include <sstream>
 #include <stdexcept>
 #include <string>
+#include <string_view>
+#include <system_error>
+#include <thread>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
-using simplejson::JsonArray;
-using simplejson::JsonObject;
-using simplejson::JsonValue;
-
 namespace {
 
 constexpr const char *kFeedUrl = "https://earthquake.usgs.gov/earthquakes/feed/v1.0/summary/all_day.geojson";
 
-size_t write_callback(void *contents, size_t size, size_t nmemb, void *userp) {
-    size_t real_size = size * nmemb;
-    auto *buffer = static_cast<std::string *>(userp);
-    buffer->append(static_cast<char *>(contents), real_size);
-    return real_size;
-}
+using columnar::RecordBatch;
+using records::parse_records;
+using records::parse_records_parallel;
+using records::RecordExtractor;
+using reports::append_records_to_csv;
+using reports::parse_area;
+using reports::Region;
+using reports::report_bins;
+using reports::write_region_report;
+using reports::write_report;
+using reports::write_summary;
+using units::parse_count;
+using units::parse_duration;
+using units::parse_size;
+
+
+// Parses one feed on the thread pool while it downloads. The transfer
+// thread only copies chunks into a queue; a pool task drains the queue
+// through the feed's push parser, with at most one task per feed so chunks
+// are parsed in arrival order. Feeds are therefore parsed in parallel with
+// each other and with the network.
+//
+// A buffered job instead collects the whole body and parses it with
+// parse_records_parallel() once the transfer completed, which is faster for
+// single large documents such as backfill queries.
+//
+// `observer`, if set, sees each feature as soon as it is parsed. With
+// `batches`, the records are handed to it every `batch_rows` records
+// instead of collected, and each chunk is parsed on the transfer thread as
+// it arrives, so that neither records nor chunks pile up. Both must outlive
+// the job.
+class FeedParseJob {
+public:
+    FeedParseJob(concurrency::ThreadPool &pool, bool buffered, const records::Limits &limits,
+                 const records::RowObserver *observer = nullptr, size_t batch_rows = 0,
+                 const records::BatchSink *batches = nullptr)
+        : pool_(pool), buffered_(buffered), limits_(limits), observer_(observer), extractor_(records_),
+          parser_(extractor_, limits.max_depth) {
+        extractor_.observe(observer);
+        extractor_.limit_features(limits.max_features);
+        if (batches) {
+            batches_ = [this, batches](RecordBatch &batch) {
+                streamed_ += batch.size();
+                (*batches)(batch);
+            };
+            extractor_.stream_batches(batch_rows, &batches_);
+        }
+    }
+
+    FeedParseJob(const FeedParseJob &) = delete;
+    FeedParseJob &operator=(const FeedParseJob &) = delete;
+
+    ~FeedParseJob() {
+        wait();
+    }
+
+    // Queues a chunk from the transfer thread. Throws the feed's parse
+    // error once one occurred, which aborts the transfer.
+    void push(std::string_view chunk) {
+        if (buffered_) {
+            body_.append(chunk);
+            return;
+        }
+        if (batches_) {
+            // Includes the time the batches completed by the chunk take.
+            auto start = std::chrono::steady_clock::now();
+            parser_.feed(chunk);
+            parse_seconds_ += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            return;
+        }
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (error_) {
+            std::rethrow_exception(error_);
+        }
+        pending_.emplace_back(chunk);
+        if (!scheduled_) {
+            scheduled_ = true;
+            pool_.submit([this] { drain(); });
+        }
+    }
 
-std::string fetch_feed(const std::string &url) {
-    CURL *curl = curl_easy_init();
-    if (!curl) {
-        throw std::runtime_error("Failed to initialize CURL");
+    // Time spent parsing, once the queued chunks are done.
+    double parse_seconds() {
+        wait();
+        return parse_seconds_;
     }
 
-    std::string response;
-    curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
-    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_callback);
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response);
-    curl_easy_setopt(curl, CURLOPT_USERAGENT, "earthquake-data-pipeline/1.0");
-    curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+    // Blocks until every queued chunk has been parsed.
+    void wait() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        idle_.wait(lock, [this] { return !scheduled_; });
+    }
 
-    CURLcode result = curl_easy_perform(curl);
-    if (result != CURLE_OK) {
-        std::string message = std::string("Failed to fetch feed: ") + curl_easy_strerror(result);
-        curl_easy_cleanup(curl);
-        throw std::runtime_error(message);
+    // Completes parsing after a successful transfer and hands over the
+    // extracted records.
+    RecordBatch finish() {
+        if (buffered_) {
+            auto start = std::chrono::steady_clock::now();
+            RecordBatch records = parse_records_parallel(body_, pool_, observer_, limits_);
+            parse_seconds_ += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            return records;
+        }
+        wait();
+        if (error_) {
+            std::rethrow_exception(error_);
+        }
+        parser_.finish();
+        extractor_.finish();
+        return std::move(records_);
     }
 
-    long response_code = 0;
-    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &response_code);
-    curl_easy_cleanup(curl);
+    // The feed's metadata, once finish() returned. Buffered jobs only
+    // delimit the features and leave it empty.
+    const records::FeedMetadata &metadata() const { return extractor_.metadata(); }
 
-    if (response_code >= 400) {
-        std::ostringstream oss;
-        oss << "HTTP error " << response_code;
-        throw std::runtime_error(oss.str());
+    // Records handed to the batch sink so far.
+    size_t streamed() const { return streamed_; }
+
+private:
+    void drain() {
+        while (true) {
+            std::string chunk;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                if (pending_.empty() || error_) {
+                    pending_.clear();
+                    scheduled_ = false;
+                    idle_.notify_all();
+                    return;
+                }
+                chunk = std::move(pending_.front());
+                pending_.pop_front();
+            }
+            try {
+                auto start = std::chrono::steady_clock::now();
+                parser_.feed(chunk);
+                parse_seconds_ += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(mutex_);
+                error_ = std::current_exception();
+            }
+        }
     }
 
-    return response;
+    concurrency::ThreadPool &pool_;
+    bool buffered_;
+    records::Limits limits_;
+    const records::RowObserver *observer_;
+    records::BatchSink batches_;
+    size_t streamed_ = 0;
+    std::string body_;
+    RecordBatch records_;
+    RecordExtractor extractor_;
+    simplejson::PushParser<RecordExtractor> parser_;
+
+    std::mutex mutex_;
+    std::condition_variable idle_;
+    std::deque<std::string> pending_;
+    bool scheduled_ = false;
+    std::exception_ptr error_;
+    // Only the draining task, or finish(), updates it.
+    double parse_seconds_ = 0.0;
+};
+
+// Where progress messages go: standard output, unless alerts go there
+// (--alert-sink -), in which case it carries nothing else and progress goes
+// to standard error.
+std::ostream *g_progress = &std::cout;
+
+std::ostream &progress() {
+    return *g_progress;
+}
+
+void report_transfer(const std::string &url, const feed::FetchResult &transfer) {
+    progress() << "Fetched " << url << ": " << transfer.wire_bytes << " bytes transferred (" << transfer.decoded_bytes
+              << " decoded";
+    if (transfer.wire_bytes > 0 && transfer.decoded_bytes > transfer.wire_bytes) {
+        progress() << ", " << std::fixed << std::setprecision(1)
+                  << static_cast<double>(transfer.decoded_bytes) / static_cast<double>(transfer.wire_bytes)
+                  << ":1 compression" << std::defaultfloat;
+    }
+    progress() << ")." << std::endl;
 }
 
-struct Record {
-    std::string time_iso;
-    std::optional<double> magnitude;
-    std::string place;
-    std::optional<double> longitude;
-    std::optional<double> latitude;
-    std::optional<double> depth_km;
+
+class CurlGlobal {
+public:
+    CurlGlobal() {
+        CURLcode code = curl_global_init(CURL_GLOBAL_DEFAULT);
+        if (code != CURLE_OK) {
+            throw std::runtime_error("Failed to initialize CURL globals");
+        }
+    }
+
+    ~CurlGlobal() {
+        curl_global_cleanup();
+    }
 };
 
-std::string iso8601_from_millis(int64_t millis_since_epoch) {
-    using namespace std::chrono;
-    system_clock::time_point tp = system_clock::time_point(milliseconds(millis_since_epoch));
-    std::time_t tt = system_clock::to_time_t(tp);
-    std::tm tm{};
-#if defined(_WIN32)
-    gmtime_s(&tm, &tt);
-#else
-    if (!gmtime_r(&tt, &tm)) {
-        throw std::runtime_error("Failed to convert timestamp to UTC");
-    }
-#endif
-    auto ms = duration_cast<milliseconds>(tp.time_since_epoch()).count() % 1000;
-    std::ostringstream oss;
-    oss << std::put_time(&tm, "%Y-%m-%dT%H:%M:%S");
-    oss << '.' << std::setw(3) << std::setfill('0') << ms << 'Z';
-    return oss.str();
+std::atomic<bool> g_shutdown_requested{false};
+
+extern "C" void request_shutdown(int) {
+    g_shutdown_requested.store(true);
 }
 
-std::optional<double> to_number(const JsonValue *value) {
-    if (!value) {
-        return std::nullopt;
+struct Options {
+    // Feed URLs fetched each cycle.
+    std::vector<std::string> feeds;
+    // Unset for a single run.
+    std::optional<std::chrono::seconds> poll_interval;
+    // Fetch each feed after its learned regeneration time, waiting at most
+    // poll_interval.
+    bool adaptive_poll = false;
+    // Events older than this are forgotten by the deduplication index.
+    std::chrono::seconds retention = std::chrono::hours(24 * 30);
+    // Parse each feed after downloading it, on all cores.
+    bool parallel_parse = false;
+    // Saved feed documents (files or directories) replayed instead of
+    // fetching.
+    std::vector<std::string> inputs;
+    // Areas that get a report of their own.
+    std::vector<Region> regions;
+    // Where each cycle's stage timings go; unset to not record them.
+    std::optional<std::string> metrics_path;
+    // When earthquakes.csv is closed and compressed.
+    rotation::Policy rotation;
+    // Fetched events that raise an alert as soon as they are parsed: those
+    // matching any rule.
+    std::vector<alerts::Rule> alert_rules;
+    std::string alert_sink = "-";
+    // What one feed document or input file may hold.
+    records::Limits limits;
+    // Set for bounded memory mode: records are then streamed through the
+    // pipeline in batches of this many instead of held per feed.
+    std::optional<size_t> batch_records;
+    // Where the query server listens, if at all, and how much event time it
+    // keeps in memory.
+    std::optional<std::string> serve_address;
+    std::chrono::seconds serve_window = std::chrono::hours(24 * 7);
+};
+
+// Accepts <name>=<area> as parse_area() does. The name becomes a file name,
+// so it is limited to letters, digits, '-' and '_'.
+Region parse_region(std::string_view text) {
+    size_t equals = text.find('=');
+    std::string name(text.substr(0, equals == std::string_view::npos ? 0 : equals));
+    bool valid_name = !name.empty() && std::all_of(name.begin(), name.end(), [](char ch) {
+        return (ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z') || (ch >= '0' && ch <= '9') || ch == '-' ||
+               ch == '_';
+    });
+    std::optional<Region> region = valid_name ? parse_area(text.substr(equals + 1)) : std::nullopt;
+    if (!region) {
+        throw std::invalid_argument("Invalid region: " + std::string(text));
     }
-    if (value->is_null()) {
-        return std::nullopt;
+    region->name = std::move(name);
+    return *region;
+}
+
+// Accepts conditions joined by '+', all of which an event must meet:
+// mag:<magnitude> for at least that magnitude, area:<area> as parse_area()
+// accepts, and tsunami for events flagged as possibly causing one.
+alerts::Rule parse_alert_rule(std::string_view text) {
+    alerts::Rule rule;
+    const std::string_view spec = text;
+    bool valid = !text.empty();
+    while (valid) {
+        size_t plus = text.find('+');
+        std::string_view condition = text.substr(0, plus);
+        if (condition.compare(0, 4, "mag:") == 0) {
+            std::string_view value = condition.substr(4);
+            double magnitude = 0.0;
+            auto [end, ec] = std::from_chars(value.data(), value.data() + value.size(), magnitude);
+            valid = !value.empty() && ec == std::errc() && end == value.data() + value.size() &&
+                    std::isfinite(magnitude) && !rule.min_magnitude;
+            rule.min_magnitude = magnitude;
+        } else if (condition.compare(0, 5, "area:") == 0) {
+            valid = !rule.area;
+            rule.area = parse_area(condition.substr(5));
+            valid = valid && rule.area;
+        } else {
+            valid = condition == "tsunami" && !rule.tsunami;
+            rule.tsunami = true;
+        }
+        if (plus == std::string_view::npos) {
+            break;
+        }
+        text.remove_prefix(plus + 1);
     }
-    if (value->is_number()) {
-        return value->as_number();
+    if (!valid) {
+        throw std::invalid_argument("Invalid alert: " + std::string(spec));
     }
-    return std::nullopt;
+    return rule;
 }
 
-std::optional<std::string> to_string(const JsonValue *value) {
-    if (!value) {
-        return std::nullopt;
+Options parse_options(int argc, char **argv) {
+    Options options;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--poll" && i + 1 < argc) {
+            options.poll_interval = parse_duration(argv[++i], arg);
+        } else if (arg == "--feed" && i + 1 < argc) {
+            options.feeds.emplace_back(argv[++i]);
+        } else if (arg == "--adaptive-poll") {
+            options.adaptive_poll = true;
+        } else if (arg == "--parallel-parse") {
+            options.parallel_parse = true;
+        } else if (arg == "--retention" && i + 1 < argc) {
+            options.retention = parse_duration(argv[++i], arg);
+        } else if (arg == "--metrics" && i + 1 < argc) {
+            options.metrics_path = argv[++i];
+        } else if (arg == "--region" && i + 1 < argc) {
+            options.regions.push_back(parse_region(argv[++i]));
+        } else if (arg == "--rotate" && i + 1 < argc) {
+            std::string_view value = argv[++i];
+            if (value == "daily") {
+                options.rotation.daily = true;
+            } else {
+                options.rotation.max_bytes = parse_size(value, arg);
+            }
+        } else if (arg == "--alert" && i + 1 < argc) {
+            options.alert_rules.push_back(parse_alert_rule(argv[++i]));
+        } else if (arg == "--alert-sink" && i + 1 < argc) {
+            options.alert_sink = argv[++i];
+        } else if (arg == "--max-payload" && i + 1 < argc) {
+            options.limits.max_bytes = parse_size(argv[++i], arg);
+        } else if (arg == "--max-depth" && i + 1 < argc) {
+            options.limits.max_depth = parse_count(argv[++i], arg);
+            if (options.limits.max_depth < records::Limits::kMinDepth) {
+                throw std::invalid_argument("--max-depth must be at least " +
+                                            std::to_string(records::Limits::kMinDepth));
+            }
+        } else if (arg == "--max-features" && i + 1 < argc) {
+            options.limits.max_features = parse_count(argv[++i], arg);
+        } else if (arg == "--bounded-memory" && i + 1 < argc) {
+            options.batch_records = parse_count(argv[++i], arg);
+        } else if (arg == "--serve" && i + 1 < argc) {
+            options.serve_address = argv[++i];
+        } else if (arg == "--serve-window" && i + 1 < argc) {
+            options.serve_window = parse_duration(argv[++i], arg);
+        } else if (arg == "--input" && i + 1 < argc) {
+            options.inputs.emplace_back(argv[++i]);
+        } else {
+            throw std::invalid_argument("Unknown argument: " + arg);
+        }
     }
-    if (value->is_null()) {
-        return std::nullopt;
+    if (options.adaptive_poll && !options.poll_interval) {
+        throw std::invalid_argument("--adaptive-poll requires --poll");
     }
-    if (value->is_string()) {
-        return value->as_string();
+    if (options.serve_address && !options.poll_interval) {
+        throw std::invalid_argument("--serve requires --poll");
     }
-    return std::nullopt;
+    if (options.batch_records && options.parallel_parse) {
+        throw std::invalid_argument("--parallel-parse cannot be combined with --bounded-memory");
+    }
+    if (!options.inputs.empty()) {
+        if (!options.feeds.empty() || options.poll_interval || !options.alert_rules.empty()) {
+            throw std::invalid_argument("--input cannot be combined with --feed, --poll or --alert");
+        }
+        return options;
+    }
+    if (options.feeds.empty()) {
+        options.feeds.emplace_back(kFeedUrl);
+    }
+    return options;
 }
 
-std::vector<Record> parse_records(const std::string &payload) {
-    JsonValue root = simplejson::parse(payload);
-    if (!root.is_object()) {
-        throw std::runtime_error("Unexpected JSON root type");
+int64_t now_millis() {
+    using namespace std::chrono;
+    return duration_cast<milliseconds>(system_clock::now().time_since_epoch()).count();
+}
+
+// Merges the records of several feeds, keeping one record per event id (the
+// latest revision). Feeds such as all_hour and all_day overlap, so the same
+// event routinely arrives more than once per cycle. Records without an id
+// are kept as they are.
+RecordBatch merge_feeds(const std::vector<RecordBatch> &feeds) {
+    // Pick the winning (feed, row) for each id first, then copy the rows
+    // once, in order of first appearance.
+    struct Source {
+        const RecordBatch *batch;
+        size_t row;
+    };
+    std::vector<Source> chosen;
+    std::unordered_map<std::string_view, size_t> position_by_id;
+    for (const RecordBatch &records : feeds) {
+        for (size_t row = 0; row < records.size(); ++row) {
+            std::string_view id = records.ids()[row];
+            if (id.empty()) {
+                chosen.push_back({&records, row});
+                continue;
+            }
+            auto [it, inserted] = position_by_id.emplace(id, chosen.size());
+            if (inserted) {
+                chosen.push_back({&records, row});
+            } else {
+                Source &current = chosen[it->second];
+                if (records.updated_ms()[row] > current.batch->updated_ms()[current.row]) {
+                    current = {&records, row};
+                }
+            }
+        }
     }
 
-    const JsonObject &root_obj = root.as_object();
-    const JsonValue *features_value = simplejson::get(root_obj, "features");
-    if (!features_value || !features_value->is_array()) {
-        throw std::runtime_error("Missing features array");
+    RecordBatch merged;
+    merged.reserve(chosen.size());
+    for (const Source &source : chosen) {
+        merged.append(*source.batch, source.row);
     }
+    return merged;
+}
 
-    const JsonArray &features = features_value->as_array();
-    std::vector<Record> records;
-    records.reserve(features.size());
+// Returns the records that have not been written before, or whose feed
+// revision is newer than the one written. Records without an id cannot be
+// tracked and are always kept.
+RecordBatch select_unseen(const RecordBatch &records, const dedup::EventIndex &index) {
+    RecordBatch unseen;
+    for (size_t row = 0; row < records.size(); ++row) {
+        std::string_view id = records.ids()[row];
+        if (id.empty() || index.is_new_or_revised(id, records.updated_ms()[row])) {
+            unseen.append(records, row);
+        }
+    }
+    return unseen;
+}
 
-    for (const JsonValue &feature_value : features) {
-        if (!feature_value.is_object()) {
-            continue;
+void report_feed_error(const std::string &url, const std::exception &ex, const char *action = "fetching") {
+    if (dynamic_cast<const simplejson::ParseError *>(&ex)) {
+        std::cerr << "JSON parse error in " << url << ": " << ex.what() << std::endl;
+    } else {
+        std::cerr << "Error " << action << " " << url << ": " << ex.what() << std::endl;
+    }
+}
+
+// The snapshot files named by --input: files as given, directories
+// searched recursively for .json and .geojson files, each in path order.
+std::vector<std::filesystem::path> list_inputs(const std::vector<std::string> &inputs) {
+    std::vector<std::filesystem::path> files;
+    for (const std::string &input : inputs) {
+        std::filesystem::path path(input);
+        if (std::filesystem::is_directory(path)) {
+            std::vector<std::filesystem::path> found;
+            for (const auto &entry : std::filesystem::recursive_directory_iterator(path)) {
+                std::filesystem::path extension = entry.path().extension();
+                if (entry.is_regular_file() && (extension == ".json" || extension == ".geojson")) {
+                    found.push_back(entry.path());
+                }
+            }
+            std::sort(found.begin(), found.end());
+            files.insert(files.end(), found.begin(), found.end());
+        } else if (std::filesystem::exists(path)) {
+            files.push_back(path);
+        } else {
+            throw std::runtime_error("No such input: " + input);
         }
-        const JsonObject &feature_obj = feature_value.as_object();
+    }
+    return files;
+}
 
-        const JsonValue *properties_value = simplejson::get(feature_obj, "properties");
-        const JsonValue *geometry_value = simplejson::get(feature_obj, "geometry");
-        if (!properties_value || !properties_value->is_object()) {
-            continue;
+// Replay batches are cut at this many bytes of input, bounding the records
+// held at once; each batch is deduplicated and written like one fetch.
+constexpr std::uintmax_t kReplayBatchBytes = 64 << 20;
+// Files at least this large are parsed with every worker instead of one.
+constexpr std::uintmax_t kReplayParallelBytes = 16 << 20;
+// In bounded memory mode files are read, rather than mapped, in chunks of
+// this size.
+constexpr size_t kReplayChunkBytes = 1 << 20;
+
+// Cycles whose outputs may wait for the writer thread before the next one
+// blocks: one being written and one queued behind it.
+constexpr size_t kWriteQueueCapacity = 2;
+
+// Closed earthquakes.csv segments waiting for compression.
+constexpr size_t kCompressQueueCapacity = 8;
+
+constexpr const char *kEventsCsv = "data/earthquakes.csv";
+
+// Everything one cycle writes, prepared on the main thread and written on
+// the writer thread.
+struct WriteJob {
+    // The cycle's records, for report.csv and the regional reports.
+    RecordBatch records;
+    // The new or revised ones, for earthquakes.csv and the archive.
+    RecordBatch unseen;
+    aggregate::State aggregates;
+    // events.idx as EventIndex::encode() produced it.
+    std::string index;
+    int64_t now_ms;
+    // False for a bounded memory mode batch that did not end its document
+    // (see Pipeline::process_batch): only its rows are written, as the
+    // files rewritten whole come with the job that does, and index is
+    // empty.
+    bool checkpoint = true;
+};
+
+// State that outlives a single cycle: the feed connections, the index of
+// events already written to earthquakes.csv and the aggregates behind the
+// reports.
+//
+// Outputs are written on a writer thread, so the disk and the network
+// overlap: while one cycle's rows are appended and its reports rewritten,
+// the next cycle can already fetch and parse. Deduplication must not wait
+// for that, so the index and aggregates in memory are updated as soon as a
+// cycle is handed to the writer. If a write then fails, the state in memory
+// is ahead of the files; the next cycle goes back to the files and writes
+// the lost events again from the feeds' last parses.
+class Pipeline {
+public:
+    explicit Pipeline(const Options &options)
+        : options_(options),
+          index_(dedup::EventIndex::load("data/events.idx")),
+          aggregates_(aggregate::State::load("data/aggregates.bin", report_bins().edges())),
+          written_aggregates_(aggregates_) {
+        if (!options.alert_rules.empty()) {
+            alerter_ = std::make_unique<alerts::Alerter>(options.alert_rules, options.alert_sink, index_);
         }
-        if (!geometry_value || !geometry_value->is_object()) {
-            continue;
+        if (options.serve_address) {
+            window_ = std::make_unique<live::Window>(options.serve_window, aggregates_);
+            const int64_t now_ms = now_millis();
+            window_->load("data/archive", now_ms);
+            window_->publish(aggregates_, now_ms);
+            server_ = std::make_unique<query::Server>(*options.serve_address, *window_);
+            progress() << "Serving queries on " << *options.serve_address << " from "
+                      << window_->snapshot()->events.size() << " archived events." << std::endl;
+        }
+        schedule::Settings settings;
+        if (options.poll_interval) {
+            settings.max_interval = *options.poll_interval;
+            settings.min_interval = std::min(settings.min_interval, settings.max_interval);
+        }
+        for (const std::string &url : options.feeds) {
+            clients_.push_back(std::make_unique<feed::FeedClient>(url));
+            clients_.back()->set_max_bytes(options.limits.max_bytes);
+            schedules_.emplace_back(settings);
+        }
+        latest_.resize(clients_.size());
+        for (std::filesystem::path &segment : rotation::uncompressed_segments(kEventsCsv)) {
+            compressor_.submit(std::move(segment));
         }
+    }
 
-        const JsonObject &properties = properties_value->as_object();
-        const JsonObject &geometry = geometry_value->as_object();
+    void set_cancel_flag(const std::atomic<bool> *flag) {
+        for (auto &client : clients_) {
+            client->set_cancel_flag(flag);
+        }
+    }
 
-        const JsonValue *time_value = simplejson::get(properties, "time");
-        if (!time_value || !time_value->is_number()) {
-            continue;
+    // One fetch -> parse -> append -> report pass over every feed. Feeds
+    // download concurrently and parse on the pool as their data arrives;
+    // the merged records (unchanged feeds contribute their last parse) then
+    // go through deduplication. Only new or revised events are appended.
+    // A failing feed does not stop the others but fails the cycle once they
+    // are done.
+    //
+    // With `wait_for_writes` the cycle's outputs are on disk when it
+    // returns, and a failed write fails the cycle. Otherwise they may still
+    // be queued, and a failed write is reported and redone by a later cycle.
+    //
+    // In bounded memory mode the records instead go through deduplication
+    // in batches while the feeds are parsed, and the cycle always waits for
+    // its writes: no parse is kept to write lost events again from, so a
+    // feed only counts as consumed once its rows are on disk. The reports
+    // then cover the last batch, as in a replay.
+    void run_cycle(bool wait_for_writes) {
+        metrics::Cycle cycle(now_millis());
+        const schedule::Clock::time_point started = schedule::Clock::now();
+        const bool bounded = options_.batch_records.has_value();
+        const records::BatchSink batches = [&](RecordBatch &batch) { process_batch(batch, cycle); };
+        // Indices into clients_ of the feeds fetched this cycle.
+        std::vector<size_t> feeds;
+        std::vector<feed::FeedClient *> clients;
+        // Declared before the jobs, which point into it; sized up front so
+        // that it does not move.
+        std::vector<records::RowObserver> observers;
+        observers.reserve(clients_.size());
+        std::vector<std::unique_ptr<FeedParseJob>> jobs;
+        std::vector<feed::ChunkSink> sinks;
+        for (size_t i = 0; i < clients_.size(); ++i) {
+            if (options_.adaptive_poll && !schedules_[i].due(started)) {
+                continue;
+            }
+            feeds.push_back(i);
+            clients.push_back(clients_[i].get());
+            const records::RowObserver *observer = nullptr;
+            if (alerter_) {
+                observers.emplace_back([this, url = &clients_[i]->url(), started](const columnar::Row &row) {
+                    alerter_->consider(row, *url, started);
+                });
+                observer = &observers.back();
+            }
+            jobs.push_back(std::make_unique<FeedParseJob>(pool_, options_.parallel_parse, options_.limits, observer,
+                                                          options_.batch_records.value_or(0),
+                                                          bounded ? &batches : nullptr));
+            sinks.emplace_back([job = jobs.back().get()](std::string_view chunk) { job->push(chunk); });
         }
 
-        Record record;
-        int64_t millis = static_cast<int64_t>(time_value->as_number());
-        record.time_iso = iso8601_from_millis(millis);
+        std::vector<feed::FetchOutcome> outcomes;
+        {
+            // Streamed parsing runs on the pool during the transfers, so
+            // this covers most of the parse as well.
+            metrics::Cycle::Timer timer = cycle.stage("fetch");
+            outcomes = fetcher_.fetch_all(clients, sinks);
+            uint64_t bytes = 0;
+            for (const feed::FetchOutcome &outcome : outcomes) {
+                bytes += static_cast<uint64_t>(outcome.transfer.decoded_bytes);
+            }
+            timer.set_bytes(bytes);
+        }
 
-        record.magnitude = to_number(simplejson::get(properties, "mag"));
-        record.place = to_string(simplejson::get(properties, "place")).value_or("");
+        std::vector<std::pair<feed::FeedClient *, feed::FetchResult>> changed;
+        size_t failed = 0;
+        {
+            metrics::Cycle::Timer timer = cycle.stage("parse_finish");
+            const schedule::Clock::time_point fetched = schedule::Clock::now();
+            const int64_t fetched_ms = now_millis();
+            for (size_t i = 0; i < clients.size(); ++i) {
+                const std::string &url = clients[i]->url();
+                schedule::FeedSchedule &feed_schedule = schedules_[feeds[i]];
+                metrics::Source source = feed_source(url, outcomes[i]);
+                try {
+                    if (outcomes[i].error) {
+                        std::rethrow_exception(outcomes[i].error);
+                    }
+                    const feed::FetchResult &transfer = outcomes[i].transfer;
+                    if (transfer.not_modified) {
+                        progress() << "Feed " << url << " not modified." << std::endl;
+                        feed_schedule.not_modified(fetched);
+                        add_feed_source(cycle, std::move(source), feed_schedule);
+                        continue;
+                    }
+                    if (bounded) {
+                        jobs[i]->finish();
+                        source.records = jobs[i]->streamed();
+                    } else {
+                        latest_[feeds[i]] = jobs[i]->finish();
+                        source.records = latest_[feeds[i]].size();
+                    }
+                    changed.emplace_back(clients[i], transfer);
+                    report_transfer(url, transfer);
+                    std::optional<int64_t> generated_ms = jobs[i]->metadata().generated_ms;
+                    if (!generated_ms) {
+                        generated_ms = schedule::parse_http_date(transfer.last_modified);
+                    }
+                    if (generated_ms) {
+                        source.staleness_seconds = static_cast<double>(fetched_ms - *generated_ms) / 1e3;
+                    }
+                    feed_schedule.modified(fetched, fetched_ms, generated_ms);
+                } catch (const std::exception &ex) {
+                    ++failed;
+                    source.failed = true;
+                    report_feed_error(url, ex);
+                    feed_schedule.failed(fetched);
+                }
+                source.parse_seconds = jobs[i]->parse_seconds();
+                add_feed_source(cycle, std::move(source), feed_schedule);
+            }
+        }
 
-        const JsonValue *coordinates_value = simplejson::get(geometry, "coordinates");
-        if (coordinates_value && coordinates_value->is_array()) {
-            const JsonArray &coordinates = coordinates_value->as_array();
-            record.longitude = to_number(simplejson::get(coordinates, 0));
-            record.latitude = to_number(simplejson::get(coordinates, 1));
-            record.depth_km = to_number(simplejson::get(coordinates, 2));
+        std::exception_ptr write_error;
+        if (bounded) {
+            // The feeds of a cycle count as one document.
+            end_document(cycle);
+            write_error = writer_.drain();
+            if (write_error) {
+                restore_written_state();
+            } else {
+                for (auto &[client, transfer] : changed) {
+                    client->commit(transfer);
+                }
+            }
+            if (changed.empty() && failed == 0) {
+                progress() << "No feed has changed; nothing to do." << std::endl;
+            }
+        } else {
+            bool recovered = recover_from_write_failure();
+            if (!changed.empty() || recovered) {
+                RecordBatch merged;
+                {
+                    metrics::Cycle::Timer timer = cycle.stage("merge");
+                    merged = merge_feeds(latest_);
+                    timer.set_records(merged.size());
+                }
+                process(std::move(merged), cycle, false);
+                for (auto &[client, transfer] : changed) {
+                    client->commit(transfer);
+                }
+            } else if (failed == 0) {
+                progress() << "No feed has changed; nothing to do." << std::endl;
+            }
+            if (wait_for_writes) {
+                write_error = writer_.drain();
+            }
+        }
+        if (window_) {
+            metrics::Cycle::Timer timer = cycle.stage("window");
+            window_->publish(aggregates_, now_millis());
+            timer.set_records(window_->snapshot()->events.size());
+        }
+        emit_metrics(cycle);
+        if (write_error) {
+            std::rethrow_exception(write_error);
+        }
+        if (failed > 0) {
+            throw std::runtime_error(std::to_string(failed) + " of " + std::to_string(clients.size()) +
+                                     " feeds failed");
+        }
+    }
+
+    // Runs saved feed documents through the same deduplicate -> append ->
+    // report steps as fetched ones. Files are mapped and parsed in place,
+    // several at a time on the pool, in batches of about kReplayBatchBytes;
+    // within a batch the latest revision of each event wins, as with
+    // overlapping feeds. A file that fails to read or parse is reported and
+    // skipped, and fails the replay once the others are done. A batch is
+    // parsed while the one before it is written; a failed write stops the
+    // replay, as the files of the batches behind it were already consumed.
+    //
+    // In bounded memory mode files are instead read one at a time in
+    // chunks through the push parser, and their records processed in
+    // batches as they are parsed. A file that fails part-way keeps the
+    // batches already written.
+    void replay(const std::vector<std::filesystem::path> &files) {
+        if (options_.batch_records) {
+            replay_streaming(files);
+            return;
+        }
+        size_t failed = 0;
+        for (size_t first = 0; first < files.size();) {
+            if (writer_.failed()) {
+                writer_.flush();
+            }
+            metrics::Cycle cycle(now_millis());
+            std::optional<metrics::Cycle::Timer> timer(std::in_place, cycle, "read_parse");
+            std::vector<std::uintmax_t> sizes;
+            std::uintmax_t batch_bytes = 0;
+            size_t last = first;
+            while (last < files.size() && (last == first || batch_bytes < kReplayBatchBytes)) {
+                std::error_code error;
+                std::uintmax_t size = std::filesystem::file_size(files[last], error);
+                sizes.push_back(error ? 0 : size);
+                batch_bytes += sizes.back();
+                ++last;
+            }
+
+            const size_t count = last - first;
+            std::vector<RecordBatch> parsed(count);
+            std::vector<std::exception_ptr> errors(count);
+            auto parse_file = [&](size_t i, bool parallel) {
+                try {
+                    check_input_size(files[first + i], sizes[i]);
+                    binary::MappedFile file(files[first + i]);
+                    file.advise_sequential();
+                    parsed[i] = parallel ? parse_records_parallel(file.view(), pool_, nullptr, options_.limits)
+                                         : parse_records(file.view(), options_.limits);
+                } catch (...) {
+                    errors[i] = std::current_exception();
+                }
+            };
+            pool_.parallel_for(count, [&](size_t i) {
+                if (sizes[i] < kReplayParallelBytes) {
+                    parse_file(i, false);
+                }
+            });
+            for (size_t i = 0; i < count; ++i) {
+                if (sizes[i] >= kReplayParallelBytes) {
+                    parse_file(i, true);
+                }
+            }
+
+            uint64_t parsed_records = 0;
+            for (size_t i = 0; i < count; ++i) {
+                parsed_records += parsed[i].size();
+                if (errors[i]) {
+                    ++failed;
+                    try {
+                        std::rethrow_exception(errors[i]);
+                    } catch (const std::exception &ex) {
+                        report_feed_error(files[first + i].string(), ex, "reading");
+                    }
+                    metrics::Source source;
+                    source.name = files[first + i].string();
+                    source.failed = true;
+                    cycle.add_source(std::move(source));
+                }
+            }
+            timer->set_bytes(batch_bytes);
+            timer->set_records(parsed_records);
+            timer.reset();
+
+            RecordBatch merged;
+            {
+                metrics::Cycle::Timer merge_timer = cycle.stage("merge");
+                merged = merge_feeds(parsed);
+                merge_timer.set_records(merged.size());
+            }
+            process(std::move(merged), cycle, false);
+            emit_metrics(cycle);
+            first = last;
         }
+        writer_.flush();
 
-        records.push_back(std::move(record));
+        progress() << "Replayed " << files.size() << " input files." << std::endl;
+        if (failed > 0) {
+            throw std::runtime_error(std::to_string(failed) + " of " + std::to_string(files.size()) +
+                                     " input files failed");
+        }
     }
 
-    return records;
-}
+    // Waits for the queued writes; throws if one failed.
+    void finish_writes() { writer_.flush(); }
 
-std::string escape_csv(const std::string &value) {
-    bool needs_quotes = value.find_first_of(",\"\n") != std::string::npos;
-    if (!needs_quotes) {
-        return value;
+    // Prints the process's peak resident set size.
+    static void report_peak_rss() {
+        progress() << "Peak RSS: " << std::fixed << std::setprecision(1)
+                  << static_cast<double>(metrics::peak_rss_bytes()) / (1 << 20) << " MiB." << std::defaultfloat
+                  << std::endl;
     }
-    std::string escaped = "\"";
-    for (char ch : value) {
-        if (ch == '\"') {
-            escaped.push_back('\"');
+
+    // With --adaptive-poll, when the next feed is due.
+    schedule::Clock::time_point next_fetch() const {
+        schedule::Clock::time_point next = schedule::Clock::time_point::max();
+        for (const schedule::FeedSchedule &feed_schedule : schedules_) {
+            next = std::min(next, feed_schedule.next());
         }
-        escaped.push_back(ch);
+        return next;
     }
-    escaped.push_back('\"');
-    return escaped;
-}
 
-void append_records_to_csv(const std::vector<Record> &records, const std::filesystem::path &path) {
-    bool file_exists = std::filesystem::exists(path);
-    std::ofstream out(path, std::ios::app);
-    if (!out) {
-        throw std::runtime_error("Failed to open earthquakes.csv for writing");
+private:
+    void replay_streaming(const std::vector<std::filesystem::path> &files) {
+        size_t failed = 0;
+        std::string chunk(kReplayChunkBytes, '\0');
+        for (const std::filesystem::path &path : files) {
+            if (writer_.failed()) {
+                writer_.flush();
+            }
+            metrics::Cycle cycle(now_millis());
+            const records::BatchSink batches = [&](RecordBatch &batch) { process_batch(batch, cycle); };
+            RecordBatch records;
+            RecordExtractor extractor(records);
+            extractor.limit_features(options_.limits.max_features);
+            extractor.stream_batches(*options_.batch_records, &batches);
+            simplejson::PushParser<RecordExtractor> parser(extractor, options_.limits.max_depth);
+            try {
+                // Includes the time the batches take.
+                metrics::Cycle::Timer timer = cycle.stage("read_parse");
+                std::ifstream in(path, std::ios::binary);
+                if (!in) {
+                    throw std::runtime_error("Failed to open " + path.string());
+                }
+                uint64_t bytes = 0;
+                while (in) {
+                    in.read(chunk.data(), static_cast<std::streamsize>(chunk.size()));
+                    const size_t count = static_cast<size_t>(in.gcount());
+                    bytes += count;
+                    check_input_size(path, bytes);
+                    parser.feed(std::string_view(chunk.data(), count));
+                }
+                if (in.bad()) {
+                    throw std::runtime_error("Failed to read " + path.string());
+                }
+                parser.finish();
+                extractor.finish();
+                timer.set_bytes(bytes);
+            } catch (const std::exception &ex) {
+                ++failed;
+                report_feed_error(path.string(), ex, "reading");
+                metrics::Source source;
+                source.name = path.string();
+                source.failed = true;
+                cycle.add_source(std::move(source));
+            }
+            end_document(cycle);
+            emit_metrics(cycle);
+        }
+        writer_.flush();
+
+        progress() << "Replayed " << files.size() << " input files." << std::endl;
+        if (failed > 0) {
+            throw std::runtime_error(std::to_string(failed) + " of " + std::to_string(files.size()) +
+                                     " input files failed");
+        }
     }
-    if (!file_exists) {
-        out << "time_iso,magnitude,place,longitude,latitude,depth_km\n";
+
+    void check_input_size(const std::filesystem::path &path, std::uintmax_t bytes) const {
+        if (options_.limits.max_bytes > 0 && bytes > options_.limits.max_bytes) {
+            throw std::runtime_error(path.string() + " exceeds " + std::to_string(options_.limits.max_bytes) +
+                                     " bytes");
+        }
     }
-    for (const auto &record : records) {
-        out << record.time_iso << ',';
-        if (record.magnitude) {
-            out << *record.magnitude;
+
+    // One batch of bounded memory mode: its revisions of the same event are
+    // merged, as across feeds, and the rest is processed like a cycle,
+    // except that its job is held back until the next batch or the end of
+    // the document. index_ is encoded, and events.idx, the reports and the
+    // aggregates are rewritten, only for the last batch of each document
+    // (end_document()), not for every batch: that would cost time
+    // quadratic in the document's events. Should a document's writes fail
+    // or the process die part-way, events.idx still describes the end of
+    // the previous document; the rows of this one already appended to
+    // earthquakes.csv are then appended again when it is processed again.
+    // As elsewhere events may be written twice, but never claimed without
+    // being written.
+    void process_batch(RecordBatch &batch, metrics::Cycle &cycle) {
+        RecordBatch merged;
+        {
+            metrics::Cycle::Timer timer = cycle.stage("merge");
+            std::vector<RecordBatch> batches;
+            batches.push_back(std::move(batch));
+            merged = merge_feeds(batches);
+            timer.set_records(merged.size());
         }
-        out << ',' << escape_csv(record.place) << ',';
-        if (record.longitude) {
-            out << *record.longitude;
+        process(std::move(merged), cycle, true);
+    }
+
+    // Submits the held job of the document's last batch, if any, with the
+    // index as it now stands.
+    void end_document(metrics::Cycle &cycle) {
+        if (!held_) {
+            return;
         }
-        out << ',';
-        if (record.latitude) {
-            out << *record.latitude;
+        WriteJob job = std::move(*held_);
+        held_.reset();
+        {
+            metrics::Cycle::Timer timer = cycle.stage("index");
+            prune_index(job.now_ms);
+            job.index = index_.encode();
+            timer.set_bytes(job.index.size());
+            timer.set_records(index_.size());
         }
-        out << ',';
-        if (record.depth_km) {
-            out << *record.depth_km;
+        metrics::Cycle::Timer timer = cycle.stage("enqueue");
+        writer_.submit(std::move(job));
+    }
+
+    void prune_index(int64_t now_ms) {
+        const int64_t cutoff_ms =
+            now_ms - std::chrono::duration_cast<std::chrono::milliseconds>(options_.retention).count();
+        index_.prune(cutoff_ms);
+        if (alerter_) {
+            alerter_->prune(cutoff_ms);
         }
-        out << "\n";
     }
-}
 
-struct Bucket {
-    double min_inclusive;
-    double max_exclusive;
-    std::string label;
-};
+    // Deduplicates the cycle's records, updates the index and aggregates in
+    // memory and queues the outputs for the writer thread, waiting only if
+    // it is kWriteQueueCapacity cycles behind. With `hold` the job is kept
+    // as held_ instead, and the one held before is queued without the
+    // files rewritten whole.
+    void process(RecordBatch records, metrics::Cycle &cycle, bool hold) {
+        if (records.empty()) {
+            std::cerr << "No earthquake records found.\n";
+        }
 
-std::vector<Bucket> make_buckets() {
-    return {
-        {std::numeric_limits<double>::lowest(), 1.0, "<1.0"},
-        {1.0, 2.0, "1.0-1.9"},
-        {2.0, 3.0, "2.0-2.9"},
-        {3.0, 4.0, "3.0-3.9"},
-        {4.0, 5.0, "4.0-4.9"},
-        {5.0, 6.0, "5.0-5.9"},
-        {6.0, 7.0, "6.0-6.9"},
-        {7.0, 8.0, "7.0-7.9"},
-        {8.0, std::numeric_limits<double>::infinity(), ">=8.0"}
-    };
-}
+        RecordBatch unseen;
+        {
+            metrics::Cycle::Timer timer = cycle.stage("dedup");
+            unseen = select_unseen(records, index_);
+            timer.set_records(records.size());
+        }
+
+        int64_t now_ms = now_millis();
+        {
+            metrics::Cycle::Timer timer = cycle.stage("aggregate");
+            count_unseen(unseen, aggregates_);
+            timer.set_records(unseen.size());
+        }
+        if (window_) {
+            // Queries see these once the cycle publishes.
+            window_->add(unseen);
+        }
+        std::string index;
+        {
+            metrics::Cycle::Timer timer = cycle.stage("index");
+            for (size_t row = 0; row < unseen.size(); ++row) {
+                std::string_view id = unseen.ids()[row];
+                if (!id.empty()) {
+                    index_.record(id, unseen.time_ms()[row], unseen.updated_ms()[row], unseen.magnitude()[row],
+                                  unseen.depth_km()[row]);
+                }
+            }
+            if (!hold) {
+                prune_index(now_ms);
+                index = index_.encode();
+                timer.set_bytes(index.size());
+            }
+            timer.set_records(index_.size());
+        }
+        cycle.add_records(records.size(), unseen.size());
+        progress() << "Processed " << records.size() << " earthquake events (" << unseen.size()
+                  << " new or revised)." << std::endl;
 
-void write_report(const std::vector<Record> &records, const std::filesystem::path &path) {
-    std::vector<Bucket> buckets = make_buckets();
-    std::vector<std::size_t> counts(buckets.size(), 0);
+        // Time spent here is time the writer thread was behind.
+        metrics::Cycle::Timer timer = cycle.stage("enqueue");
+        WriteJob job{std::move(records), std::move(unseen), aggregates_, std::move(index), now_ms};
+        if (!hold) {
+            writer_.submit(std::move(job));
+            return;
+        }
+        if (held_) {
+            held_->checkpoint = false;
+            writer_.submit(std::move(*held_));
+        }
+        held_ = std::move(job);
+    }
 
-    for (const auto &record : records) {
-        if (!record.magnitude) {
-            continue;
+    // Runs on the writer thread. Jobs that queued up behind a slow write
+    // are written together: their rows as one append and one archive
+    // segment, and the files that are rewritten whole (reports, aggregates,
+    // index) from the last job only, provided it is a checkpoint. events.idx
+    // is written last, so after a failure it never claims rows that did not
+    // reach earthquakes.csv.
+    void write_outputs(std::vector<WriteJob> &jobs) {
+        // Only collects the stage timings.
+        metrics::Cycle cycle(now_millis());
+        WriteJob &last = jobs.back();
+        RecordBatch combined;
+        if (jobs.size() > 1) {
+            for (const WriteJob &job : jobs) {
+                combined.append(job.unseen);
+            }
         }
-        double mag = *record.magnitude;
-        for (std::size_t i = 0; i < buckets.size(); ++i) {
-            const Bucket &bucket = buckets[i];
-            if (mag >= bucket.min_inclusive && mag < bucket.max_exclusive) {
-                counts[i] += 1;
-                break;
+        const RecordBatch &unseen = jobs.size() > 1 ? combined : last.unseen;
+
+        std::filesystem::create_directories("data");
+        {
+            metrics::Cycle::Timer timer = cycle.stage("csv_append");
+            if (std::optional<std::filesystem::path> closed =
+                    rotation::rotate(kEventsCsv, options_.rotation, last.now_ms)) {
+                compressor_.submit(std::move(*closed));
             }
+            std::error_code error;
+            std::uintmax_t before = std::filesystem::file_size(kEventsCsv, error);
+            append_records_to_csv(unseen, kEventsCsv);
+            timer.set_bytes(std::filesystem::file_size(kEventsCsv) - (error ? 0 : before));
+            timer.set_records(unseen.size());
+        }
+        {
+            metrics::Cycle::Timer timer = cycle.stage("archive");
+            archive_.append(unseen);
+            timer.set_records(unseen.size());
+        }
+        if (!last.checkpoint) {
+            std::lock_guard<std::mutex> lock(written_mutex_);
+            write_stages_.insert(write_stages_.end(), cycle.stages().begin(), cycle.stages().end());
+            return;
+        }
+        {
+            metrics::Cycle::Timer timer = cycle.stage("report");
+            write_report(last.records, last.aggregates, last.now_ms, "data/report.csv", pool_);
+            write_summary(last.aggregates, last.now_ms, "data/summary.csv");
+            last.aggregates.save("data/aggregates.bin");
+            timer.set_records(last.records.size());
+        }
+        if (!options_.regions.empty()) {
+            metrics::Cycle::Timer timer = cycle.stage("regions");
+            spatial::GridIndex grid(last.records);
+            std::filesystem::create_directories("data/regions");
+            for (const Region &region : options_.regions) {
+                write_region_report(last.records, grid, region, "data/regions/" + region.name + ".csv");
+            }
+            timer.set_records(last.records.size());
+        }
+        {
+            metrics::Cycle::Timer timer = cycle.stage("index_save");
+            binary::write_file_atomically("data/events.idx", last.index);
+            timer.set_bytes(last.index.size());
         }
+
+        std::lock_guard<std::mutex> lock(written_mutex_);
+        written_aggregates_ = std::move(last.aggregates);
+        write_stages_.insert(write_stages_.end(), cycle.stages().begin(), cycle.stages().end());
     }
 
-    std::ofstream out(path, std::ios::trunc);
-    if (!out) {
-        throw std::runtime_error("Failed to open report.csv for writing");
+    // Runs on the compressor thread. Each closed segment is replaced by a
+    // gzip copy compressed in blocks on the pool; one that fails is reported
+    // and kept as it is, and is tried again when the pipeline next starts.
+    void compress_segments(std::vector<std::filesystem::path> &segments) {
+        metrics::Cycle cycle(now_millis());
+        for (const std::filesystem::path &segment : segments) {
+            metrics::Cycle::Timer timer = cycle.stage("compress");
+            try {
+                std::filesystem::path compressed = segment;
+                compressed += ".gz";
+                timer.set_bytes(std::filesystem::file_size(segment));
+                gzip::compress_file(segment, compressed, pool_);
+                std::filesystem::remove(segment);
+            } catch (const std::exception &ex) {
+                std::cerr << "Error compressing " << segment.string() << ": " << ex.what() << std::endl;
+            }
+        }
+        std::lock_guard<std::mutex> lock(written_mutex_);
+        write_stages_.insert(write_stages_.end(), cycle.stages().begin(), cycle.stages().end());
     }
-    out << "range,count\n";
-    for (std::size_t i = 0; i < buckets.size(); ++i) {
-        out << buckets[i].label << ',' << counts[i] << "\n";
+
+    // After a failed write, goes back to the index and aggregates of the
+    // last write that succeeded. events.idx, written last, holds that
+    // index; aggregates.bin may already hold the failed write's totals, so
+    // they come from the writer's copy instead. Returns whether it did, in
+    // which case the cycle must process its records even if no feed
+    // changed.
+    bool recover_from_write_failure() {
+        if (!writer_.failed()) {
+            return false;
+        }
+        std::exception_ptr error = writer_.drain();
+        try {
+            std::rethrow_exception(error);
+        } catch (const std::exception &ex) {
+            std::cerr << "Error writing outputs: " << ex.what() << "; writing them again." << std::endl;
+        }
+        restore_written_state();
+        return true;
     }
-}
 
-class CurlGlobal {
-public:
-    CurlGlobal() {
-        CURLcode code = curl_global_init(CURL_GLOBAL_DEFAULT);
-        if (code != CURLE_OK) {
-            throw std::runtime_error("Failed to initialize CURL globals");
+    void restore_written_state() {
+        index_ = dedup::EventIndex::load("data/events.idx");
+        std::lock_guard<std::mutex> lock(written_mutex_);
+        aggregates_ = written_aggregates_;
+    }
+
+    // Adds the stages the writer thread finished since the last call to
+    // `cycle`, which sums those of the same name.
+    void add_write_stages(metrics::Cycle &cycle) {
+        std::vector<metrics::Stage> finished;
+        {
+            std::lock_guard<std::mutex> lock(written_mutex_);
+            finished.swap(write_stages_);
+        }
+        for (metrics::Stage &stage : finished) {
+            cycle.add_stage(std::move(stage));
         }
     }
 
-    ~CurlGlobal() {
-        curl_global_cleanup();
+    void add_feed_source(metrics::Cycle &cycle, metrics::Source source,
+                         const schedule::FeedSchedule &feed_schedule) const {
+        if (options_.adaptive_poll && feed_schedule.cadence()) {
+            source.cadence_seconds = std::chrono::duration<double>(*feed_schedule.cadence()).count();
+        }
+        cycle.add_source(std::move(source));
+    }
+
+    static metrics::Source feed_source(const std::string &url, const feed::FetchOutcome &outcome) {
+        metrics::Source source;
+        source.name = url;
+        if (outcome.error) {
+            return source;
+        }
+        const feed::FetchResult &transfer = outcome.transfer;
+        source.not_modified = transfer.not_modified;
+        source.wire_bytes = static_cast<uint64_t>(transfer.wire_bytes);
+        source.decoded_bytes = static_cast<uint64_t>(transfer.decoded_bytes);
+        source.name_lookup_seconds = transfer.timings.name_lookup;
+        source.connect_seconds = transfer.timings.connect;
+        source.tls_seconds = transfer.timings.tls;
+        source.first_byte_seconds = transfer.timings.first_byte;
+        source.transfer_seconds = transfer.timings.total;
+        return source;
+    }
+
+    // Writes the cycle's measurements to --metrics: a Prometheus text file,
+    // replaced atomically, when the name ends in .prom, otherwise one JSON
+    // line appended per cycle. The output stages are those the writer
+    // thread finished by then, which in poll mode are usually the previous
+    // cycle's. A failure to write them is reported but does not fail the
+    // cycle.
+    void emit_metrics(metrics::Cycle &cycle) {
+        cycle.finish();
+        add_write_stages(cycle);
+        if (alerter_) {
+            alerts::Alerter::Latency latency = alerter_->take_latency();
+            cycle.set_alerts(latency.alerts, latency.max_parse_to_alert_seconds, latency.max_fetch_to_alert_seconds);
+        }
+        if (!options_.metrics_path) {
+            return;
+        }
+        const std::filesystem::path path(*options_.metrics_path);
+        try {
+            if (path.extension() == ".prom") {
+                binary::write_file_atomically(path, cycle.to_prometheus());
+                return;
+            }
+            std::ofstream out(path, std::ios::app);
+            if (!(out << cycle.to_json() << '\n') || !out.flush()) {
+                throw std::runtime_error("Failed to write " + path.string());
+            }
+        } catch (const std::exception &ex) {
+            std::cerr << "Error writing metrics: " << ex.what() << std::endl;
+        }
     }
+
+    // Adds the new or revised events to the aggregates. A revision first
+    // takes out the values counted for the previous one; events the index
+    // knows but never counted (from before the aggregates existed) are
+    // simply added. So are events pruned from the index, which are then
+    // counted twice: keeping what they counted would make the index grow
+    // without bound, which is what --retention prevents.
+    void count_unseen(const RecordBatch &unseen, aggregate::State &aggregates) const {
+        for (size_t row = 0; row < unseen.size(); ++row) {
+            std::string_view id = unseen.ids()[row];
+            const dedup::EventIndex::Entry *previous = id.empty() ? nullptr : index_.find(id);
+            if (previous && previous->counted) {
+                aggregates.remove(previous->time_ms, previous->magnitude, previous->depth_km);
+            }
+            aggregates.add(unseen.time_ms()[row], unseen.magnitude()[row], unseen.depth_km()[row]);
+        }
+    }
+
+    const Options &options_;
+    std::vector<std::unique_ptr<feed::FeedClient>> clients_;
+    // Records of each feed's last successful parse.
+    std::vector<RecordBatch> latest_;
+    // When to fetch each feed, used with --adaptive-poll.
+    std::vector<schedule::FeedSchedule> schedules_;
+    feed::MultiFetcher fetcher_;
+    concurrency::ThreadPool pool_;
+    dedup::EventIndex index_;
+    // Set with --alert. Reads index_ on the threads that parse feeds. On the
+    // pool, and with --parallel-parse, they run while the main thread waits
+    // in fetch_all() or FeedParseJob::finish(), when the index does not
+    // change. In bounded memory mode the main thread parses each chunk
+    // itself as it arrives, and process_batch() updates index_ between
+    // features, on that same thread, so the reads never overlap a change.
+    std::unique_ptr<alerts::Alerter> alerter_;
+    aggregate::State aggregates_;
+    // Set with --serve: the events and aggregates queries are answered
+    // from, published at the end of every cycle, and the server answering
+    // them, which must go before the window.
+    std::unique_ptr<live::Window> window_;
+    std::unique_ptr<query::Server> server_;
+    // In bounded memory mode, the job of the last batch processed, until
+    // the next batch or the end of its document.
+    std::optional<WriteJob> held_;
+    // What the writer thread last wrote successfully, and the stages it
+    // finished since the last metrics.
+    std::mutex written_mutex_;
+    aggregate::State written_aggregates_;
+    std::vector<metrics::Stage> write_stages_;
+    // Used by the writer thread only.
+    archive::SegmentWriter archive_{"data/archive"};
+    // Compresses the segments the writer closes; destroyed after it, so it
+    // also finishes those closed by the last writes.
+    concurrency::AsyncWriter<std::filesystem::path> compressor_{
+        kCompressQueueCapacity, [this](std::vector<std::filesystem::path> &segments) { compress_segments(segments); }};
+    // Last, so that it is destroyed first and writes what is still queued
+    // while the rest of the pipeline is intact.
+    // In bounded memory mode only one batch waits behind the one being
+    // written, besides held_, so that memory does not grow with the
+    // document.
+    concurrency::AsyncWriter<WriteJob> writer_{options_.batch_records ? 1 : kWriteQueueCapacity,
+                                               [this](std::vector<WriteJob> &jobs) { write_outputs(jobs); }};
 };
 
-} // namespace
+void report_cycle_error(const std::exception &ex) {
+    if (dynamic_cast<const simplejson::ParseError *>(&ex)) {
+        std::cerr << "JSON parse error: " << ex.what() << std::endl;
+    } else {
+        std::cerr << "Error: " << ex.what() << std::endl;
+    }
+}
 
-int main() {
-    try {
-        CurlGlobal curl_initializer;
+// Sleeps until `deadline`, waking early when shutdown is requested.
+void sleep_until(std::chrono::steady_clock::time_point deadline) {
+    constexpr auto kSlice = std::chrono::milliseconds(200);
+    while (!g_shutdown_requested.load()) {
+        auto now = std::chrono::steady_clock::now();
+        if (now >= deadline) {
+            return;
+        }
+        std::this_thread::sleep_until(std::min(deadline, now + kSlice));
+    }
+}
 
-        std::string payload = fetch_feed(kFeedUrl);
-        std::vector<Record> records = parse_records(payload);
+// Runs a cycle every `interval` until SIGINT/SIGTERM. Ticks are scheduled
+// from a fixed origin so they do not drift with cycle duration; ticks missed
+// by an overrunning cycle are skipped rather than run back to back. Failed
+// cycles are reported and retried on the next tick. With `adaptive`, a
+// cycle instead runs whenever a feed's schedule says it is due, and fetches
+// only the feeds that are. A cycle's outputs are written while the next one
+// fetches; the writes still queued at shutdown are finished before the loop
+// returns.
+void run_poll_loop(Pipeline &pipeline, std::chrono::seconds interval, bool adaptive) {
+    std::signal(SIGINT, request_shutdown);
+    std::signal(SIGTERM, request_shutdown);
+    pipeline.set_cancel_flag(&g_shutdown_requested);
 
-        if (records.empty()) {
-            std::cerr << "No earthquake records found.\n";
+    auto next_tick = std::chrono::steady_clock::now();
+    while (!g_shutdown_requested.load()) {
+        try {
+            pipeline.run_cycle(false);
+        } catch (const std::exception &ex) {
+            if (g_shutdown_requested.load()) {
+                break;
+            }
+            report_cycle_error(ex);
         }
 
-        std::filesystem::create_directories("data");
-        append_records_to_csv(records, "data/earthquakes.csv");
-        write_report(records, "data/report.csv");
+        if (adaptive) {
+            sleep_until(pipeline.next_fetch());
+            continue;
+        }
+        auto now = std::chrono::steady_clock::now();
+        while (next_tick <= now) {
+            next_tick += interval;
+        }
+        sleep_until(next_tick);
+    }
+    progress() << "Shutting down." << std::endl;
+    try {
+        pipeline.finish_writes();
+    } catch (const std::exception &ex) {
+        report_cycle_error(ex);
+    }
+}
 
-        std::cout << "Processed " << records.size() << " earthquake events." << std::endl;
+} // namespace
+
+int main(int argc, char **argv) {
+    Options options;
+    try {
+        options = parse_options(argc, argv);
+    } catch (const std::exception &ex) {
+        std::cerr << ex.what() << "\n"
+                  << "Usage: " << argv[0] << " [--feed <url>]... [--poll <interval> [--adaptive-poll]]"
+                  << " [--retention <duration>]"
+                  << " [--parallel-parse] [--region <name>=<area>]... [--metrics <file>]"
+                  << " [--rotate daily|<size>]... [--alert <condition>[+<condition>...]]..."
+                  << " [--alert-sink -|<path>|udp://<host>:<port>|<url>]"
+                  << " [--serve <port>|<host>:<port>|unix:<path> [--serve-window <duration>]]\n"
+                  << "       " << argv[0] << " --input <file|dir>... [--retention <duration>]"
+                  << " [--region <name>=<area>]... [--metrics <file>] [--rotate daily|<size>]...\n"
+                  << "Both forms also take [--max-payload <size>] [--max-depth <levels>]"
+                  << " [--max-features <count>] [--bounded-memory <records>].\n"
+                  << "Areas are <lat>,<lon>,<radius_km> or <south>,<west>,<north>,<east> in degrees.\n"
+                  << "Durations are in seconds, or take an s, m, h or d suffix.\n"
+                  << "Sizes are in bytes, or take a K, M or G suffix.\n"
+                  << "Alert conditions are mag:<magnitude>, area:<area> and tsunami." << std::endl;
+        return 2;
+    }
+
+    if (!options.alert_rules.empty() && options.alert_sink == "-") {
+        g_progress = &std::cerr;
+    }
+    try {
+        CurlGlobal curl_initializer;
+        Pipeline pipeline(options);
+
+        if (!options.inputs.empty()) {
+            pipeline.replay(list_inputs(options.inputs));
+        } else if (options.poll_interval) {
+            run_poll_loop(pipeline, *options.poll_interval, options.adaptive_poll);
+        } else {
+            pipeline.run_cycle(true);
+        }
+        Pipeline::report_peak_rss();
         return 0;
-    } catch (const simplejson::ParseError &ex) {
-        std::cerr << "JSON parse error: " << ex.what() << std::endl;
-        return 1;
     } catch (const std::exception &ex) {
-        std::cerr << "Error: " << ex.what() << std::endl;
+        report_cycle_error(ex);
+        Pipeline::report_peak_rss();
         return 1;
     }
 }
-
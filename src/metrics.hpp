@@ -0,0 +1,420 @@
+#pragma once
+
+#include <sys/resource.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "json.hpp"
+
+namespace metrics {
+
+// Allocations made so far by the process, counted by the operator new hook
+// of allocation_hook.hpp. Builds without METRICS_COUNT_ALLOCATIONS have no
+// hook and report no allocation counts.
+inline std::atomic<uint64_t> g_allocations{0};
+
+inline std::optional<uint64_t> allocations() {
+#if defined(METRICS_COUNT_ALLOCATIONS)
+    return g_allocations.load(std::memory_order_relaxed);
+#else
+    return std::nullopt;
+#endif
+}
+
+// The largest the process's resident set has been so far, in bytes.
+inline uint64_t peak_rss_bytes() {
+    rusage usage{};
+    if (::getrusage(RUSAGE_SELF, &usage) != 0) {
+        return 0;
+    }
+    // Linux reports kilobytes.
+    return static_cast<uint64_t>(usage.ru_maxrss) * 1024;
+}
+
+// Time, volume and allocations of one stage of a cycle. Allocations are
+// process-wide, so a stage that overlaps work on other threads also counts
+// theirs.
+struct Stage {
+    std::string name;
+    double seconds = 0.0;
+    uint64_t bytes = 0;
+    uint64_t records = 0;
+    std::optional<uint64_t> allocations;
+};
+
+// Transfer and parse figures of one feed or input file.
+struct Source {
+    std::string name;
+    bool not_modified = false;
+    bool failed = false;
+    uint64_t wire_bytes = 0;
+    uint64_t decoded_bytes = 0;
+    uint64_t records = 0;
+    // Time spent parsing, which overlaps the transfer for streamed feeds.
+    double parse_seconds = 0.0;
+    // Phase end times from curl; absent for files.
+    std::optional<double> name_lookup_seconds;
+    std::optional<double> connect_seconds;
+    std::optional<double> tls_seconds;
+    std::optional<double> first_byte_seconds;
+    std::optional<double> transfer_seconds;
+    // Age of the document when it arrived, from its generation time.
+    std::optional<double> staleness_seconds;
+    // The feed's learned regeneration interval, under --adaptive-poll.
+    std::optional<double> cadence_seconds;
+};
+
+// Measurements of one cycle, collected as it runs and written out once at
+// the end, as a JSON line or a Prometheus text file. Recording a stage costs
+// two clock reads and, with the hook, two atomic loads.
+class Cycle {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    // Times a stage until destroyed; bytes and records can be filled in
+    // while it runs.
+    class Timer {
+    public:
+        Timer(Cycle &cycle, std::string name)
+            : cycle_(cycle), start_(Clock::now()), allocations_(metrics::allocations()) {
+            stage_.name = std::move(name);
+        }
+
+        Timer(const Timer &) = delete;
+        Timer &operator=(const Timer &) = delete;
+
+        ~Timer() {
+            stage_.seconds = std::chrono::duration<double>(Clock::now() - start_).count();
+            if (allocations_) {
+                stage_.allocations = *metrics::allocations() - *allocations_;
+            }
+            cycle_.add_stage(std::move(stage_));
+        }
+
+        void set_bytes(uint64_t bytes) { stage_.bytes = bytes; }
+        void set_records(uint64_t records) { stage_.records = records; }
+
+    private:
+        Cycle &cycle_;
+        Stage stage_;
+        Clock::time_point start_;
+        std::optional<uint64_t> allocations_;
+    };
+
+    explicit Cycle(int64_t wall_time_ms)
+        : wall_time_ms_(wall_time_ms), start_(Clock::now()), allocations_(metrics::allocations()) {}
+
+    Timer stage(std::string name) { return Timer(*this, std::move(name)); }
+
+    void add_source(Source source) { sources_.push_back(std::move(source)); }
+
+    // Adds a stage measured elsewhere, such as on another thread. A stage
+    // that ran more than once in the cycle, as with batches in bounded
+    // memory mode, is listed once with the runs summed.
+    void add_stage(Stage stage) {
+        auto same = std::find_if(stages_.begin(), stages_.end(),
+                                 [&](const Stage &other) { return other.name == stage.name; });
+        if (same == stages_.end()) {
+            stages_.push_back(std::move(stage));
+            return;
+        }
+        same->seconds += stage.seconds;
+        same->bytes += stage.bytes;
+        same->records += stage.records;
+        if (same->allocations && stage.allocations) {
+            *same->allocations += *stage.allocations;
+        }
+    }
+
+    const std::vector<Stage> &stages() const { return stages_; }
+
+    // Counts records seen by the cycle and the new or revised ones among
+    // them.
+    void add_records(uint64_t records, uint64_t written) {
+        records_ += records;
+        written_ += written;
+    }
+
+    // Alerts delivered since the previous cycle's metrics, with the longest
+    // delays from parsing the event, and from starting the fetch that
+    // carried it, to the sink accepting the alert. Left out unless set.
+    void set_alerts(uint64_t alerts, double max_parse_to_alert_seconds, double max_fetch_to_alert_seconds) {
+        alerts_ = Alerts{alerts, max_parse_to_alert_seconds, max_fetch_to_alert_seconds};
+    }
+
+    // Stops the cycle clock; later stages are still listed.
+    void finish() {
+        if (!seconds_) {
+            seconds_ = std::chrono::duration<double>(Clock::now() - start_).count();
+            if (allocations_) {
+                total_allocations_ = *metrics::allocations() - *allocations_;
+            }
+            peak_rss_bytes_ = metrics::peak_rss_bytes();
+        }
+    }
+
+    // {"time_ms":..., "seconds":..., "records":..., "stages":[...],
+    //  "sources":[...]} on one line.
+    std::string to_json() const {
+        std::string out = "{\"time_ms\":" + std::to_string(wall_time_ms_);
+        field(out, "seconds", seconds());
+        field(out, "records", records_);
+        field(out, "written", written_);
+        field(out, "records_per_second", per_second(records_, seconds()));
+        field(out, "peak_rss_bytes", peak_rss_bytes_);
+        if (total_allocations_) {
+            field(out, "allocations", *total_allocations_);
+        }
+        if (alerts_) {
+            field(out, "alerts", alerts_->count);
+            field(out, "max_parse_to_alert_seconds", alerts_->max_parse_seconds);
+            field(out, "max_fetch_to_alert_seconds", alerts_->max_fetch_seconds);
+        }
+        out += ",\"stages\":[";
+        for (size_t i = 0; i < stages_.size(); ++i) {
+            const Stage &stage = stages_[i];
+            out += i == 0 ? "{" : ",{";
+            out += "\"name\":";
+            simplejson::append_string(out, stage.name);
+            field(out, "seconds", stage.seconds);
+            if (stage.bytes > 0) {
+                field(out, "bytes", stage.bytes);
+                field(out, "megabytes_per_second", per_second(stage.bytes, stage.seconds) / 1e6);
+            }
+            if (stage.records > 0) {
+                field(out, "records", stage.records);
+                field(out, "records_per_second", per_second(stage.records, stage.seconds));
+            }
+            if (stage.allocations) {
+                field(out, "allocations", *stage.allocations);
+            }
+            out += "}";
+        }
+        out += "],\"sources\":[";
+        for (size_t i = 0; i < sources_.size(); ++i) {
+            const Source &source = sources_[i];
+            out += i == 0 ? "{" : ",{";
+            out += "\"name\":";
+            simplejson::append_string(out, source.name);
+            out += source.failed ? ",\"failed\":true" : "";
+            out += source.not_modified ? ",\"not_modified\":true" : "";
+            field(out, "wire_bytes", source.wire_bytes);
+            field(out, "decoded_bytes", source.decoded_bytes);
+            field(out, "records", source.records);
+            field(out, "parse_seconds", source.parse_seconds);
+            optional_field(out, "name_lookup_seconds", source.name_lookup_seconds);
+            optional_field(out, "connect_seconds", source.connect_seconds);
+            optional_field(out, "tls_seconds", source.tls_seconds);
+            optional_field(out, "first_byte_seconds", source.first_byte_seconds);
+            optional_field(out, "transfer_seconds", source.transfer_seconds);
+            optional_field(out, "staleness_seconds", source.staleness_seconds);
+            optional_field(out, "cadence_seconds", source.cadence_seconds);
+            out += "}";
+        }
+        out += "]}";
+        return out;
+    }
+
+    // Gauges in the Prometheus text exposition format, for the node
+    // exporter's textfile collector.
+    std::string to_prometheus() const {
+        std::string out;
+        gauge(out, "earthquake_cycle_timestamp_seconds", "Wall-clock time the last cycle started.", {},
+              static_cast<double>(wall_time_ms_) / 1e3);
+        gauge(out, "earthquake_cycle_seconds", "Duration of the last cycle.", {}, seconds());
+        gauge(out, "earthquake_cycle_records", "Records seen by the last cycle.", {},
+              static_cast<double>(records_));
+        gauge(out, "earthquake_cycle_written_records", "New or revised records written by the last cycle.", {},
+              static_cast<double>(written_));
+        gauge(out, "earthquake_peak_rss_bytes", "Largest resident set size of the process so far.", {},
+              static_cast<double>(peak_rss_bytes_));
+        if (total_allocations_) {
+            gauge(out, "earthquake_cycle_allocations", "Heap allocations during the last cycle.", {},
+                  static_cast<double>(*total_allocations_));
+        }
+        if (alerts_) {
+            gauge(out, "earthquake_alerts", "Alerts delivered since the previous cycle.", {},
+                  static_cast<double>(alerts_->count));
+            header(out, "earthquake_alert_latency_seconds",
+                   "Longest delay to deliver an alert since the previous cycle, from parsing the event or from "
+                   "starting its fetch.");
+            sample(out, "earthquake_alert_latency_seconds", {{"from", "parse"}}, alerts_->max_parse_seconds);
+            sample(out, "earthquake_alert_latency_seconds", {{"from", "fetch"}}, alerts_->max_fetch_seconds);
+        }
+
+        header(out, "earthquake_stage_seconds", "Duration of each stage of the last cycle.");
+        for (const Stage &stage : stages_) {
+            sample(out, "earthquake_stage_seconds", {{"stage", stage.name}}, stage.seconds);
+        }
+        header(out, "earthquake_stage_bytes", "Bytes processed by each stage of the last cycle.");
+        for (const Stage &stage : stages_) {
+            sample(out, "earthquake_stage_bytes", {{"stage", stage.name}}, static_cast<double>(stage.bytes));
+        }
+        header(out, "earthquake_stage_records", "Records processed by each stage of the last cycle.");
+        for (const Stage &stage : stages_) {
+            sample(out, "earthquake_stage_records", {{"stage", stage.name}}, static_cast<double>(stage.records));
+        }
+        if (total_allocations_) {
+            header(out, "earthquake_stage_allocations", "Heap allocations during each stage of the last cycle.");
+            for (const Stage &stage : stages_) {
+                sample(out, "earthquake_stage_allocations", {{"stage", stage.name}},
+                       static_cast<double>(stage.allocations.value_or(0)));
+            }
+        }
+
+        header(out, "earthquake_source_bytes", "Body bytes of each feed or file, on the wire and decoded.");
+        for (const Source &source : sources_) {
+            sample(out, "earthquake_source_bytes", {{"source", source.name}, {"kind", "wire"}},
+                   static_cast<double>(source.wire_bytes));
+            sample(out, "earthquake_source_bytes", {{"source", source.name}, {"kind", "decoded"}},
+                   static_cast<double>(source.decoded_bytes));
+        }
+        header(out, "earthquake_source_records", "Records parsed from each feed or file.");
+        for (const Source &source : sources_) {
+            sample(out, "earthquake_source_records", {{"source", source.name}}, static_cast<double>(source.records));
+        }
+        header(out, "earthquake_source_failed", "1 if the feed or file failed in the last cycle.");
+        for (const Source &source : sources_) {
+            sample(out, "earthquake_source_failed", {{"source", source.name}}, source.failed ? 1.0 : 0.0);
+        }
+        header(out, "earthquake_source_not_modified", "1 if the feed answered 304 in the last cycle.");
+        for (const Source &source : sources_) {
+            sample(out, "earthquake_source_not_modified", {{"source", source.name}}, source.not_modified ? 1.0 : 0.0);
+        }
+        header(out, "earthquake_source_staleness_seconds", "Age of each feed's document when it arrived.");
+        for (const Source &source : sources_) {
+            if (source.staleness_seconds) {
+                sample(out, "earthquake_source_staleness_seconds", {{"source", source.name}}, *source.staleness_seconds);
+            }
+        }
+        header(out, "earthquake_source_cadence_seconds", "Learned regeneration interval of each feed.");
+        for (const Source &source : sources_) {
+            if (source.cadence_seconds) {
+                sample(out, "earthquake_source_cadence_seconds", {{"source", source.name}}, *source.cadence_seconds);
+            }
+        }
+        header(out, "earthquake_source_seconds", "Parse time and transfer phase end times of each source.");
+        for (const Source &source : sources_) {
+            sample(out, "earthquake_source_seconds", {{"source", source.name}, {"phase", "parse"}},
+                   source.parse_seconds);
+            const std::pair<const char *, const std::optional<double> &> phases[] = {
+                {"name_lookup", source.name_lookup_seconds}, {"connect", source.connect_seconds},
+                {"tls", source.tls_seconds},                 {"first_byte", source.first_byte_seconds},
+                {"transfer", source.transfer_seconds},
+            };
+            for (const auto &[phase, value] : phases) {
+                if (value) {
+                    sample(out, "earthquake_source_seconds", {{"source", source.name}, {"phase", phase}}, *value);
+                }
+            }
+        }
+        return out;
+    }
+
+private:
+    using Labels = std::vector<std::pair<std::string_view, std::string_view>>;
+
+    double seconds() const {
+        return seconds_ ? *seconds_ : std::chrono::duration<double>(Clock::now() - start_).count();
+    }
+
+    static double per_second(uint64_t count, double seconds) {
+        return seconds > 0.0 ? static_cast<double>(count) / seconds : 0.0;
+    }
+
+    static void field(std::string &out, const char *name, uint64_t value) {
+        out += ",\"";
+        out += name;
+        out += "\":";
+        out += std::to_string(value);
+    }
+
+    static void field(std::string &out, const char *name, double value) {
+        out += ",\"";
+        out += name;
+        out += "\":";
+        simplejson::append_number(out, value);
+    }
+
+    static void optional_field(std::string &out, const char *name, const std::optional<double> &value) {
+        if (value) {
+            field(out, name, *value);
+        }
+    }
+
+    static void header(std::string &out, const char *name, const char *help) {
+        out += "# HELP ";
+        out += name;
+        out += ' ';
+        out += help;
+        out += "\n# TYPE ";
+        out += name;
+        out += " gauge\n";
+    }
+
+    static void sample(std::string &out, const char *name, const Labels &labels, double value) {
+        out += name;
+        if (!labels.empty()) {
+            out += '{';
+            for (size_t i = 0; i < labels.size(); ++i) {
+                out += i == 0 ? "" : ",";
+                out += labels[i].first;
+                out += "=\"";
+                for (char ch : labels[i].second) {
+                    if (ch == '\\' || ch == '"') {
+                        out += '\\';
+                        out += ch;
+                    } else if (ch == '\n') {
+                        out += "\\n";
+                    } else {
+                        out += ch;
+                    }
+                }
+                out += '"';
+            }
+            out += '}';
+        }
+        out += ' ';
+        if (std::isfinite(value)) {
+            simplejson::append_number(out, value);
+        } else {
+            out += std::isnan(value) ? "NaN" : value > 0 ? "+Inf" : "-Inf";
+        }
+        out += '\n';
+    }
+
+    static void gauge(std::string &out, const char *name, const char *help, const Labels &labels, double value) {
+        header(out, name, help);
+        sample(out, name, labels, value);
+    }
+
+    struct Alerts {
+        uint64_t count;
+        double max_parse_seconds;
+        double max_fetch_seconds;
+    };
+
+    int64_t wall_time_ms_;
+    Clock::time_point start_;
+    std::optional<uint64_t> allocations_;
+    std::optional<double> seconds_;
+    std::optional<uint64_t> total_allocations_;
+    uint64_t records_ = 0;
+    uint64_t written_ = 0;
+    uint64_t peak_rss_bytes_ = 0;
+    std::optional<Alerts> alerts_;
+    std::vector<Stage> stages_;
+    std::vector<Source> sources_;
+};
+
+} // namespace metrics
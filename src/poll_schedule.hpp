@@ -0,0 +1,134 @@
+#pragma once
+
+#include <curl/curl.h>
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <random>
+#include <string>
+
+namespace schedule {
+
+using Clock = std::chrono::steady_clock;
+using Milliseconds = std::chrono::milliseconds;
+
+struct Settings {
+    // Longest wait between two fetches of a feed, and the wait until its
+    // cadence is known.
+    Milliseconds max_interval = std::chrono::minutes(5);
+    // Shortest wait, and the first retry after an error or a 304.
+    Milliseconds min_interval = std::chrono::seconds(10);
+    // How long after the expected regeneration to fetch, so that the new
+    // document has reached the server's caches.
+    Milliseconds settle = std::chrono::seconds(5);
+    // Random extra delay, up to this fraction of the cadence, so that
+    // clients started together do not stay in step.
+    double jitter = 0.1;
+};
+
+// Milliseconds since the epoch of an HTTP date such as a Last-Modified
+// header; unset when it does not parse.
+inline std::optional<int64_t> parse_http_date(const std::string &text) {
+    if (text.empty()) {
+        return std::nullopt;
+    }
+    time_t seconds = curl_getdate(text.c_str(), nullptr);
+    if (seconds < 0) {
+        return std::nullopt;
+    }
+    return static_cast<int64_t>(seconds) * 1000;
+}
+
+// When to fetch one feed next. The feed's regeneration cadence is learned
+// from the generation times of the documents received (metadata.generated,
+// or Last-Modified without it): it is the shortest of the last few gaps
+// between successive generations, since a gap that spans a regeneration
+// the schedule missed is a multiple of the cadence. Once known, the feed is
+// fetched `settle` plus some jitter after its next expected regeneration.
+//
+// Until then the feed is fetched every min_interval, so that the first gap
+// is not itself such a multiple, for at most max_interval after the last
+// change. A 304 after that means the regeneration is late, and an error
+// that the server is unwell; both retry after min_interval, doubling with
+// each further 304 or error, up to the cadence for 304s and max_interval
+// for errors. The first fetch is due straight away.
+class FeedSchedule {
+public:
+    explicit FeedSchedule(const Settings &settings, uint64_t seed = std::random_device{}())
+        : settings_(settings), random_(seed) {}
+
+    Clock::time_point next() const { return next_; }
+    bool due(Clock::time_point now) const { return now >= next_; }
+
+    std::optional<Milliseconds> cadence() const { return cadence_; }
+
+    // A new document arrived at `now` (`now_ms` on the wall clock), generated
+    // at `generated_ms` if known.
+    void modified(Clock::time_point now, int64_t now_ms, std::optional<int64_t> generated_ms) {
+        retries_ = 0;
+        modified_at_ = now;
+        if (generated_ms && last_generated_ms_ && *generated_ms > *last_generated_ms_) {
+            gaps_[gap_count_++ % gaps_.size()] = Milliseconds(*generated_ms - *last_generated_ms_);
+            const auto filled = gaps_.begin() + static_cast<std::ptrdiff_t>(std::min(gap_count_, gaps_.size()));
+            cadence_ = std::clamp(*std::min_element(gaps_.begin(), filled), settings_.min_interval,
+                                  settings_.max_interval);
+        }
+        if (generated_ms) {
+            last_generated_ms_ = generated_ms;
+        }
+        if (!last_generated_ms_) {
+            next_ = now + settings_.max_interval;
+            return;
+        }
+        if (!cadence_) {
+            next_ = now + settings_.min_interval;
+            return;
+        }
+        // Steps from the last generation to the first regeneration that is
+        // still ahead.
+        int64_t expected_ms = *last_generated_ms_ + cadence_->count();
+        if (expected_ms <= now_ms) {
+            expected_ms += (now_ms - expected_ms) / cadence_->count() * cadence_->count() + cadence_->count();
+        }
+        Milliseconds wait = Milliseconds(expected_ms - now_ms) + settings_.settle + jitter(*cadence_);
+        next_ = now + std::clamp(wait, settings_.min_interval, settings_.max_interval);
+    }
+
+    void not_modified(Clock::time_point now) {
+        if (!cadence_ && last_generated_ms_ && now - modified_at_ < settings_.max_interval) {
+            next_ = now + settings_.min_interval;
+            return;
+        }
+        retry(now, cadence_.value_or(settings_.max_interval));
+    }
+
+    void failed(Clock::time_point now) { retry(now, settings_.max_interval); }
+
+private:
+    void retry(Clock::time_point now, Milliseconds limit) {
+        Milliseconds wait = settings_.min_interval * (int64_t(1) << std::min(retries_, 20u));
+        ++retries_;
+        next_ = now + std::clamp(wait, settings_.min_interval, std::max(limit, settings_.min_interval));
+    }
+
+    Milliseconds jitter(Milliseconds cadence) {
+        std::uniform_real_distribution<double> fraction(0.0, settings_.jitter);
+        return Milliseconds(static_cast<int64_t>(fraction(random_) * static_cast<double>(cadence.count())));
+    }
+
+    Settings settings_;
+    std::minstd_rand random_;
+    Clock::time_point next_{};
+    Clock::time_point modified_at_{};
+    std::optional<int64_t> last_generated_ms_;
+    std::array<Milliseconds, 8> gaps_{};
+    size_t gap_count_ = 0;
+    std::optional<Milliseconds> cadence_;
+    unsigned retries_ = 0;
+};
+
+} // namespace schedule
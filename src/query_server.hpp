@@ -0,0 +1,602 @@
+#pragma once
+
+#include <netdb.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <charconv>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "aggregate_state.hpp"
+#include "iso8601.hpp"
+#include "json.hpp"
+#include "live_window.hpp"
+#include "record_batch.hpp"
+#include "reports.hpp"
+#include "spatial_index.hpp"
+#include "units.hpp"
+
+namespace query {
+
+using columnar::RecordBatch;
+
+// A request the server turns down with a 400, e.g. for a malformed
+// parameter.
+class BadRequest : public std::invalid_argument {
+public:
+    using std::invalid_argument::invalid_argument;
+};
+
+// Which events of a snapshot a query is about: event time at or after
+// from_ms, and the magnitude and area when set.
+struct Filter {
+    int64_t from_ms = 0;
+    std::optional<double> min_magnitude;
+    std::optional<reports::Region> area;
+    // For /events, the most events listed.
+    size_t limit = 100;
+};
+
+inline std::string percent_decode(std::string_view text) {
+    auto hex = [](char ch) {
+        if (ch >= '0' && ch <= '9') {
+            return ch - '0';
+        }
+        if (ch >= 'a' && ch <= 'f') {
+            return ch - 'a' + 10;
+        }
+        if (ch >= 'A' && ch <= 'F') {
+            return ch - 'A' + 10;
+        }
+        return -1;
+    };
+    std::string out;
+    out.reserve(text.size());
+    for (size_t i = 0; i < text.size(); ++i) {
+        if (text[i] == '+') {
+            out += ' ';
+        } else if (text[i] != '%') {
+            out += text[i];
+        } else if (i + 2 < text.size() && hex(text[i + 1]) >= 0 && hex(text[i + 2]) >= 0) {
+            out += static_cast<char>(hex(text[i + 1]) * 16 + hex(text[i + 2]));
+            i += 2;
+        } else {
+            throw BadRequest("Malformed escape in query");
+        }
+    }
+    return out;
+}
+
+// Reads the parameters of a query string: since=<duration> (at most the
+// window; the whole window when absent), min_magnitude=<magnitude>,
+// area=<area> as --region takes it, and limit=<count>.
+inline Filter parse_filter(std::string_view query, const live::Snapshot &snapshot, int64_t span_ms,
+                           int64_t now_ms) {
+    Filter filter;
+    filter.from_ms = now_ms - span_ms;
+    while (!query.empty()) {
+        size_t amp = query.find('&');
+        std::string_view pair = query.substr(0, amp);
+        query.remove_prefix(amp == std::string_view::npos ? query.size() : amp + 1);
+        if (pair.empty()) {
+            continue;
+        }
+        size_t equals = pair.find('=');
+        std::string name = percent_decode(pair.substr(0, equals));
+        std::string value = equals == std::string_view::npos ? std::string() : percent_decode(pair.substr(equals + 1));
+        try {
+            if (name == "since") {
+                int64_t since_ms = std::chrono::milliseconds(units::parse_duration(value, name)).count();
+                if (since_ms > span_ms) {
+                    throw BadRequest("since exceeds the window of " + std::to_string(span_ms / 1000) + " s");
+                }
+                filter.from_ms = now_ms - since_ms;
+            } else if (name == "min_magnitude") {
+                double magnitude = 0.0;
+                auto [end, ec] = std::from_chars(value.data(), value.data() + value.size(), magnitude);
+                if (value.empty() || ec != std::errc() || end != value.data() + value.size() ||
+                    !std::isfinite(magnitude)) {
+                    throw BadRequest("Invalid magnitude for " + name);
+                }
+                filter.min_magnitude = magnitude;
+            } else if (name == "area") {
+                filter.area = reports::parse_area(value);
+                if (!filter.area) {
+                    throw BadRequest("Invalid area: " + value);
+                }
+            } else if (name == "limit") {
+                filter.limit = units::parse_count(value, name);
+            } else {
+                throw BadRequest("Unknown parameter " + name);
+            }
+        } catch (const std::invalid_argument &ex) {
+            throw BadRequest(ex.what());
+        }
+    }
+    // Rows from before the window may linger in a snapshot published a
+    // while ago; they are not part of any answer.
+    filter.from_ms = std::max(filter.from_ms, snapshot.from_ms);
+    return filter;
+}
+
+// Calls visit(row) for every row of the snapshot that `filter` selects, in
+// time order. Only rows from filter.from_ms on are looked at. With an area,
+// the grid is used when the cells it overlaps hold fewer events than that
+// time range, as for a small area; a large area over a short time range is
+// cheaper to scan.
+template <typename Visit>
+void visit_matches(const live::Snapshot &snapshot, const Filter &filter, Visit visit) {
+    const RecordBatch &events = snapshot.events;
+    const double *magnitudes = events.magnitude().values();
+    const double *latitudes = events.latitude().values();
+    const size_t first = snapshot.lower_bound(filter.from_ms);
+    auto selected = [&](size_t row) {
+        return !filter.min_magnitude || (events.magnitude().has_value(row) && magnitudes[row] >= *filter.min_magnitude);
+    };
+    if (filter.area && snapshot.grid) {
+        const reports::Region &area = *filter.area;
+        const spatial::GridIndex &grid = *snapshot.grid;
+        const size_t candidates = area.box ? grid.candidates_in_box(*area.box)
+                                           : grid.candidates_in_radius(area.lat, area.lon, area.radius_km);
+        if (candidates < events.size() - first) {
+            // The grid visits rows cell by cell; rows are numbered in time
+            // order.
+            std::vector<size_t> rows;
+            auto collect = [&](size_t row) {
+                if (row >= first && selected(row)) {
+                    rows.push_back(row);
+                }
+            };
+            if (area.box) {
+                grid.within_box(*area.box, collect);
+            } else {
+                grid.within_radius(area.lat, area.lon, area.radius_km, collect);
+            }
+            std::sort(rows.begin(), rows.end());
+            for (size_t row : rows) {
+                visit(row);
+            }
+            return;
+        }
+    }
+    // A circle lies within a band of latitude, which rules out most rows
+    // before the haversine is computed.
+    double south = -90.0;
+    double north = 90.0;
+    if (filter.area && !filter.area->box) {
+        const double margin = spatial::degrees(filter.area->radius_km / spatial::kEarthRadiusKm);
+        south = filter.area->lat - margin;
+        north = filter.area->lat + margin;
+    }
+    for (size_t row = first; row < events.size(); ++row) {
+        if (!selected(row)) {
+            continue;
+        }
+        if (filter.area && !(events.latitude().has_value(row) && events.longitude().has_value(row) &&
+                             latitudes[row] >= south && latitudes[row] <= north &&
+                             reports::contains(*filter.area, latitudes[row], events.longitude().values()[row]))) {
+            continue;
+        }
+        visit(row);
+    }
+}
+
+namespace detail {
+
+inline void append_optional(std::string &out, const std::optional<double> &value) {
+    if (value) {
+        simplejson::append_number(out, *value);
+    } else {
+        out += "null";
+    }
+}
+
+inline void append_time(std::string &out, int64_t time_ms) {
+    iso8601::Formatter timestamps;
+    iso8601::Buffer buffer;
+    simplejson::append_string(out, timestamps.format(time_ms, buffer));
+}
+
+// "as_of" and "from" fields, shared by the filtered answers.
+inline void append_span(std::string &out, const live::Snapshot &snapshot, const Filter &filter) {
+    out += "\"as_of\":";
+    append_time(out, snapshot.published_ms);
+    out += ",\"from\":";
+    append_time(out, filter.from_ms);
+}
+
+inline void append_bins(std::string &out, const std::vector<double> &edges, const std::vector<uint64_t> &counts) {
+    out += '[';
+    for (size_t bin = 0; bin < counts.size(); ++bin) {
+        out += bin == 0 ? "{\"bin\":" : ",{\"bin\":";
+        simplejson::append_string(out, reports::bin_label(edges, bin));
+        out += ",\"count\":";
+        out += std::to_string(counts[bin]);
+        out += '}';
+    }
+    out += ']';
+}
+
+inline void append_stats(std::string &out, const aggregate::Stats &stats) {
+    out += "{\"min\":";
+    append_optional(out, stats.count > 0 ? std::optional<double>(stats.min) : std::nullopt);
+    out += ",\"max\":";
+    append_optional(out, stats.count > 0 ? std::optional<double>(stats.max) : std::nullopt);
+    out += ",\"mean\":";
+    append_optional(out, stats.mean());
+    out += '}';
+}
+
+inline void append_summary(std::string &out, const aggregate::Summary &summary, const std::vector<double> &edges) {
+    out += "{\"events\":";
+    out += std::to_string(summary.events);
+    out += ",\"magnitude\":";
+    append_stats(out, summary.magnitude);
+    out += ",\"depth_km\":";
+    append_stats(out, summary.depth_km);
+    out += ",\"bins\":";
+    append_bins(out, edges, summary.buckets);
+    out += '}';
+}
+
+inline void append_event(std::string &out, const RecordBatch &events, size_t row) {
+    out += "{\"id\":";
+    simplejson::append_string(out, events.ids()[row]);
+    out += ",\"time\":";
+    append_time(out, events.time_ms()[row]);
+    out += ",\"updated\":";
+    append_time(out, events.updated_ms()[row]);
+    out += ",\"magnitude\":";
+    append_optional(out, events.magnitude()[row]);
+    out += ",\"place\":";
+    simplejson::append_string(out, events.places()[row]);
+    out += ",\"longitude\":";
+    append_optional(out, events.longitude()[row]);
+    out += ",\"latitude\":";
+    append_optional(out, events.latitude()[row]);
+    out += ",\"depth_km\":";
+    append_optional(out, events.depth_km()[row]);
+    out += '}';
+}
+
+} // namespace detail
+
+// An answer: the HTTP status and a JSON body.
+struct Response {
+    int status = 200;
+    std::string body;
+};
+
+// Answers the request for `target` (path and query string) from `snapshot`:
+//   /count      how many events match
+//   /histogram  the matching events per report.csv magnitude bin
+//   /events     the latest `limit` matching events, newest first
+//   /summary    the aggregates of summary.csv's rolling windows and of all
+//               time, as of the snapshot's publish; takes no parameters
+inline Response answer(const live::Snapshot &snapshot, std::string_view target, int64_t span_ms, int64_t now_ms) {
+    size_t question = target.find('?');
+    std::string_view path = target.substr(0, question);
+    std::string_view parameters = question == std::string_view::npos ? std::string_view() : target.substr(question + 1);
+    Response response;
+    std::string &out = response.body;
+    try {
+        if (path == "/summary") {
+            if (!parameters.empty()) {
+                throw BadRequest("/summary takes no parameters");
+            }
+            const std::vector<double> &edges = snapshot.aggregates.edges();
+            out = "{\"as_of\":";
+            detail::append_time(out, snapshot.published_ms);
+            for (const reports::ReportWindow &window : reports::kReportWindows) {
+                out += ",\"";
+                out += window.name;
+                out += "\":";
+                detail::append_summary(out, snapshot.aggregates.window(snapshot.published_ms, window.hours), edges);
+            }
+            out += ",\"all_time\":";
+            detail::append_summary(out, snapshot.aggregates.totals(), edges);
+            out += "}\n";
+            return response;
+        }
+        if (path != "/count" && path != "/histogram" && path != "/events") {
+            response.status = 404;
+            out = "{\"error\":\"Not found\"}\n";
+            return response;
+        }
+        const Filter filter = parse_filter(parameters, snapshot, span_ms, now_ms);
+        const RecordBatch &events = snapshot.events;
+        out = "{";
+        detail::append_span(out, snapshot, filter);
+        if (path == "/count") {
+            uint64_t count = 0;
+            visit_matches(snapshot, filter, [&](size_t) { ++count; });
+            out += ",\"count\":";
+            out += std::to_string(count);
+        } else if (path == "/histogram") {
+            const std::vector<double> &edges = reports::report_bins().edges();
+            std::vector<uint64_t> counts(edges.size() + 1, 0);
+            uint64_t count = 0;
+            uint64_t without_magnitude = 0;
+            visit_matches(snapshot, filter, [&](size_t row) {
+                ++count;
+                if (!events.magnitude().has_value(row)) {
+                    ++without_magnitude;
+                    return;
+                }
+                double magnitude = events.magnitude().values()[row];
+                ++counts[static_cast<size_t>(std::upper_bound(edges.begin(), edges.end(), magnitude) - edges.begin())];
+            });
+            out += ",\"count\":";
+            out += std::to_string(count);
+            out += ",\"without_magnitude\":";
+            out += std::to_string(without_magnitude);
+            out += ",\"bins\":";
+            detail::append_bins(out, edges, counts);
+        } else {
+            std::vector<size_t> rows;
+            visit_matches(snapshot, filter, [&](size_t row) { rows.push_back(row); });
+            out += ",\"count\":";
+            out += std::to_string(rows.size());
+            out += ",\"events\":[";
+            const size_t listed = std::min(rows.size(), filter.limit);
+            for (size_t i = 0; i < listed; ++i) {
+                if (i > 0) {
+                    out += ',';
+                }
+                detail::append_event(out, events, rows[rows.size() - 1 - i]);
+            }
+            out += ']';
+        }
+        out += "}\n";
+    } catch (const BadRequest &ex) {
+        response.status = 400;
+        out = "{\"error\":";
+        simplejson::append_string(out, ex.what());
+        out += "}\n";
+    }
+    return response;
+}
+
+// Serves answer() over HTTP/1.1 GET requests on `address`: a port on
+// 127.0.0.1, <host>:<port>, or unix:<path> for a Unix domain socket (a
+// stale socket file left at the path is replaced). Each query loads the
+// window's current snapshot, so it neither waits for nor holds up the
+// pipeline; requests are answered one at a time on the server's thread,
+// one per connection. A connection gets kRequestTimeout in all to send its
+// request and take the answer, and is dropped when that runs out, so a
+// client trickling bytes cannot hold the others up for longer.
+class Server {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    static constexpr auto kRequestTimeout = std::chrono::seconds(2);
+    static constexpr size_t kMaxRequestBytes = 8192;
+
+    Server(const std::string &address, const live::Window &window) : window_(window), address_(address) {
+        if (address.compare(0, 5, "unix:") == 0) {
+            listen_unix(address.substr(5));
+        } else {
+            listen_tcp(address);
+        }
+        thread_ = std::thread([this] { run(); });
+    }
+
+    ~Server() {
+        stop_.store(true);
+        thread_.join();
+        ::close(listener_);
+        if (!unix_path_.empty()) {
+            ::unlink(unix_path_.c_str());
+        }
+    }
+
+    Server(const Server &) = delete;
+    Server &operator=(const Server &) = delete;
+
+private:
+    void listen_tcp(const std::string &address) {
+        size_t colon = address.rfind(':');
+        std::string host = colon == std::string::npos ? "127.0.0.1" : address.substr(0, colon);
+        std::string port = colon == std::string::npos ? address : address.substr(colon + 1);
+        if (host.size() >= 2 && host.front() == '[' && host.back() == ']') {
+            host = host.substr(1, host.size() - 2);
+        }
+        addrinfo hints{};
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = AI_PASSIVE | AI_NUMERICSERV;
+        addrinfo *found = nullptr;
+        int error = ::getaddrinfo(host.c_str(), port.c_str(), &hints, &found);
+        if (error != 0) {
+            throw std::runtime_error("Failed to resolve " + address_ + ": " + ::gai_strerror(error));
+        }
+        int last_errno = 0;
+        for (addrinfo *candidate = found; candidate && listener_ < 0; candidate = candidate->ai_next) {
+            listener_ = ::socket(candidate->ai_family, candidate->ai_socktype | SOCK_CLOEXEC, candidate->ai_protocol);
+            if (listener_ < 0) {
+                last_errno = errno;
+                continue;
+            }
+            int reuse = 1;
+            ::setsockopt(listener_, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+            if (::bind(listener_, candidate->ai_addr, candidate->ai_addrlen) != 0 || ::listen(listener_, 16) != 0) {
+                last_errno = errno;
+                ::close(listener_);
+                listener_ = -1;
+            }
+        }
+        ::freeaddrinfo(found);
+        if (listener_ < 0) {
+            throw std::system_error(last_errno, std::generic_category(), "Failed to listen on " + address_);
+        }
+    }
+
+    void listen_unix(const std::string &path) {
+        sockaddr_un socket_address{};
+        if (path.empty() || path.size() >= sizeof(socket_address.sun_path)) {
+            throw std::runtime_error("Invalid socket path " + path);
+        }
+        socket_address.sun_family = AF_UNIX;
+        std::memcpy(socket_address.sun_path, path.c_str(), path.size() + 1);
+        struct stat existing {};
+        if (::lstat(path.c_str(), &existing) == 0 && S_ISSOCK(existing.st_mode)) {
+            ::unlink(path.c_str());
+        }
+        listener_ = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (listener_ < 0 ||
+            ::bind(listener_, reinterpret_cast<const sockaddr *>(&socket_address), sizeof(socket_address)) != 0 ||
+            ::listen(listener_, 16) != 0) {
+            int error = errno;
+            if (listener_ >= 0) {
+                ::close(listener_);
+            }
+            throw std::system_error(error, std::generic_category(), "Failed to listen on " + address_);
+        }
+        unix_path_ = path;
+    }
+
+    // Waits for connections in slices, so that the destructor is noticed.
+    void run() {
+        constexpr int kSliceMs = 200;
+        while (!stop_.load()) {
+            pollfd ready{listener_, POLLIN, 0};
+            if (::poll(&ready, 1, kSliceMs) <= 0 || !(ready.revents & POLLIN)) {
+                continue;
+            }
+            int client = ::accept4(listener_, nullptr, nullptr, SOCK_CLOEXEC);
+            if (client < 0) {
+                continue;
+            }
+            try {
+                serve(client);
+            } catch (const std::exception &ex) {
+                std::cerr << "Error answering a query: " << ex.what() << std::endl;
+            }
+            ::close(client);
+        }
+    }
+
+    void serve(int client) {
+        const Clock::time_point deadline = Clock::now() + kRequestTimeout;
+
+        // Only the request line matters, but the headers are read too so
+        // the client is not reset while still sending them.
+        std::string request;
+        char buffer[2048];
+        while (request.find("\r\n\r\n") == std::string::npos && request.find("\n\n") == std::string::npos) {
+            if (request.size() > kMaxRequestBytes) {
+                send(client, 431, "{\"error\":\"Request too large\"}\n", deadline);
+                return;
+            }
+            if (!wait(client, POLLIN, deadline)) {
+                return;
+            }
+            ssize_t got = ::recv(client, buffer, sizeof(buffer), MSG_DONTWAIT);
+            if (got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+                continue;
+            }
+            if (got <= 0) {
+                return;
+            }
+            request.append(buffer, static_cast<size_t>(got));
+        }
+        std::string_view line(request);
+        line = line.substr(0, line.find('\n'));
+        if (!line.empty() && line.back() == '\r') {
+            line.remove_suffix(1);
+        }
+        size_t first = line.find(' ');
+        size_t second = first == std::string_view::npos ? first : line.find(' ', first + 1);
+        if (second == std::string_view::npos || line.compare(second + 1, 5, "HTTP/") != 0) {
+            send(client, 400, "{\"error\":\"Malformed request\"}\n", deadline);
+            return;
+        }
+        if (line.substr(0, first) != "GET") {
+            send(client, 405, "{\"error\":\"Only GET is supported\"}\n", deadline);
+            return;
+        }
+        std::shared_ptr<const live::Snapshot> snapshot = window_.snapshot();
+        const int64_t now_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                                   std::chrono::system_clock::now().time_since_epoch())
+                                   .count();
+        Response response =
+            answer(*snapshot, line.substr(first + 1, second - first - 1), window_.span().count(), now_ms);
+        send(client, response.status, response.body, deadline);
+    }
+
+    // Waits until `client` is ready for `events`; false once `deadline`
+    // has passed first.
+    static bool wait(int client, short events, Clock::time_point deadline) {
+        while (true) {
+            const auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - Clock::now());
+            if (left.count() <= 0) {
+                return false;
+            }
+            pollfd ready{client, events, 0};
+            int result = ::poll(&ready, 1, static_cast<int>(left.count()));
+            if (result > 0) {
+                return true;
+            }
+            if (result < 0 && errno != EINTR) {
+                return false;
+            }
+        }
+    }
+
+    static void send(int client, int status, std::string_view body, Clock::time_point deadline) {
+        const char *reason = status == 200   ? "OK"
+                             : status == 400 ? "Bad Request"
+                             : status == 404 ? "Not Found"
+                             : status == 405 ? "Method Not Allowed"
+                                             : "Request Header Fields Too Large";
+        std::string out = "HTTP/1.1 " + std::to_string(status) + " " + reason +
+                          "\r\nContent-Type: application/json\r\nContent-Length: " + std::to_string(body.size()) +
+                          "\r\nConnection: close\r\n";
+        if (status == 405) {
+            out += "Allow: GET\r\n";
+        }
+        out += "\r\n";
+        out += body;
+        for (size_t sent = 0; sent < out.size();) {
+            if (!wait(client, POLLOUT, deadline)) {
+                return;
+            }
+            ssize_t wrote = ::send(client, out.data() + sent, out.size() - sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+            if (wrote < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+                continue;
+            }
+            if (wrote <= 0) {
+                return;
+            }
+            sent += static_cast<size_t>(wrote);
+        }
+    }
+
+    const live::Window &window_;
+    const std::string address_;
+    int listener_ = -1;
+    std::string unix_path_;
+    std::atomic<bool> stop_{false};
+    std::thread thread_;
+};
+
+} // namespace query
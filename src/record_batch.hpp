@@ -0,0 +1,236 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace columnar {
+
+// One earthquake event while it is being assembled, e.g. by a parser. Times
+// are kept as UTC milliseconds since the epoch and only rendered as ISO 8601
+// when written out.
+struct Row {
+    std::string id;
+    int64_t time_ms = 0;
+    // Last revision time reported by the feed; equals time_ms when absent.
+    int64_t updated_ms = 0;
+    std::optional<double> magnitude;
+    std::string place;
+    std::optional<double> longitude;
+    std::optional<double> latitude;
+    std::optional<double> depth_km;
+    // properties.tsunami, 1 when a tsunami may follow. Only alerts read it;
+    // RecordBatch does not keep it.
+    int64_t tsunami = 0;
+
+    // Empties the row but keeps the strings' capacity for the next one.
+    void clear() {
+        id.clear();
+        time_ms = 0;
+        updated_ms = 0;
+        magnitude.reset();
+        place.clear();
+        longitude.reset();
+        latitude.reset();
+        depth_km.reset();
+        tsunami = 0;
+    }
+};
+
+// One bit per row, set when the row has a value.
+class Validity {
+public:
+    void reserve(size_t rows) {
+        words_.reserve((rows + 63) / 64);
+    }
+
+    void push_back(bool valid) {
+        if (size_ % 64 == 0) {
+            words_.push_back(0);
+        }
+        if (valid) {
+            words_.back() |= uint64_t{1} << (size_ % 64);
+        }
+        ++size_;
+    }
+
+    bool operator[](size_t row) const {
+        return (words_[row / 64] >> (row % 64)) & 1;
+    }
+
+    size_t size() const { return size_; }
+
+    void clear() {
+        words_.clear();
+        size_ = 0;
+    }
+
+    // Bit i % 64 of word i / 64 is row i; bits past size() are zero.
+    const uint64_t *words() const { return words_.data(); }
+
+private:
+    std::vector<uint64_t> words_;
+    size_t size_ = 0;
+};
+
+// Values with a validity bitmap. Missing values are stored as T{} so the
+// value array can be scanned without consulting the bitmap first.
+template <typename T>
+class NullableColumn {
+public:
+    void reserve(size_t rows) {
+        values_.reserve(rows);
+        valid_.reserve(rows);
+    }
+
+    void push_back(const std::optional<T> &value) {
+        values_.push_back(value.value_or(T{}));
+        valid_.push_back(value.has_value());
+    }
+
+    std::optional<T> operator[](size_t row) const {
+        if (!valid_[row]) {
+            return std::nullopt;
+        }
+        return values_[row];
+    }
+
+    void clear() {
+        values_.clear();
+        valid_.clear();
+    }
+
+    bool has_value(size_t row) const { return valid_[row]; }
+    size_t size() const { return values_.size(); }
+    const T *values() const { return values_.data(); }
+    const Validity &validity() const { return valid_; }
+
+private:
+    std::vector<T> values_;
+    Validity valid_;
+};
+
+// Strings stored back to back in one heap; row i spans
+// [offsets[i], offsets[i + 1]).
+class StringColumn {
+public:
+    void reserve(size_t rows, size_t bytes) {
+        offsets_.reserve(rows + 1);
+        heap_.reserve(bytes);
+    }
+
+    void push_back(std::string_view value) {
+        if (heap_.size() + value.size() > UINT32_MAX) {
+            throw std::length_error("String column exceeds 4 GiB");
+        }
+        heap_.append(value);
+        offsets_.push_back(static_cast<uint32_t>(heap_.size()));
+    }
+
+    std::string_view operator[](size_t row) const {
+        return std::string_view(heap_).substr(offsets_[row], offsets_[row + 1] - offsets_[row]);
+    }
+
+    size_t size() const { return offsets_.size() - 1; }
+    size_t heap_size() const { return heap_.size(); }
+
+    void clear() {
+        heap_.clear();
+        offsets_.assign(1, 0);
+    }
+
+private:
+    std::string heap_;
+    std::vector<uint32_t> offsets_{0};
+};
+
+// Events stored column by column. Scans such as the magnitude histogram
+// read one contiguous array instead of striding over whole rows, and a
+// batch holds no per-row heap allocations.
+class RecordBatch {
+public:
+    // `string_bytes` is the expected total size of ids and places.
+    void reserve(size_t rows, size_t string_bytes = 0) {
+        ids_.reserve(rows, string_bytes / 2);
+        time_ms_.reserve(rows);
+        updated_ms_.reserve(rows);
+        magnitude_.reserve(rows);
+        places_.reserve(rows, string_bytes / 2);
+        longitude_.reserve(rows);
+        latitude_.reserve(rows);
+        depth_km_.reserve(rows);
+    }
+
+    void append(const Row &row) {
+        ids_.push_back(row.id);
+        time_ms_.push_back(row.time_ms);
+        updated_ms_.push_back(row.updated_ms);
+        magnitude_.push_back(row.magnitude);
+        places_.push_back(row.place);
+        longitude_.push_back(row.longitude);
+        latitude_.push_back(row.latitude);
+        depth_km_.push_back(row.depth_km);
+    }
+
+    // Copies row `row` of `other`.
+    void append(const RecordBatch &other, size_t row) {
+        ids_.push_back(other.ids_[row]);
+        time_ms_.push_back(other.time_ms_[row]);
+        updated_ms_.push_back(other.updated_ms_[row]);
+        magnitude_.push_back(other.magnitude_[row]);
+        places_.push_back(other.places_[row]);
+        longitude_.push_back(other.longitude_[row]);
+        latitude_.push_back(other.latitude_[row]);
+        depth_km_.push_back(other.depth_km_[row]);
+    }
+
+    // Copies every row of `other`.
+    void append(const RecordBatch &other) {
+        reserve(size() + other.size(), ids_.heap_size() + places_.heap_size() + other.ids_.heap_size() +
+                                           other.places_.heap_size());
+        for (size_t row = 0; row < other.size(); ++row) {
+            append(other, row);
+        }
+    }
+
+    size_t size() const { return time_ms_.size(); }
+    bool empty() const { return time_ms_.empty(); }
+
+    // Removes every row, keeping the columns' capacity. Also makes a batch
+    // that was moved from usable again.
+    void clear() {
+        ids_.clear();
+        time_ms_.clear();
+        updated_ms_.clear();
+        magnitude_.clear();
+        places_.clear();
+        longitude_.clear();
+        latitude_.clear();
+        depth_km_.clear();
+    }
+
+    const StringColumn &ids() const { return ids_; }
+    const std::vector<int64_t> &time_ms() const { return time_ms_; }
+    const std::vector<int64_t> &updated_ms() const { return updated_ms_; }
+    const NullableColumn<double> &magnitude() const { return magnitude_; }
+    const StringColumn &places() const { return places_; }
+    const NullableColumn<double> &longitude() const { return longitude_; }
+    const NullableColumn<double> &latitude() const { return latitude_; }
+    const NullableColumn<double> &depth_km() const { return depth_km_; }
+
+private:
+    StringColumn ids_;
+    std::vector<int64_t> time_ms_;
+    std::vector<int64_t> updated_ms_;
+    NullableColumn<double> magnitude_;
+    StringColumn places_;
+    NullableColumn<double> longitude_;
+    NullableColumn<double> latitude_;
+    NullableColumn<double> depth_km_;
+};
+
+} // namespace columnar
@@ -0,0 +1,261 @@
+#pragma once
+
+#include <array>
+#include <charconv>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <optional>
+#include <ratio>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <vector>
+
+#include "aggregate_state.hpp"
+#include "csv_writer.hpp"
+#include "histogram.hpp"
+#include "iso8601.hpp"
+#include "record_batch.hpp"
+#include "spatial_index.hpp"
+#include "thread_pool.hpp"
+
+namespace reports {
+
+using columnar::RecordBatch;
+
+// Number formats for the CSV columns. Coordinates and depth can be pinned
+// to a fixed number of decimals so every row has the same shape.
+struct CsvFormat {
+    csv::NumberFormat magnitude;
+    csv::NumberFormat coordinates;
+    csv::NumberFormat depth;
+};
+
+inline void append_records_to_csv(const RecordBatch &records, const std::filesystem::path &path,
+                                  const CsvFormat &format = {}) {
+    bool file_exists = std::filesystem::exists(path);
+    csv::Writer out(path, true);
+    if (!file_exists) {
+        for (const char *column : {"time_iso", "magnitude", "place", "longitude", "latitude", "depth_km"}) {
+            out.raw_field(column);
+        }
+        out.end_row();
+    }
+    iso8601::Formatter timestamps;
+    iso8601::Buffer time_iso;
+    for (size_t row = 0; row < records.size(); ++row) {
+        out.raw_field(timestamps.format(records.time_ms()[row], time_iso));
+        out.field(records.magnitude()[row], format.magnitude);
+        out.field(records.places()[row]);
+        out.field(records.longitude()[row], format.coordinates);
+        out.field(records.latitude()[row], format.coordinates);
+        out.field(records.depth_km()[row], format.depth);
+        out.end_row();
+    }
+    out.close();
+}
+
+// Magnitude bins of report.csv: <1.0, 1.0-1.9, ..., 7.0-7.9, >=8.0.
+using ReportBins = histogram::UniformBins<std::ratio<1>>;
+
+inline const ReportBins &report_bins() {
+    static const ReportBins bins(1.0, 7);
+    return bins;
+}
+
+inline std::string one_decimal(double value) {
+    char buffer[32];
+    auto [end, ec] = std::to_chars(buffer, buffer + sizeof(buffer), value, std::chars_format::fixed, 1);
+    return ec == std::errc() ? std::string(buffer, end) : std::string();
+}
+
+// Labels assume magnitudes with one decimal, so [1, 2) reads "1.0-1.9".
+inline std::string bin_label(const std::vector<double> &edges, std::size_t bin) {
+    if (bin == 0) {
+        return "<" + one_decimal(edges.front());
+    }
+    if (bin == edges.size()) {
+        return ">=" + one_decimal(edges.back());
+    }
+    return one_decimal(edges[bin - 1]) + "-" + one_decimal(edges[bin] - 0.1);
+}
+
+// Batches at least this large are counted on the pool, one partial
+// histogram per slice.
+constexpr std::size_t kParallelHistogramRows = 1 << 16;
+
+template <typename Bins>
+histogram::Histogram count_magnitudes(const RecordBatch &records, const Bins &bins, concurrency::ThreadPool &pool) {
+    const columnar::NullableColumn<double> &magnitudes = records.magnitude();
+    const std::size_t rows = magnitudes.size();
+    const std::size_t slices = rows < kParallelHistogramRows ? 1 : pool.size();
+    std::vector<histogram::Histogram> partials(slices, histogram::Histogram(bins.size()));
+    auto count_slice = [&](std::size_t slice) {
+        partials[slice].add(bins, magnitudes.values(), magnitudes.validity().words(), rows * slice / slices,
+                            rows * (slice + 1) / slices);
+    };
+    if (slices == 1) {
+        count_slice(0);
+    } else {
+        pool.parallel_for(slices, count_slice);
+    }
+    for (std::size_t slice = 1; slice < slices; ++slice) {
+        partials[0].merge(partials[slice]);
+    }
+    return partials[0];
+}
+
+// Rolling windows of report.csv and summary.csv, in hours of event time.
+struct ReportWindow {
+    const char *name;
+    int64_t hours;
+};
+constexpr std::array<ReportWindow, 3> kReportWindows{{{"24h", 24}, {"7d", 7 * 24}, {"30d", 30 * 24}}};
+
+// report.csv: per magnitude bin, the count in the records just fetched
+// ("count", as before), then the cumulative counts of the rolling windows
+// and of all time from the aggregate state. Only the first column touches
+// the records; the rest is O(bins) from the state.
+inline void write_report(const RecordBatch &records, const aggregate::State &state, int64_t now_ms,
+                  const std::filesystem::path &path, concurrency::ThreadPool &pool) {
+    const ReportBins &bins = report_bins();
+    histogram::Histogram counts = count_magnitudes(records, bins, pool);
+    std::vector<aggregate::Summary> windows;
+    for (const ReportWindow &window : kReportWindows) {
+        windows.push_back(state.window(now_ms, window.hours));
+    }
+
+    std::ofstream out(path, std::ios::trunc);
+    if (!out) {
+        throw std::runtime_error("Failed to open report.csv for writing");
+    }
+    out << "range,count";
+    for (const ReportWindow &window : kReportWindows) {
+        out << ",last_" << window.name;
+    }
+    out << ",all_time\n";
+    for (std::size_t i = 0; i < counts.size(); ++i) {
+        out << bin_label(bins.edges(), i) << ',' << counts[i];
+        for (const aggregate::Summary &summary : windows) {
+            out << ',' << summary.buckets[i];
+        }
+        out << ',' << state.totals().buckets[i] << "\n";
+    }
+}
+
+// summary.csv: event count and magnitude/depth range and mean for each
+// rolling window and for all time. Empty fields where nothing was counted.
+inline void write_summary(const aggregate::State &state, int64_t now_ms, const std::filesystem::path &path) {
+    csv::Writer out(path, false);
+    for (const char *column : {"window", "events", "magnitude_min", "magnitude_max", "magnitude_mean", "depth_km_min",
+                               "depth_km_max", "depth_km_mean"}) {
+        out.raw_field(column);
+    }
+    out.end_row();
+    auto write_stats = [&](const aggregate::Stats &stats) {
+        if (stats.count == 0) {
+            out.field(std::optional<double>());
+            out.field(std::optional<double>());
+        } else {
+            out.field(stats.min);
+            out.field(stats.max);
+        }
+        out.field(stats.mean(), csv::NumberFormat::fixed(3));
+    };
+    auto write_row = [&](std::string_view name, const aggregate::Summary &summary) {
+        out.raw_field(name);
+        out.raw_field(std::to_string(summary.events));
+        write_stats(summary.magnitude);
+        write_stats(summary.depth_km);
+        out.end_row();
+    };
+    for (const ReportWindow &window : kReportWindows) {
+        write_row(window.name, state.window(now_ms, window.hours));
+    }
+    write_row("all_time", state.totals());
+    out.close();
+}
+
+// An area named by --region: a circle of radius_km around (lat, lon), or a
+// bounding box.
+struct Region {
+    std::string name;
+    std::optional<spatial::Box> box;
+    double lat = 0.0;
+    double lon = 0.0;
+    double radius_km = 0.0;
+};
+
+inline bool contains(const Region &region, double lat, double lon) {
+    if (region.box) {
+        return spatial::in_box(*region.box, lat, lon);
+    }
+    return spatial::haversine_km(region.lat, region.lon, lat, lon) <= region.radius_km;
+}
+
+// Accepts <lat>,<lon>,<radius_km> for a circle or
+// <south>,<west>,<north>,<east> for a box; unset if `text` is neither.
+inline std::optional<Region> parse_area(std::string_view text) {
+    std::vector<double> numbers;
+    while (true) {
+        std::size_t comma = text.find(',');
+        std::string_view part = text.substr(0, comma);
+        double value = 0.0;
+        auto [end, ec] = std::from_chars(part.data(), part.data() + part.size(), value);
+        if (part.empty() || ec != std::errc() || end != part.data() + part.size() || !std::isfinite(value)) {
+            return std::nullopt;
+        }
+        numbers.push_back(value);
+        if (comma == std::string_view::npos) {
+            break;
+        }
+        text.remove_prefix(comma + 1);
+    }
+    Region area;
+    if (numbers.size() == 3 && numbers[2] > 0.0) {
+        area.lat = numbers[0];
+        area.lon = numbers[1];
+        area.radius_km = numbers[2];
+    } else if (numbers.size() == 4 && numbers[0] <= numbers[2]) {
+        area.box = spatial::Box{numbers[0], numbers[1], numbers[2], numbers[3]};
+    } else {
+        return std::nullopt;
+    }
+    return area;
+}
+
+// regions/<name>.csv: the magnitude bins of report.csv's count column for
+// the records just fetched that lie inside `region`. The grid finds them
+// without a pass over the records.
+inline void write_region_report(const RecordBatch &records, const spatial::GridIndex &grid, const Region &region,
+                         const std::filesystem::path &path) {
+    const ReportBins &bins = report_bins();
+    std::vector<double> magnitudes;
+    auto collect = [&](std::size_t row) {
+        if (records.magnitude().has_value(row)) {
+            magnitudes.push_back(records.magnitude().values()[row]);
+        }
+    };
+    if (region.box) {
+        grid.within_box(*region.box, collect);
+    } else {
+        grid.within_radius(region.lat, region.lon, region.radius_km, collect);
+    }
+    histogram::Histogram counts(bins.size());
+    counts.add(bins, magnitudes.data(), nullptr, 0, magnitudes.size());
+
+    std::ofstream out(path, std::ios::trunc);
+    if (!out) {
+        throw std::runtime_error("Failed to open " + path.string() + " for writing");
+    }
+    out << "range,count\n";
+    for (std::size_t i = 0; i < counts.size(); ++i) {
+        out << bin_label(bins.edges(), i) << ',' << counts[i] << "\n";
+    }
+}
+
+} // namespace reports
@@ -0,0 +1,115 @@
+#pragma once
+
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <filesystem>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#include "iso8601.hpp"
+
+namespace rotation {
+
+// When the live file is closed and a new one started. Either condition,
+// or both, may be set; with neither the file grows forever.
+struct Policy {
+    // Close the file on the first write of a new UTC day.
+    bool daily = false;
+    // Close the file once it holds at least this many bytes; 0 for no limit.
+    uint64_t max_bytes = 0;
+
+    bool enabled() const { return daily || max_bytes > 0; }
+};
+
+namespace detail {
+
+constexpr int64_t kMillisPerDay = 86400000;
+
+// "YYYY-MM-DD" of a UTC millisecond timestamp (expanded outside years 0-9999).
+inline std::string utc_date(int64_t millis_since_epoch) {
+    iso8601::Formatter formatter;
+    iso8601::Buffer buffer;
+    std::string_view timestamp = formatter.format(millis_since_epoch, buffer);
+    return std::string(timestamp.substr(0, timestamp.size() - iso8601::kTimeLength));
+}
+
+inline int64_t last_write_ms(const std::filesystem::path &path) {
+    struct stat info;
+    if (::stat(path.c_str(), &info) != 0) {
+        throw std::runtime_error("Failed to stat " + path.string());
+    }
+    return static_cast<int64_t>(info.st_mtim.tv_sec) * 1000 + info.st_mtim.tv_nsec / 1000000;
+}
+
+// <stem>-<date><suffix><extension> in the live file's directory, where the
+// suffix is empty for the day's first segment and "-2", "-3", ... after it.
+// A name is taken if either the segment or its compressed copy exists.
+inline std::filesystem::path segment_path(const std::filesystem::path &live, const std::string &date) {
+    const std::string stem = live.stem().string() + "-" + date;
+    const std::string extension = live.extension().string();
+    for (int number = 1;; ++number) {
+        std::filesystem::path candidate =
+            live.parent_path() / (stem + (number == 1 ? "" : "-" + std::to_string(number)) + extension);
+        std::filesystem::path compressed = candidate;
+        compressed += ".gz";
+        if (!std::filesystem::exists(candidate) && !std::filesystem::exists(compressed)) {
+            return candidate;
+        }
+    }
+}
+
+} // namespace detail
+
+// Closes `live` if `policy` says it is due before a write at `now_ms`: it is
+// renamed to a dated segment next to it, which is returned, and the next
+// write starts a new file. The date is that of the file's last write, which
+// under a daily policy is the day all its rows were written.
+inline std::optional<std::filesystem::path> rotate(const std::filesystem::path &live, const Policy &policy,
+                                                   int64_t now_ms) {
+    if (!policy.enabled()) {
+        return std::nullopt;
+    }
+    std::error_code error;
+    const std::uintmax_t size = std::filesystem::file_size(live, error);
+    if (error) {
+        return std::nullopt;
+    }
+    const int64_t written_ms = detail::last_write_ms(live);
+    const bool new_day = policy.daily && iso8601::floor_div(written_ms, detail::kMillisPerDay) !=
+                                             iso8601::floor_div(now_ms, detail::kMillisPerDay);
+    const bool full = policy.max_bytes > 0 && size >= policy.max_bytes;
+    if (!new_day && !full) {
+        return std::nullopt;
+    }
+    std::filesystem::path segment = detail::segment_path(live, detail::utc_date(written_ms));
+    std::filesystem::rename(live, segment);
+    return segment;
+}
+
+// Closed segments of `live` that were not compressed yet, for instance
+// because the process stopped first, in name order.
+inline std::vector<std::filesystem::path> uncompressed_segments(const std::filesystem::path &live) {
+    std::vector<std::filesystem::path> segments;
+    std::error_code error;
+    std::filesystem::directory_iterator entries(live.parent_path().empty() ? "." : live.parent_path(), error);
+    if (error) {
+        return segments;
+    }
+    const std::string prefix = live.stem().string() + "-";
+    for (const std::filesystem::directory_entry &entry : entries) {
+        const std::string name = entry.path().filename().string();
+        if (entry.is_regular_file(error) && name.compare(0, prefix.size(), prefix) == 0 &&
+            entry.path().extension() == live.extension()) {
+            segments.push_back(entry.path());
+        }
+    }
+    std::sort(segments.begin(), segments.end());
+    return segments;
+}
+
+} // namespace rotation
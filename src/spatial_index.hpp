@@ -0,0 +1,237 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <vector>
+
+#include "record_batch.hpp"
+
+namespace spatial {
+
+constexpr double kEarthRadiusKm = 6371.0088;
+constexpr double kPi = 3.14159265358979323846;
+
+// Latitudes south..north and longitudes west..east, in degrees. A box with
+// west > east crosses the antimeridian.
+struct Box {
+    double south;
+    double west;
+    double north;
+    double east;
+};
+
+inline double radians(double degrees) {
+    return degrees * (kPi / 180.0);
+}
+
+inline double degrees(double radians) {
+    return radians * (180.0 / kPi);
+}
+
+// Great-circle distance between two points, by the haversine formula.
+inline double haversine_km(double lat1, double lon1, double lat2, double lon2) {
+    double dlat = radians(lat2 - lat1);
+    double dlon = radians(lon2 - lon1);
+    double a = std::sin(dlat / 2) * std::sin(dlat / 2) +
+               std::cos(radians(lat1)) * std::cos(radians(lat2)) * std::sin(dlon / 2) * std::sin(dlon / 2);
+    return 2 * kEarthRadiusKm * std::asin(std::min(1.0, std::sqrt(a)));
+}
+
+// Maps a longitude to [-180, 180).
+inline double normalize_longitude(double lon) {
+    double wrapped = std::fmod(lon + 180.0, 360.0);
+    return (wrapped < 0 ? wrapped + 360.0 : wrapped) - 180.0;
+}
+
+inline bool in_box(const Box &box, double lat, double lon) {
+    if (lat < box.south || lat > box.north) {
+        return false;
+    }
+    return box.west <= box.east ? lon >= box.west && lon <= box.east : lon >= box.west || lon <= box.east;
+}
+
+// Events of a batch bucketed into a grid of equal latitude/longitude cells.
+// Cells are stored compressed, in the manner of a CSR matrix: the events of
+// cell c are entries [cell_start[c], cell_start[c + 1]), with their
+// coordinates copied next to the row numbers so a query reads only the
+// cells it overlaps. A query therefore costs the overlapped cells plus their
+// entries, not a pass over the batch. Events without both coordinates, or
+// with a latitude outside [-90, 90], are not indexed.
+//
+// The index refers to rows of the batch by number and does not keep the
+// batch itself.
+class GridIndex {
+public:
+    explicit GridIndex(const columnar::RecordBatch &records, double cell_degrees = 1.0)
+        : cell_degrees_(cell_degrees) {
+        if (!(cell_degrees > 0.0) || cell_degrees > 180.0) {
+            throw std::invalid_argument("Grid cells must be between 0 and 180 degrees");
+        }
+        lat_cells_ = static_cast<size_t>(std::ceil(180.0 / cell_degrees));
+        lon_cells_ = static_cast<size_t>(std::ceil(360.0 / cell_degrees));
+
+        // Counting sort by cell: count, prefix-sum into starts, scatter.
+        const columnar::NullableColumn<double> &latitude = records.latitude();
+        const columnar::NullableColumn<double> &longitude = records.longitude();
+        std::vector<uint32_t> cell_of(records.size());
+        cell_start_.assign(lat_cells_ * lon_cells_ + 1, 0);
+        constexpr uint32_t kSkipped = UINT32_MAX;
+        for (size_t row = 0; row < records.size(); ++row) {
+            double lat = latitude.values()[row];
+            if (!latitude.has_value(row) || !longitude.has_value(row) || !(lat >= -90.0 && lat <= 90.0) ||
+                !std::isfinite(longitude.values()[row])) {
+                cell_of[row] = kSkipped;
+                continue;
+            }
+            cell_of[row] = static_cast<uint32_t>(cell(lat, normalize_longitude(longitude.values()[row])));
+            ++cell_start_[cell_of[row] + 1];
+        }
+        for (size_t c = 1; c < cell_start_.size(); ++c) {
+            cell_start_[c] += cell_start_[c - 1];
+        }
+        const size_t indexed = cell_start_.back();
+        rows_.resize(indexed);
+        lat_.resize(indexed);
+        lon_.resize(indexed);
+        std::vector<uint32_t> next(cell_start_.begin(), cell_start_.end() - 1);
+        for (size_t row = 0; row < records.size(); ++row) {
+            if (cell_of[row] == kSkipped) {
+                continue;
+            }
+            uint32_t slot = next[cell_of[row]]++;
+            rows_[slot] = static_cast<uint32_t>(row);
+            lat_[slot] = latitude.values()[row];
+            lon_[slot] = normalize_longitude(longitude.values()[row]);
+        }
+    }
+
+    // Number of indexed events.
+    size_t size() const { return rows_.size(); }
+
+    // Calls visit(row) for every event inside `box` (edges included).
+    template <typename Visit>
+    void within_box(const Box &box, Visit visit) const {
+        const Box normalized = normalize(box);
+        for_cells(normalized, [&](size_t entry) {
+            if (in_box(normalized, lat_[entry], lon_[entry])) {
+                visit(static_cast<size_t>(rows_[entry]));
+            }
+        });
+    }
+
+    // Calls visit(row) for every event within `radius_km` of (lat, lon)
+    // along the Earth's surface.
+    template <typename Visit>
+    void within_radius(double lat, double lon, double radius_km, Visit visit) const {
+        for_cells(bounding_box(lat, lon, radius_km), [&](size_t entry) {
+            if (haversine_km(lat, lon, lat_[entry], lon_[entry]) <= radius_km) {
+                visit(static_cast<size_t>(rows_[entry]));
+            }
+        });
+    }
+
+    // How many indexed events within_box() and within_radius() would look
+    // at, which is cheap to compute: the entries of the cells they scan.
+    size_t candidates_in_box(const Box &box) const { return candidates(normalize(box)); }
+
+    size_t candidates_in_radius(double lat, double lon, double radius_km) const {
+        return candidates(bounding_box(lat, lon, radius_km));
+    }
+
+private:
+    static Box normalize(const Box &box) {
+        Box normalized{box.south, normalize_longitude(box.west), box.north, normalize_longitude(box.east)};
+        // A box spanning the whole circle would normalize to a single
+        // meridian; keep it whole.
+        if (box.east - box.west >= 360.0) {
+            normalized.west = -180.0;
+            normalized.east = 180.0;
+        }
+        return normalized;
+    }
+
+    // The cells a circle may overlap are those of its bounding box: the
+    // latitude band of the radius and, unless the circle reaches a pole,
+    // the widest longitude spread on that band.
+    static Box bounding_box(double lat, double lon, double radius_km) {
+        double angle = radius_km / kEarthRadiusKm;
+        double dlat = degrees(angle);
+        Box box{lat - dlat, -180.0, lat + dlat, 180.0};
+        double spread = std::sin(angle) / std::cos(radians(lat));
+        if (box.south > -90.0 && box.north < 90.0 && angle < kPi / 2 && spread < 1.0) {
+            double dlon = degrees(std::asin(spread));
+            box.west = normalize_longitude(lon - dlon);
+            box.east = normalize_longitude(lon + dlon);
+        }
+        return box;
+    }
+
+    size_t candidates(const Box &box) const {
+        size_t count = 0;
+        for_ranges(box, [&](size_t first, size_t last) { count += last - first; });
+        return count;
+    }
+
+    size_t lat_cell(double lat) const {
+        double index = std::floor((lat + 90.0) / cell_degrees_);
+        return static_cast<size_t>(std::clamp(index, 0.0, static_cast<double>(lat_cells_ - 1)));
+    }
+
+    size_t lon_cell(double lon) const {
+        double index = std::floor((lon + 180.0) / cell_degrees_);
+        return static_cast<size_t>(std::clamp(index, 0.0, static_cast<double>(lon_cells_ - 1)));
+    }
+
+    size_t cell(double lat, double lon) const {
+        return lat_cell(lat) * lon_cells_ + lon_cell(lon);
+    }
+
+    // Calls each(entry) for every entry of the cells overlapping `box`,
+    // whose longitudes must already be normalized.
+    template <typename Each>
+    void for_cells(const Box &box, Each each) const {
+        for_ranges(box, [&](size_t first, size_t last) {
+            for (size_t entry = first; entry < last; ++entry) {
+                each(entry);
+            }
+        });
+    }
+
+    // Calls range(first, last) for the entries of each grid row's cells
+    // overlapping `box`.
+    template <typename Range>
+    void for_ranges(const Box &box, Range range) const {
+        if (rows_.empty() || box.south > 90.0 || box.north < -90.0 || box.south > box.north) {
+            return;
+        }
+        size_t first_row = lat_cell(std::max(box.south, -90.0));
+        size_t last_row = lat_cell(std::min(box.north, 90.0));
+        auto scan = [&](size_t first_col, size_t last_col) {
+            for (size_t row = first_row; row <= last_row; ++row) {
+                // The cells of a grid row are contiguous, and so are their
+                // entries.
+                range(size_t(cell_start_[row * lon_cells_ + first_col]),
+                      size_t(cell_start_[row * lon_cells_ + last_col + 1]));
+            }
+        };
+        if (box.west <= box.east) {
+            scan(lon_cell(box.west), lon_cell(box.east));
+        } else {
+            scan(lon_cell(box.west), lon_cells_ - 1);
+            scan(0, lon_cell(box.east));
+        }
+    }
+
+    double cell_degrees_;
+    size_t lat_cells_ = 0;
+    size_t lon_cells_ = 0;
+    std::vector<uint32_t> cell_start_;
+    std::vector<uint32_t> rows_;
+    std::vector<double> lat_;
+    std::vector<double> lon_;
+};
+
+} // namespace spatial
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <optional>
+#include <utility>
+#include <vector>
+
+namespace concurrency {
+
+// Bounded single-producer single-consumer FIFO. One thread may push and one
+// other thread may pop, without locks: each side owns one index and
+// publishes it with a release store, so a slot is only ever touched by the
+// side that owns it at the time. The indices sit on separate cache lines,
+// and each side caches the other's index so that it reads the shared line
+// only when the ring looks full or empty.
+//
+// The queue never blocks; callers that need to wait build that on top.
+template <typename T>
+class SpscQueue {
+public:
+    // Holds at least `capacity` elements; rounded up to a power of two.
+    explicit SpscQueue(size_t capacity) : slots_(round_up(capacity)), mask_(slots_.size() - 1) {}
+
+    SpscQueue(const SpscQueue &) = delete;
+    SpscQueue &operator=(const SpscQueue &) = delete;
+
+    size_t capacity() const { return slots_.size(); }
+
+    // Producer only. Leaves `value` untouched and returns false when full.
+    bool try_push(T &value) {
+        size_t tail = tail_.load(std::memory_order_relaxed);
+        if (tail - head_cache_ == slots_.size()) {
+            head_cache_ = head_.load(std::memory_order_acquire);
+            if (tail - head_cache_ == slots_.size()) {
+                return false;
+            }
+        }
+        slots_[tail & mask_].emplace(std::move(value));
+        tail_.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer only.
+    std::optional<T> try_pop() {
+        size_t head = head_.load(std::memory_order_relaxed);
+        if (head == tail_cache_) {
+            tail_cache_ = tail_.load(std::memory_order_acquire);
+            if (head == tail_cache_) {
+                return std::nullopt;
+            }
+        }
+        std::optional<T> value = std::move(slots_[head & mask_]);
+        slots_[head & mask_].reset();
+        head_.store(head + 1, std::memory_order_release);
+        return value;
+    }
+
+    // Either side; exact only when the other side is idle.
+    bool empty() const { return head_.load(std::memory_order_acquire) == tail_.load(std::memory_order_acquire); }
+
+    bool full() const {
+        return tail_.load(std::memory_order_acquire) - head_.load(std::memory_order_acquire) == slots_.size();
+    }
+
+private:
+    static constexpr size_t kCacheLine = 64;
+
+    static size_t round_up(size_t capacity) {
+        size_t size = 1;
+        while (size < capacity) {
+            size *= 2;
+        }
+        return size;
+    }
+
+    std::vector<std::optional<T>> slots_;
+    const size_t mask_;
+    // Next slot to pop, written by the consumer.
+    alignas(kCacheLine) std::atomic<size_t> head_{0};
+    size_t tail_cache_ = 0;
+    // Next slot to push, written by the producer.
+    alignas(kCacheLine) std::atomic<size_t> tail_{0};
+    size_t head_cache_ = 0;
+};
+
+} // namespace concurrency
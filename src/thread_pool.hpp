@@ -0,0 +1,110 @@
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace concurrency {
+
+// Fixed set of worker threads draining a FIFO of tasks. Tasks must not
+// throw; callers that need to report failures capture them themselves.
+class ThreadPool {
+public:
+    static size_t default_size() {
+        return std::max<size_t>(1, std::thread::hardware_concurrency());
+    }
+
+    explicit ThreadPool(size_t threads = default_size()) {
+        workers_.reserve(threads);
+        for (size_t i = 0; i < threads; ++i) {
+            workers_.emplace_back([this] { work(); });
+        }
+    }
+
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    // Runs the tasks already queued, then joins the workers.
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        ready_.notify_all();
+        for (std::thread &worker : workers_) {
+            worker.join();
+        }
+    }
+
+    void submit(std::function<void()> task) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            tasks_.push_back(std::move(task));
+        }
+        ready_.notify_one();
+    }
+
+    // Runs body(0) ... body(count - 1) on the workers and waits for all of
+    // them, then rethrows the exception of the lowest index that failed.
+    // Must not be called from a pool task, which could deadlock the pool.
+    void parallel_for(size_t count, const std::function<void(size_t)> &body) {
+        std::vector<std::exception_ptr> errors(count);
+        std::mutex done_mutex;
+        std::condition_variable done;
+        size_t remaining = count;
+        for (size_t i = 0; i < count; ++i) {
+            submit([&, i] {
+                try {
+                    body(i);
+                } catch (...) {
+                    errors[i] = std::current_exception();
+                }
+                std::lock_guard<std::mutex> lock(done_mutex);
+                if (--remaining == 0) {
+                    done.notify_one();
+                }
+            });
+        }
+        std::unique_lock<std::mutex> lock(done_mutex);
+        done.wait(lock, [&] { return remaining == 0; });
+        for (std::exception_ptr &error : errors) {
+            if (error) {
+                std::rethrow_exception(error);
+            }
+        }
+    }
+
+    size_t size() const { return workers_.size(); }
+
+private:
+    void work() {
+        while (true) {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                ready_.wait(lock, [this] { return stopping_ || !tasks_.empty(); });
+                if (tasks_.empty()) {
+                    return;
+                }
+                task = std::move(tasks_.front());
+                tasks_.pop_front();
+            }
+            task();
+        }
+    }
+
+    std::mutex mutex_;
+    std::condition_variable ready_;
+    std::deque<std::function<void()>> tasks_;
+    bool stopping_ = false;
+    std::vector<std::thread> workers_;
+};
+
+} // namespace concurrency
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <charconv>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <system_error>
+
+namespace units {
+
+// Parsers for the durations, sizes and counts given on the command line
+// and in query server requests. `what` names the value in the error.
+
+// Accepts a number of seconds with an optional s/m/h/d suffix.
+inline std::chrono::seconds parse_duration(std::string_view text, const std::string &what) {
+    std::chrono::seconds::rep unit = 1;
+    if (!text.empty()) {
+        switch (text.back()) {
+            case 's': unit = 1; break;
+            case 'm': unit = 60; break;
+            case 'h': unit = 3600; break;
+            case 'd': unit = 86400; break;
+            default: unit = 0; break;
+        }
+        if (unit != 0) {
+            text.remove_suffix(1);
+        } else {
+            unit = 1;
+        }
+    }
+    std::chrono::seconds::rep count = 0;
+    auto [end, ec] = std::from_chars(text.data(), text.data() + text.size(), count);
+    if (text.empty() || ec != std::errc() || end != text.data() + text.size() || count <= 0 ||
+        count > std::numeric_limits<std::chrono::seconds::rep>::max() / unit) {
+        throw std::invalid_argument("Invalid duration for " + what);
+    }
+    return std::chrono::seconds(count * unit);
+}
+
+// Accepts a number of bytes with an optional K, M or G suffix (powers of
+// 1024).
+inline uint64_t parse_size(std::string_view text, const std::string &what) {
+    uint64_t unit = 1;
+    if (!text.empty()) {
+        switch (text.back()) {
+            case 'K': unit = uint64_t(1) << 10; break;
+            case 'M': unit = uint64_t(1) << 20; break;
+            case 'G': unit = uint64_t(1) << 30; break;
+            default: break;
+        }
+        if (unit != 1) {
+            text.remove_suffix(1);
+        }
+    }
+    uint64_t count = 0;
+    auto [end, ec] = std::from_chars(text.data(), text.data() + text.size(), count);
+    if (text.empty() || ec != std::errc() || end != text.data() + text.size() || count == 0 ||
+        count > std::numeric_limits<uint64_t>::max() / unit) {
+        throw std::invalid_argument("Invalid size for " + what);
+    }
+    return count * unit;
+}
+
+// Accepts a positive whole number.
+inline size_t parse_count(std::string_view text, const std::string &what) {
+    size_t count = 0;
+    auto [end, ec] = std::from_chars(text.data(), text.data() + text.size(), count);
+    if (text.empty() || ec != std::errc() || end != text.data() + text.size() || count == 0) {
+        throw std::invalid_argument("Invalid count for " + what);
+    }
+    return count;
+}
+
+} // namespace units